@@ -0,0 +1,326 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <queue>
+#include <string>
+#include <thread>
+#include <vector>
+#include <signal.h>
+#include <sys/signalfd.h>
+#include <unistd.h>
+#include <zmq.h>
+#include "client.hpp"
+#include "event_loop.hpp"
+
+// Merges the streams of several aircraft, each running mosley, into one
+// feed for the ground operators. Frames are fetched from every source
+// with a Client, put in capture-time order and published on a single
+// PUB socket as two parts: a topic naming the aircraft and camera, such
+// as "hawk/1", which subscribers can filter on, and the frame exactly
+// as mosley sent it.
+//
+// A frame is held until every source has delivered something newer, so
+// the feed is in time order as long as each source is, but never longer
+// than the hold time, so a source that falls silent only delays the
+// feed by that much. An optional total budget is shared fairly between
+// the sources: one that needs less than an even share keeps what it
+// uses and the rest is split among those that want more.
+//
+// To try it locally, start a few servers on synthetic sources:
+//
+//     mosley --synthetic --port 5600 &
+//     mosley --synthetic --port 5610 &
+//     aggregator --source tcp://localhost:5600 --source tcp://localhost:5610
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Options {
+    std::vector<std::string> names;
+    std::vector<std::string> endpoints;
+    std::string publish = "tcp://*:5570";
+    std::string command = "snap";
+    int window = 4;
+    double budget = 0;          // MB/s over all sources, 0 for no limit
+    int hold = 250;             // ms a frame may wait for other sources
+};
+
+class Aggregator {
+public:
+    static const int REPORT_SECONDS = 1;
+
+    Aggregator(Event_loop& loop, void* context, const Options& options)
+        : loop(loop), options(options),
+          publisher{zmq_socket(context, ZMQ_PUB)},
+          hold{std::chrono::milliseconds(options.hold)},
+          last_published{0}, published{0}, late{0}, running{true}
+    {
+        if (zmq_bind(publisher.get(), options.publish.c_str()) != 0)
+            throw std::runtime_error{"could not bind " + options.publish};
+
+        const double share = options.budget * 1e6 / options.endpoints.size();
+        for (size_t i = 0; i < options.endpoints.size(); ++i) {
+            sources.emplace_back(new Source);
+            Source& source = *sources.back();
+            source.name = options.names[i];
+            source.share = share;
+            source.client.reset(new Client{context, options.endpoints[i],
+                    options.window, options.command});
+        }
+        for (size_t i = 0; i < sources.size(); ++i)
+            sources[i]->fetcher = std::thread{&Aggregator::fetch, this, i};
+
+        loop.add_timer(hold / 4, [this] { release(); });
+        loop.add_timer(std::chrono::seconds(REPORT_SECONDS),
+                [this] { report(); });
+    }
+
+    ~Aggregator()
+    {
+        running = false;
+        for (auto& source : sources)
+            source->fetcher.join();
+    }
+
+    // Disallow copying and moving.
+    Aggregator(const Aggregator&) = delete;
+    Aggregator& operator=(const Aggregator&) = delete;
+
+private:
+    typedef std::shared_ptr<Client_frame> Frame_ref;
+
+    struct Source {
+        std::string name;
+        std::unique_ptr<Client> client;
+        std::thread fetcher;
+        std::atomic<double> share;  // bytes/s, 0 for no limit
+
+        // Only the loop thread touches these.
+        uint64_t newest = 0;        // latest capture time delivered
+        unsigned long frames = 0;   // since the last report
+        unsigned long long bytes = 0;
+    };
+
+    struct Held {
+        uint64_t timestamp;
+        size_t source;
+        Clock::time_point arrived;
+        Frame_ref frame;
+
+        // Orders the priority queue oldest first.
+        bool operator<(const Held& other) const
+        {
+            return timestamp > other.timestamp;
+        }
+    };
+
+    Event_loop& loop;
+    const Options options;
+    const Zmq_socket publisher;
+    const Clock::duration hold;
+    std::vector<std::unique_ptr<Source>> sources;
+
+    // Only the loop thread touches these.
+    std::priority_queue<Held> held;
+    uint64_t last_published;
+    unsigned long published;    // since the last report
+    unsigned long late;         // published out of order, in total
+
+    std::atomic<bool> running;
+
+    // Takes frames from one source and hands them to the loop. With a
+    // budget, the source is paced to its share: after each frame the
+    // next one is due once the frame's bytes have been paid for.
+    void fetch(size_t index)
+    {
+        Source& source = *sources[index];
+        auto due = Clock::now();
+        while (running) {
+            Client_frame received;
+            if (!source.client->next(received, 1000))
+                continue;
+            const Frame_ref frame = std::make_shared<Client_frame>(
+                    std::move(received));
+            loop.post([this, index, frame] { arrive(index, frame); });
+
+            const double share = source.share;
+            if (share > 0) {
+                const size_t size = zmq_msg_size(frame->message.get());
+                due = std::max(due, Clock::now())
+                    + std::chrono::duration_cast<Clock::duration>(
+                            std::chrono::duration<double>(size / share));
+                std::this_thread::sleep_until(due);
+            }
+        }
+    }
+
+    void arrive(size_t index, Frame_ref frame)
+    {
+        Source& source = *sources[index];
+        source.newest = std::max(source.newest, frame->timestamp);
+        ++source.frames;
+        source.bytes += zmq_msg_size(frame->message.get());
+        held.push(Held{frame->timestamp, index, Clock::now(), frame});
+        release();
+    }
+
+    // Publishes the held frames that no source can still precede, and
+    // any that have waited the hold time.
+    void release()
+    {
+        uint64_t watermark = UINT64_MAX;
+        for (const auto& source : sources)
+            watermark = std::min(watermark, source->newest);
+
+        const auto expired = Clock::now() - hold;
+        while (!held.empty() && (held.top().timestamp <= watermark
+                    || held.top().arrived <= expired)) {
+            const Held& next = held.top();
+            if (next.timestamp < last_published)
+                ++late;
+            last_published = std::max(last_published, next.timestamp);
+            publish(*sources[next.source], *next.frame);
+            held.pop();
+        }
+    }
+
+    // Sends the frame's own message on, so publishing copies nothing.
+    void publish(const Source& source, Client_frame& frame)
+    {
+        const std::string topic = source.name + "/"
+            + std::to_string(frame.camera);
+        zmq_send(publisher.get(), topic.data(), topic.size(), ZMQ_SNDMORE);
+        zmq_msg_send(frame.message.get(), publisher.get(), 0);
+        ++published;
+    }
+
+    // Shares the budget out max-min fairly. A source that used clearly
+    // less than its share last interval is given what it used with room
+    // to grow; the others are assumed to want more. Going from the
+    // smallest demand up, each source gets its demand or an even split
+    // of what is left, whichever is less.
+    void balance(const std::vector<double>& rates)
+    {
+        if (options.budget <= 0)
+            return;
+        std::vector<std::pair<double, size_t>> demands;
+        for (size_t i = 0; i < sources.size(); ++i) {
+            const double share = sources[i]->share;
+            demands.push_back({rates[i] < 0.9 * share
+                    ? rates[i] * 1.25 : options.budget * 1e6, i});
+        }
+        std::sort(demands.begin(), demands.end());
+
+        double left = options.budget * 1e6;
+        size_t remaining = demands.size();
+        for (const auto& demand : demands) {
+            const double share = std::min(demand.first, left / remaining--);
+            // A source that sent nothing still needs enough for a frame.
+            sources[demand.second]->share = std::max(share,
+                    options.budget * 1e6 / sources.size() / 10);
+            left -= share;
+        }
+    }
+
+    void report()
+    {
+        const double seconds = REPORT_SECONDS;
+        std::vector<double> rates;
+        for (auto& source : sources) {
+            rates.push_back(source->bytes / seconds);
+            std::clog << "source: " << source->name << " "
+                << source->frames / seconds << " frames/s "
+                << source->bytes / seconds / 1e6 << " MB/s "
+                << "share: " << source->share / 1e6 << " MB/s "
+                << "errors: " << source->client->error_count() << '\n';
+            source->frames = 0;
+            source->bytes = 0;
+        }
+        std::clog << "published: " << published / seconds << " frames/s "
+            << "held: " << held.size() << " "
+            << "late: " << late << std::endl;
+        published = 0;
+        balance(rates);
+    }
+};
+
+void usage(const char* name)
+{
+    std::cerr << "usage: " << name << " --source [name=]addr ..."
+        << " [--publish addr] [--command snap|next] [--window n]"
+        << " [--budget MB/s] [--hold ms]\n";
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+    // Termination signals are delivered through the event loop, so they
+    // must be blocked before any thread is started.
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+    Options options;
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg{argv[i]};
+        const bool value = i+1 < argc;
+        if (arg == "--source" && value) {
+            const std::string source{argv[++i]};
+            const size_t equals = source.find('=');
+            options.names.push_back(equals != std::string::npos
+                    ? source.substr(0, equals)
+                    : "aircraft-" + std::to_string(options.names.size()));
+            options.endpoints.push_back(equals != std::string::npos
+                    ? source.substr(equals + 1) : source);
+        } else if (arg == "--publish" && value) {
+            options.publish = argv[++i];
+        } else if (arg == "--command" && value) {
+            options.command = argv[++i];
+        } else if (arg == "--window" && value) {
+            options.window = std::atoi(argv[++i]);
+        } else if (arg == "--budget" && value) {
+            options.budget = std::atof(argv[++i]);
+        } else if (arg == "--hold" && value) {
+            options.hold = std::max(4, std::atoi(argv[++i]));
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (options.endpoints.empty()) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    void* context = zmq_ctx_new();
+    try {
+        Event_loop loop;
+        const int signal_fd = signalfd(-1, &signals, 0);
+        loop.add_fd(signal_fd, [&] {
+            signalfd_siginfo info;
+            ssize_t unused = read(signal_fd, &info, sizeof(info));
+            (void)unused;
+            loop.stop();
+        });
+        {
+            Aggregator aggregator{loop, context, options};
+            std::clog << "aggregating " << options.endpoints.size()
+                << " sources on " << options.publish << std::endl;
+            loop.run();
+        }
+        close(signal_fd);
+    } catch (std::runtime_error& e) {
+        std::cerr << e.what() << std::endl;
+        zmq_ctx_destroy(context);
+        return 1;
+    }
+    zmq_ctx_destroy(context);
+}
@@ -0,0 +1,325 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "demosaic.hpp"
+#include "denoise.hpp"
+#include "hdr.hpp"
+#include "jpeg.hpp"
+#include "parallel.hpp"
+#include "swath.hpp"
+#include "undistort.hpp"
+
+// Micro-benchmarks for the host-side processing stages. Each benchmark
+// runs on synthetic data sized like a full UI-1495LE-C frame, so no
+// cameras are needed, and reports the mean time and throughput.
+
+namespace {
+
+const int WIDTH = 3840;
+const int HEIGHT = 2748;
+
+// A raw frame with smooth gradients plus sensor-like noise, so that the
+// edge-aware paths see realistic gradient comparisons.
+std::vector<unsigned char> synthetic_bayer(int width, int height)
+{
+    std::vector<unsigned char> raw(static_cast<size_t>(width) * height);
+    std::minstd_rand rng{42};
+    for (int y = 0; y < height; ++y)
+        for (int x = 0; x < width; ++x)
+            raw[static_cast<size_t>(y)*width + x] =
+                ((x ^ y) & 0x7f) + (x % 2 ? 64 : 0) + rng() % 16;
+    return raw;
+}
+
+// Runs fn the given number of times and returns the mean in seconds.
+double measure(int iterations, const std::function<void()>& fn)
+{
+    using namespace std::chrono;
+    fn();  // warm up caches and page in buffers
+    const auto start = steady_clock::now();
+    for (int i = 0; i < iterations; ++i)
+        fn();
+    const auto end = steady_clock::now();
+    return duration<double>(end - start).count() / iterations;
+}
+
+void report(const std::string& name, double seconds, double megapixels)
+{
+    std::cout << name << ": " << seconds * 1000 << "ms/frame "
+        << megapixels / seconds << "MP/s\n";
+}
+
+void bench_demosaic(int iterations)
+{
+    const auto raw = synthetic_bayer(WIDTH, HEIGHT);
+    std::vector<unsigned char> rgb(raw.size() * 3);
+    const double mp = WIDTH * HEIGHT / 1e6;
+
+    std::cout << "threads: " << std::thread::hardware_concurrency() << '\n';
+    report("demosaic", measure(iterations, [&] {
+        demosaic(raw.data(), WIDTH, HEIGHT, WIDTH,
+                Bayer_pattern::GRBG, rgb.data());
+    }), mp);
+
+    std::vector<unsigned char> jpeg;
+    report("demosaic+encode", measure(iterations, [&] {
+        demosaic(raw.data(), WIDTH, HEIGHT, WIDTH,
+                Bayer_pattern::GRBG, rgb.data());
+        jpeg = encode_jpeg(rgb.data(), WIDTH, HEIGHT, JCS_RGB, 80);
+    }), mp);
+    std::cout << "jpeg size: " << jpeg.size() << " bytes\n";
+}
+
+// Undistorts a demosaiced frame with a wide-angle barrel distortion,
+// after timing how long the remap tables take to build.
+void bench_undistort(int iterations)
+{
+    const auto raw = synthetic_bayer(WIDTH, HEIGHT);
+    std::vector<unsigned char> rgb(raw.size() * 3), corrected(rgb.size());
+    demosaic(raw.data(), WIDTH, HEIGHT, WIDTH, Bayer_pattern::GRBG,
+            rgb.data());
+    const Lens lens{WIDTH, HEIGHT, 2800, 2800, WIDTH / 2.0, HEIGHT / 2.0,
+        -0.25, 0.08, 0.0005, -0.0003, 0};
+    const double mp = WIDTH * HEIGHT / 1e6;
+
+    std::unique_ptr<Undistorter> undistorter;
+    report("tables", measure(1, [&] {
+        undistorter.reset(new Undistorter{lens, WIDTH, HEIGHT});
+    }), mp);
+    report("undistort", measure(iterations, [&] {
+        undistorter->apply(rgb.data(), WIDTH * 3, corrected.data());
+    }), mp);
+}
+
+// Denoises a scene drifting 16 pixels a frame, averaging three at a
+// time, with a cut to another scene at frame 5, which starts the
+// history again on an odd slot of the ring. A noiseless scene shifted
+// into line averages to itself, so the frames after the cut must come
+// out exactly as they went in.
+void check_denoise_reset()
+{
+    const int width = 640, height = 480, frames = 8, drift = 16;
+    const int margin = drift * frames;
+    const int pitch = (width + margin) * 3;
+
+    // Random blocks, so that no shift but the true one matches.
+    std::vector<unsigned char> scene(static_cast<size_t>(pitch)
+            * (height + margin));
+    std::minstd_rand rng{7};
+    std::vector<unsigned char> blocks(scene.size() / 48 + pitch);
+    for (auto& block : blocks)
+        block = rng() % 256;
+    for (int y = 0; y < height + margin; ++y)
+        for (int x = 0; x < pitch; ++x)
+            scene[static_cast<size_t>(y) * pitch + x] =
+                blocks[y / 4 * (pitch / 12 + 1) + x / 12];
+    std::vector<unsigned char> cut(scene.size());
+    for (size_t i = 0; i < scene.size(); ++i)
+        cut[i] = 255 - scene[i];
+
+    Temporal_denoiser denoiser{width, height, 3, 3};
+    for (int frame = 0; frame < frames; ++frame) {
+        const unsigned char* input = (frame < 5 ? scene : cut).data()
+            + frame * drift * pitch + frame * drift * 3;
+        const unsigned char* output = denoiser.apply(input, pitch);
+        long error = 0;
+        for (int y = 0; y < height; ++y)
+            for (int x = 0; x < width * 3; ++x)
+                error += std::abs(output[y * width * 3 + x]
+                        - input[y * pitch + x]);
+        std::cout << "denoise frame " << frame << ": "
+            << denoiser.frames_averaged() << " averaged, mean error "
+            << static_cast<double>(error) / (width * height * 3)
+            << (error ? " FAILED" : "") << '\n';
+    }
+}
+
+// Denoises a stream of demosaiced frames drifting a few pixels a frame,
+// averaging four at a time.
+void bench_denoise(int iterations)
+{
+    check_denoise_reset();
+
+    const int margin = 64;
+    const auto raw = synthetic_bayer(WIDTH + margin, HEIGHT + margin);
+    std::vector<unsigned char> scene(raw.size() * 3);
+    demosaic(raw.data(), WIDTH + margin, HEIGHT + margin, WIDTH + margin,
+            Bayer_pattern::GRBG, scene.data());
+    const int pitch = (WIDTH + margin) * 3;
+    const double mp = WIDTH * HEIGHT / 1e6;
+
+    Temporal_denoiser denoiser{WIDTH, HEIGHT, 3, 4};
+    int frame = 0;
+    report("denoise", measure(iterations, [&] {
+        const int shift = 2 * (frame++ % 16);
+        denoiser.apply(&scene[shift * pitch + shift * 3], pitch);
+    }), mp);
+}
+
+// Coarsens the background of a frame encoded at the default quality,
+// keeping a region of about 5% of it, and compares the size with the
+// uniform encoding.
+void bench_regions(int iterations)
+{
+    const auto raw = synthetic_bayer(WIDTH, HEIGHT);
+    std::vector<unsigned char> rgb(raw.size() * 3);
+    demosaic(raw.data(), WIDTH, HEIGHT, WIDTH, Bayer_pattern::GRBG,
+            rgb.data());
+    const auto uniform = encode_jpeg(rgb.data(), WIDTH, HEIGHT, JCS_RGB, 80);
+    const std::vector<Jpeg_region> regions{{1600, 1000, 800, 600}};
+
+    std::vector<unsigned char> coarse;
+    report("requantize", measure(iterations, [&] {
+        coarse = requantize_jpeg(uniform.data(), uniform.size(), regions,
+                30);
+    }), WIDTH * HEIGHT / 1e6);
+    std::cout << "uniform: " << uniform.size() << " bytes "
+        << "regions: " << coarse.size() << " bytes ("
+        << 100 - 100.0 * coarse.size() / uniform.size() << "% saved)\n";
+}
+
+// Fuses a bracket of three exposures a stop apart, raw and demosaiced.
+void bench_hdr(int iterations)
+{
+    const auto raw = synthetic_bayer(WIDTH, HEIGHT);
+    std::vector<std::vector<unsigned char>> raws;
+    for (const double gain : {0.5, 1.0, 2.0}) {
+        raws.push_back(raw);
+        for (auto& pixel : raws.back())
+            pixel = std::min(255.0, pixel * gain);
+    }
+    std::vector<std::vector<unsigned char>> colours;
+    for (const auto& exposure : raws) {
+        colours.emplace_back(raw.size() * 3);
+        demosaic(exposure.data(), WIDTH, HEIGHT, WIDTH, Bayer_pattern::GRBG,
+                colours.back().data());
+    }
+    const double mp = WIDTH * HEIGHT / 1e6;
+
+    const Exposure_fusion fusion;
+    std::vector<const unsigned char*> images;
+    for (const auto& exposure : raws)
+        images.push_back(exposure.data());
+    std::vector<unsigned char> fused(raw.size() * 3);
+    report("fuse raw", measure(iterations, [&] {
+        fusion.fuse(images, WIDTH, HEIGHT, WIDTH, 1, fused.data());
+    }), mp);
+    images.clear();
+    for (const auto& exposure : colours)
+        images.push_back(exposure.data());
+    report("fuse colour", measure(iterations, [&] {
+        fusion.fuse(images, WIDTH, HEIGHT, WIDTH * 3, 3, fused.data());
+    }), mp);
+}
+
+// Assembles raw strips from a ring of padded capture buffers, as the
+// strip mode does, then demosaics and encodes each completed swath.
+void bench_swath(int iterations)
+{
+    const int width = 3040;
+    const int strip_height = 406;
+    const int pitch = 3072;
+    const int strips = 8;
+
+    std::vector<std::vector<unsigned char>> ring;
+    for (int i = 0; i < 8; ++i)
+        ring.push_back(synthetic_bayer(pitch, strip_height));
+
+    Swath_assembler assembler{1, width, strip_height, 1, strips};
+    Swath swath;
+    int next = 0;
+    const double seconds = measure(iterations, [&] {
+        for (int i = 0; i < strips; ++i)
+            assembler.add(ring[next++ % ring.size()].data(), pitch, i);
+        swath = assembler.take();
+    });
+    std::cout << "assemble: " << strips / seconds << " strips/s "
+        << swath.pixels.size() / seconds / 1e6 << "MB/s\n";
+
+    std::vector<unsigned char> rgb(swath.pixels.size() * 3);
+    report("swath encode", measure(iterations, [&] {
+        demosaic(swath.pixels.data(), swath.width, swath.height,
+                swath.width, Bayer_pattern::GRBG, rgb.data());
+        encode_jpeg(rgb.data(), swath.width, swath.height, JCS_RGB, 80);
+    }), swath.width * swath.height / 1e6);
+}
+
+void report_workers(Thread_pool& pool)
+{
+    const auto stats = pool.take_stats();
+    for (size_t i = 0; i < stats.size(); ++i)
+        std::cout << "  worker " << i << ": " << stats[i].tasks << " tasks "
+            << stats[i].steals << " steals "
+            << stats[i].utilisation * 100 << "% busy\n";
+}
+
+// Demosaics a full frame and a strip-sized frame concurrently, as when
+// one camera runs full frames and the other strips, and reports how
+// evenly the pool spread the load, then the cost of an empty task.
+void bench_pool(int iterations)
+{
+    const auto full = synthetic_bayer(WIDTH, HEIGHT);
+    const auto strip = synthetic_bayer(3040, 406);
+    std::vector<unsigned char> full_rgb(full.size() * 3);
+    std::vector<unsigned char> strip_rgb(strip.size() * 3);
+    Thread_pool& pool = thread_pool();
+
+    std::cout << "workers: " << pool.size() << '\n';
+    pool.take_stats();
+    const double seconds = measure(iterations, [&] {
+        std::thread other{[&] {
+            for (int i = 0; i < 4; ++i)
+                demosaic(strip.data(), 3040, 406, 3040,
+                        Bayer_pattern::GRBG, strip_rgb.data());
+        }};
+        demosaic(full.data(), WIDTH, HEIGHT, WIDTH, Bayer_pattern::GRBG,
+                full_rgb.data());
+        other.join();
+    });
+    report("uneven cameras", seconds, (WIDTH * HEIGHT + 4 * 3040 * 406) / 1e6);
+    report_workers(pool);
+
+    const int tasks = 100000;
+    const double empty = measure(1, [&] {
+        for (int i = 0; i < tasks; ++i)
+            pool.submit([] {});
+        while (pool.run_one()) {}
+    });
+    std::cout << "task overhead: " << empty / tasks * 1e9 << "ns\n";
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+    const std::map<std::string, std::function<void(int)>> benchmarks{
+        {"demosaic", bench_demosaic},
+        {"denoise", bench_denoise},
+        {"hdr", bench_hdr},
+        {"pool", bench_pool},
+        {"regions", bench_regions},
+        {"swath", bench_swath},
+        {"undistort", bench_undistort},
+    };
+
+    const auto it = argc > 1 ? benchmarks.find(argv[1]) : benchmarks.end();
+    if (it == benchmarks.end()) {
+        std::cerr << "usage: " << argv[0] << " <benchmark> [iterations]\n"
+            << "benchmarks:";
+        for (const auto& benchmark : benchmarks)
+            std::cerr << ' ' << benchmark.first;
+        std::cerr << '\n';
+        return 1;
+    }
+
+    const int iterations = argc > 2 ? std::atoi(argv[2]) : 10;
+    it->second(iterations);
+}
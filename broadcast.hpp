@@ -0,0 +1,269 @@
+#ifndef MOSLEY_BROADCAST_HPP
+#define MOSLEY_BROADCAST_HPP
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <msgpack.hpp>
+
+// How far behind one consumer of a Broadcast_ring is.
+struct Consumer_stats {
+    std::string name;
+    unsigned long read;
+    unsigned long dropped;      // overwritten before they were read
+    unsigned long lag;          // published but not read yet
+
+    MSGPACK_DEFINE(name, read, dropped, lag);
+};
+
+// A single-producer, multi-consumer ring for fanning large values out
+// to several consumers without copying them. The producer fills a slot
+// in place and publishes it once; every consumer then reads it at its
+// own pace through a reference that keeps the slot from being reused
+// until it is released. A consumer that falls a whole ring behind
+// either skips ahead, counting what it missed, or holds the producer
+// back until it catches up, depending on its policy.
+template<typename T>
+class Broadcast_ring {
+private:
+    struct Slot;
+
+public:
+    enum Policy { SKIP, BLOCK };
+
+    // A counted reference to a published slot. Release it promptly: the
+    // producer waits for every reader of a slot before reusing it.
+    class Ref {
+    public:
+        Ref() : ring{nullptr}, slot{nullptr} {}
+
+        Ref(Ref&& other) : ring{other.ring}, slot{other.slot}
+        {
+            other.slot = nullptr;
+        }
+
+        Ref& operator=(Ref&& other)
+        {
+            if (this != &other) {
+                reset();
+                ring = other.ring;
+                slot = other.slot;
+                other.slot = nullptr;
+            }
+            return *this;
+        }
+
+        ~Ref()
+        {
+            reset();
+        }
+
+        // Disallow copying.
+        Ref(const Ref&) = delete;
+        Ref& operator=(const Ref&) = delete;
+
+        const T& operator*() const
+        {
+            return slot->value;
+        }
+
+        const T* operator->() const
+        {
+            return &slot->value;
+        }
+
+        explicit operator bool() const
+        {
+            return slot != nullptr;
+        }
+
+        // The position of the value in the order it was published.
+        uint64_t sequence() const
+        {
+            return slot->sequence;
+        }
+
+        void reset()
+        {
+            if (slot)
+                ring->release(*slot);
+            slot = nullptr;
+        }
+
+    private:
+        friend class Broadcast_ring;
+
+        Ref(Broadcast_ring* ring, Slot* slot) : ring{ring}, slot{slot} {}
+
+        Broadcast_ring* ring;
+        Slot* slot;
+    };
+
+    explicit Broadcast_ring(size_t capacity)
+        : slots(capacity), head{0}, claimed{false}, closed{false}
+    {
+    }
+
+    // Disallow copying and moving.
+    Broadcast_ring(const Broadcast_ring&) = delete;
+    Broadcast_ring& operator=(const Broadcast_ring&) = delete;
+
+    // Adds a consumer, which sees values published from now on, and
+    // returns its id.
+    int add_consumer(const std::string& name, Policy policy)
+    {
+        std::lock_guard<std::mutex> lock{mutex};
+        consumers.push_back(Consumer{name, policy, head, 0, 0});
+        return consumers.size() - 1;
+    }
+
+    // Returns the oldest slot for the producer to fill, waiting while it
+    // has readers or a blocking consumer has yet to read it. Consumers
+    // that skip lose the value it held.
+    T& claim()
+    {
+        std::unique_lock<std::mutex> lock{mutex};
+        Slot& slot = slots[head % slots.size()];
+        released.wait(lock, [&] {
+            return closed || (slot.readers == 0 && !held_back());
+        });
+        for (auto& consumer : consumers) {
+            if (consumer.next + slots.size() <= head) {
+                consumer.dropped += head + 1 - slots.size() - consumer.next;
+                consumer.next = head + 1 - slots.size();
+            }
+        }
+        claimed = true;
+        return slot.value;
+    }
+
+    // Publishes the claimed slot to every consumer and returns a
+    // reference to it for the producer's own use.
+    Ref publish()
+    {
+        std::lock_guard<std::mutex> lock{mutex};
+        Slot& slot = slots[head % slots.size()];
+        slot.sequence = head++;
+        slot.readers = 1;
+        claimed = false;
+        published.notify_all();
+        return Ref{this, &slot};
+    }
+
+    // Takes the next value for a consumer if one has been published.
+    // These release whatever the reference held first.
+    bool try_read(int id, Ref& ref)
+    {
+        ref.reset();
+        std::lock_guard<std::mutex> lock{mutex};
+        return take(consumers[id], ref);
+    }
+
+    // Waits for the next value for a consumer. Returns false once the
+    // ring is closed.
+    bool read(int id, Ref& ref)
+    {
+        ref.reset();
+        std::unique_lock<std::mutex> lock{mutex};
+        Consumer& consumer = consumers[id];
+        published.wait(lock, [&] {
+            return closed || consumer.next < head;
+        });
+        return !closed && take(consumer, ref);
+    }
+
+    // Looks up a value by sequence, if it is still in the ring.
+    bool get(uint64_t sequence, Ref& ref)
+    {
+        ref.reset();
+        std::lock_guard<std::mutex> lock{mutex};
+        if (sequence >= head || sequence + slots.size() < head + claimed)
+            return false;
+        ref = acquire(slots[sequence % slots.size()]);
+        return true;
+    }
+
+    // Wakes every waiting consumer and stops the producer waiting for
+    // them, for shutting down.
+    void close()
+    {
+        std::lock_guard<std::mutex> lock{mutex};
+        closed = true;
+        published.notify_all();
+        released.notify_all();
+    }
+
+    std::vector<Consumer_stats> stats() const
+    {
+        std::lock_guard<std::mutex> lock{mutex};
+        std::vector<Consumer_stats> result;
+        for (const auto& consumer : consumers)
+            result.push_back({consumer.name, consumer.read,
+                    consumer.dropped,
+                    static_cast<unsigned long>(head - consumer.next)});
+        return result;
+    }
+
+private:
+    struct Slot {
+        T value;
+        uint64_t sequence = 0;
+        int readers = 0;
+    };
+
+    struct Consumer {
+        std::string name;
+        Policy policy;
+        uint64_t next;          // sequence of the next value to read
+        unsigned long read;
+        unsigned long dropped;
+    };
+
+    std::vector<Slot> slots;
+    std::vector<Consumer> consumers;
+    uint64_t head;              // sequence of the next value published
+    bool claimed;
+    bool closed;
+
+    mutable std::mutex mutex;
+    std::condition_variable published;
+    std::condition_variable released;
+
+    // Whether a blocking consumer still has to read the oldest slot.
+    bool held_back() const
+    {
+        for (const auto& consumer : consumers)
+            if (consumer.policy == BLOCK
+                    && consumer.next + slots.size() <= head)
+                return true;
+        return false;
+    }
+
+    bool take(Consumer& consumer, Ref& ref)
+    {
+        if (consumer.next >= head)
+            return false;
+        ref = acquire(slots[consumer.next % slots.size()]);
+        ++consumer.next;
+        ++consumer.read;
+        released.notify_all();
+        return true;
+    }
+
+    Ref acquire(Slot& slot)
+    {
+        ++slot.readers;
+        return Ref{this, &slot};
+    }
+
+    void release(Slot& slot)
+    {
+        std::lock_guard<std::mutex> lock{mutex};
+        --slot.readers;
+        released.notify_all();
+    }
+};
+
+#endif
@@ -0,0 +1,312 @@
+#ifndef MOSLEY_CLIENT_HPP
+#define MOSLEY_CLIENT_HPP
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <zmq.h>
+#include <msgpack.hpp>
+#include "event_loop.hpp"
+#include "telemetry.hpp"
+
+// A frame received by a Client. The image points into the message it
+// arrived in, which the frame owns, so receiving a frame copies
+// nothing; only frames from servers that send images as arrays are
+// copied out.
+struct Client_frame {
+    struct Message_closer {
+        void operator()(zmq_msg_t* msg) const
+        {
+            zmq_msg_close(msg);
+            delete msg;
+        }
+    };
+
+    int width = 0;
+    int height = 0;
+    int camera = 0;             // zero from servers that do not send it
+    unsigned long sequence = 0;
+    uint64_t timestamp = 0;     // capture time, microseconds since the epoch
+    const unsigned char* image = nullptr;
+    size_t image_size = 0;
+    std::chrono::steady_clock::duration latency{};  // request to reply
+
+    std::unique_ptr<zmq_msg_t, Message_closer> message;
+    std::vector<unsigned char> copy;
+};
+
+// Closes a socket when it goes, so that a constructor that throws after
+// opening one does not leave zmq_ctx_destroy() waiting on it for ever.
+struct Socket_closer {
+    void operator()(void* socket) const
+    {
+        zmq_close(socket);
+    }
+};
+
+typedef std::unique_ptr<void, Socket_closer> Zmq_socket;
+
+// Fetches frames from the mosley data socket while keeping several
+// requests in flight, so that the link round trip no longer limits the
+// frame rate. A DEALER socket lets requests be sent without waiting for
+// replies; the server answers them in order. Requests are sent and
+// replies decoded on a thread of the client's own, which keeps the
+// window full: with a window of two or more the next frame of each
+// camera is already on its way while the caller handles the last one.
+//
+// Frames are either queued for next(), in which case the window also
+// bounds how many frames are buffered ahead of the caller, or handed to
+// a callback on the client thread as they arrive. Every request carries
+// an id in its envelope, which the server's REP socket echoes back, so
+// a request that gets no reply within TIMEOUT_MS, because the server
+// restarted for example, can be given up without a late reply being
+// taken for another.
+class Client {
+public:
+    typedef std::function<void(Client_frame&)> Handler;
+
+    static const int TIMEOUT_MS = 5000;
+
+    // The command is "snap" for a new frame per request or "next" for
+    // the frames triggered by the server's capture scheduler.
+    Client(void* context, const std::string& endpoint, int window = 4,
+            const std::string& command = "snap", Handler handler = nullptr)
+        : context{context}, endpoint{endpoint}, command{command},
+          window{static_cast<size_t>(std::max(1, window))}, handler{handler},
+          socket{nullptr}, next_id{0}, errors{0}, started{false}
+    {
+        io = std::thread{&Client::run, this};
+
+        // Wait for the socket so that a bad endpoint is reported here.
+        std::unique_lock<std::mutex> lock{mutex};
+        ready.wait(lock, [this] { return started; });
+        if (!socket) {
+            lock.unlock();
+            io.join();
+            throw std::runtime_error{"could not connect to " + endpoint};
+        }
+    }
+
+    ~Client()
+    {
+        loop.post([this] { loop.stop(); });
+        io.join();
+    }
+
+    // Disallow copying and moving.
+    Client(const Client&) = delete;
+    Client& operator=(const Client&) = delete;
+
+    // Waits up to the timeout for the next frame. Returns false if none
+    // arrived in time.
+    bool next(Client_frame& frame, int timeout_ms)
+    {
+        {
+            std::unique_lock<std::mutex> lock{mutex};
+            if (!ready.wait_for(lock, std::chrono::milliseconds(timeout_ms),
+                        [this] { return !frames.empty(); }))
+                return false;
+            frame = std::move(frames.front());
+            frames.pop_front();
+        }
+        loop.post([this] { fill(); });
+        return true;
+    }
+
+    // Requests that failed or timed out and replies that did not decode.
+    unsigned long error_count() const
+    {
+        std::lock_guard<std::mutex> lock{mutex};
+        return errors;
+    }
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    void* const context;
+    const std::string endpoint;
+    const std::string command;
+    const size_t window;
+    const Handler handler;
+
+    // Only the client thread touches these.
+    Event_loop loop;
+    void* socket;
+    uint64_t next_id;
+    std::map<uint64_t, Clock::time_point> sent;
+
+    mutable std::mutex mutex;
+    std::condition_variable ready;
+    std::deque<Client_frame> frames;
+    unsigned long errors;
+    bool started;
+
+    std::thread io;
+
+    void run()
+    {
+        const bool connected = connect();
+        {
+            std::lock_guard<std::mutex> lock{mutex};
+            started = true;
+        }
+        ready.notify_all();
+        if (!connected)
+            return;
+
+        loop.add_socket(socket, [this] { receive(); });
+        loop.add_timer(std::chrono::milliseconds(TIMEOUT_MS / 5),
+                [this] { expire(); });
+        fill();
+        loop.run();
+        zmq_close(socket);
+    }
+
+    bool connect()
+    {
+        socket = zmq_socket(context, ZMQ_DEALER);
+        const int linger = 0;
+        zmq_setsockopt(socket, ZMQ_LINGER, &linger, sizeof(linger));
+        if (zmq_connect(socket, endpoint.c_str()) != 0) {
+            zmq_close(socket);
+            socket = nullptr;
+            return false;
+        }
+        return true;
+    }
+
+    // Sends requests until the window is full. Each request is the id,
+    // an empty delimiter and the command; the server sees the id as
+    // part of the envelope and returns it with the reply.
+    void fill()
+    {
+        size_t queued;
+        {
+            std::lock_guard<std::mutex> lock{mutex};
+            queued = frames.size();
+        }
+        while (sent.size() + queued < window) {
+            const uint64_t id = next_id++;
+            zmq_send(socket, &id, sizeof(id), ZMQ_SNDMORE);
+            zmq_send(socket, "", 0, ZMQ_SNDMORE);
+            zmq_send(socket, command.data(), command.size(), 0);
+            sent[id] = Clock::now();
+        }
+    }
+
+    void receive()
+    {
+        for (;;) {
+            uint64_t id = 0;
+            const int size = zmq_recv(socket, &id, sizeof(id), ZMQ_DONTWAIT);
+            if (size < 0)
+                break;
+
+            // Then the delimiter and the reply, which every part of the
+            // message must be read up to, wanted or not.
+            std::unique_ptr<zmq_msg_t, Client_frame::Message_closer> msg{
+                new zmq_msg_t};
+            zmq_msg_init(msg.get());
+            while (zmq_msg_recv(msg.get(), socket, 0) >= 0
+                    && zmq_msg_more(msg.get())) {}
+
+            const auto request = sent.find(id);
+            if (size != static_cast<int>(sizeof(id)) || request == sent.end())
+                continue;
+
+            Client_frame frame;
+            frame.latency = Clock::now() - request->second;
+            sent.erase(request);
+            try {
+                decode(std::move(msg), frame);
+            } catch (std::exception& e) {
+                std::cerr << "bad frame: " << e.what() << '\n';
+                std::lock_guard<std::mutex> lock{mutex};
+                ++errors;
+                continue;
+            }
+
+            if (handler) {
+                handler(frame);
+            } else {
+                {
+                    std::lock_guard<std::mutex> lock{mutex};
+                    frames.push_back(std::move(frame));
+                }
+                ready.notify_one();
+            }
+        }
+        fill();
+    }
+
+    // Decodes the fields of a Telemetry message one by one rather than
+    // converting it, which would copy the image. Unpacking references
+    // raw data in the message rather than copying it into the zone.
+    static void decode(
+            std::unique_ptr<zmq_msg_t, Client_frame::Message_closer> msg,
+            Client_frame& frame)
+    {
+        msgpack::unpacked unpacked;
+        msgpack::unpack(&unpacked,
+                static_cast<const char*>(zmq_msg_data(msg.get())),
+                zmq_msg_size(msg.get()));
+        const msgpack::object o = unpacked.get();
+        if (o.type != msgpack::type::ARRAY || o.via.array.size < 3)
+            throw msgpack::type_error();
+
+        const msgpack::object* field = o.via.array.ptr;
+        frame.width = field[0].as<int>();
+        frame.height = field[1].as<int>();
+        if (field[2].type == msgpack::type::RAW) {
+            frame.image = reinterpret_cast<const unsigned char*>(
+                    field[2].via.raw.ptr);
+            frame.image_size = field[2].via.raw.size;
+        } else {
+            field[2].convert(&frame.copy);
+            frame.image = frame.copy.data();
+            frame.image_size = frame.copy.size();
+        }
+        if (o.via.array.size >= 6) {
+            frame.camera = field[3].as<int>();
+            frame.sequence = field[4].as<unsigned long>();
+            frame.timestamp = field[5].as<uint64_t>();
+        }
+        frame.message = std::move(msg);
+    }
+
+    // Gives up on requests that have waited too long, and replaces them
+    // in the window. Their replies are dropped if they come after all.
+    void expire()
+    {
+        const auto deadline = Clock::now()
+            - std::chrono::milliseconds(TIMEOUT_MS);
+        unsigned long expired = 0;
+        for (auto it = sent.begin(); it != sent.end(); ) {
+            if (it->second < deadline) {
+                it = sent.erase(it);
+                ++expired;
+            } else {
+                ++it;
+            }
+        }
+        if (expired == 0)
+            return;
+        {
+            std::lock_guard<std::mutex> lock{mutex};
+            errors += expired;
+        }
+        std::cerr << "no reply from " << endpoint << " to " << expired
+            << " requests\n";
+        fill();
+    }
+};
+
+#endif
@@ -0,0 +1,142 @@
+#ifndef MOSLEY_DEMOSAIC_HPP
+#define MOSLEY_DEMOSAIC_HPP
+
+#include <cstdint>
+#include <cstring>
+#include <utility>
+#include <vector>
+#include "parallel.hpp"
+#include "simd.hpp"
+#include "trace.hpp"
+
+// The colour filter layout of a raw sensor, named after the colours of
+// its top-left 2x2 block read row by row.
+enum class Bayer_pattern { RGGB, GRBG, GBRG, BGGR };
+
+namespace demosaic_detail {
+
+using namespace simd;
+
+// Rows are widened into buffers with this many padding pixels on
+// either side, so the stencils never need bounds checks.
+const int PAD = LANES;
+
+inline v8u16 absdiff(v8u16 a, v8u16 b)
+{
+    return a > b ? a - b : b - a;
+}
+
+// Widens a raw row to 16 bits, mirroring the border pixels so that the
+// neighbours of an edge pixel keep the colour they would have on the
+// sensor (p[-1] = p[1], p[w] = p[w-2]).
+inline void widen(const unsigned char* src, int width, uint16_t* dst)
+{
+    uint16_t* row = dst + PAD;
+    for (int x = 0; x < width; ++x)
+        row[x] = src[x];
+    row[-1] = src[1];
+    row[width] = src[width-2];
+    row[width+1] = src[width-1];
+    for (int x = width+2; x < width+PAD; ++x)
+        row[x] = src[width-1];
+}
+
+// Interpolates one row. Each row holds one chroma channel (red or blue)
+// interleaved with green; the other chroma channel lives on the rows
+// above and below. Every candidate value is computed for all lanes and
+// the right one is selected per site, which keeps the loop branch free.
+// Green at chroma sites is interpolated along the direction with the
+// smaller gradient so that edges are not smeared across.
+inline void interpolate_row(const uint16_t* up, const uint16_t* mid,
+        const uint16_t* down, int width, bool even_is_green,
+        uint16_t* own, uint16_t* green, uint16_t* other)
+{
+    const v8i16 chroma_site = even_is_green
+        ? v8i16{0, -1, 0, -1, 0, -1, 0, -1}
+        : v8i16{-1, 0, -1, 0, -1, 0, -1, 0};
+    const v8u16 one = v8u16{} + 1;
+    const v8u16 two = v8u16{} + 2;
+
+    up += PAD;
+    mid += PAD;
+    down += PAD;
+    for (int x = 0; x < width; x += LANES) {
+        const v8u16 c = load(mid + x);
+        const v8u16 l = load(mid + x - 1);
+        const v8u16 r = load(mid + x + 1);
+        const v8u16 u = load(up + x);
+        const v8u16 d = load(down + x);
+
+        const v8u16 h = (l + r + one) >> 1;
+        const v8u16 v = (u + d + one) >> 1;
+        const v8u16 cross = (l + r + u + d + two) >> 2;
+        const v8u16 diag = (load(up + x - 1) + load(up + x + 1) +
+                load(down + x - 1) + load(down + x + 1) + two) >> 2;
+
+        const v8u16 gh = absdiff(l, r);
+        const v8u16 gv = absdiff(u, d);
+        const v8u16 g = gh < gv ? h : (gv < gh ? v : cross);
+
+        store(own + x, chroma_site ? c : h);
+        store(green + x, chroma_site ? g : c);
+        store(other + x, chroma_site ? diag : v);
+    }
+}
+
+} // namespace demosaic_detail
+
+// Reconstructs a packed 24bpp RGB image from 8-bit raw Bayer data. The
+// raw image may have a line pitch larger than its width; the output is
+// tightly packed. Bands of rows are processed on all cores.
+inline void demosaic(const unsigned char* raw, int width, int height,
+        int pitch, Bayer_pattern pattern, unsigned char* rgb)
+{
+    using namespace demosaic_detail;
+
+    const bool first_even_is_green = pattern == Bayer_pattern::GRBG
+        || pattern == Bayer_pattern::GBRG;
+    const bool first_has_red = pattern == Bayer_pattern::RGGB
+        || pattern == Bayer_pattern::GRBG;
+    const int padded = (width + LANES - 1) / LANES * LANES;
+
+    parallel_for(height, [=](int begin, int end) {
+        Trace_span span{"demosaic rows"};
+        auto source = [=](int y) {
+            y = y < 0 ? -y : (y >= height ? 2*height - 2 - y : y);
+            return raw + static_cast<size_t>(y) * pitch;
+        };
+
+        std::vector<uint16_t> rows[3];
+        for (auto& row : rows)
+            row.resize(padded + 2*PAD);
+        std::vector<uint16_t> own(padded), green(padded), other(padded);
+
+        uint16_t* up = rows[0].data();
+        uint16_t* mid = rows[1].data();
+        uint16_t* down = rows[2].data();
+        widen(source(begin-1), width, up);
+        widen(source(begin), width, mid);
+
+        for (int y = begin; y < end; ++y) {
+            widen(source(y+1), width, down);
+
+            const bool odd = y % 2;
+            interpolate_row(up, mid, down, padded,
+                    first_even_is_green != odd,
+                    own.data(), green.data(), other.data());
+
+            const int o = (first_has_red != odd) ? 0 : 2;
+            unsigned char* out = rgb + static_cast<size_t>(y) * width * 3;
+            for (int x = 0; x < width; ++x) {
+                out[3*x + o] = own[x];
+                out[3*x + 1] = green[x];
+                out[3*x + 2 - o] = other[x];
+            }
+
+            std::swap(up, mid);
+            std::swap(mid, down);
+        }
+    });
+}
+
+#endif
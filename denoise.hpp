@@ -0,0 +1,391 @@
+#ifndef MOSLEY_DENOISE_HPP
+#define MOSLEY_DENOISE_HPP
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+#include "parallel.hpp"
+#include "simd.hpp"
+#include "trace.hpp"
+
+namespace denoise_detail {
+
+using namespace simd;
+
+// A greyscale image at a fraction of the frame's resolution.
+struct Level {
+    int width = 0;
+    int height = 0;
+    std::vector<unsigned char> pixels;
+
+    unsigned char at(int x, int y) const
+    {
+        return pixels[static_cast<size_t>(y) * width + x];
+    }
+};
+
+} // namespace denoise_detail
+
+// Finds how far a frame lies from the one before it. The cameras look
+// straight down from a moving aircraft, so frames taken close together
+// differ mostly by a translation, which is found by block matching on a
+// pyramid of thumbnails: an exhaustive search on the coarsest level,
+// refined one pixel each way on every finer one. The thumbnails of raw
+// Bayer frames average whole 2x2 cells, so shifts are always whole
+// cells and keep the colour phase.
+class Thumbnail_matcher {
+public:
+    // Search range, in pixels of the coarsest thumbnail each way.
+    static const int SEARCH = 8;
+
+    // Thumbnails are at 1/2 to 1/16 of the frame's resolution.
+    static const int LEVELS = 4;
+
+    // The finer levels are matched on a central window of this size.
+    static const int WINDOW = 256;
+
+    // The mean absolute difference above which frames do not match.
+    static const int MAX_ERROR = 24;
+
+    // Matches frames of width by height pixels of channels bytes each.
+    Thumbnail_matcher(int width, int height, int channels)
+        : width{width}, height{height}, channels{channels},
+          current(LEVELS), previous(LEVELS)
+    {
+    }
+
+    // Whether the matcher was built for frames of this shape.
+    bool fits(int frame_width, int frame_height, int frame_channels) const
+    {
+        return frame_width == width && frame_height == height
+            && frame_channels == channels;
+    }
+
+    // Makes a frame, which may have a pitch larger than its width, the
+    // newest. Its thumbnails are scaled by the gain, which brings
+    // frames of different exposures into line.
+    void add(const unsigned char* pixels, int pitch, double gain = 1)
+    {
+        std::swap(current, previous);
+        build_pyramid(pixels, pitch, gain);
+    }
+
+    // Finds where the newest frame lies in the one before, in pixels of
+    // the frame: its pixel (x, y) is at (x + dx, y + dy) there. Returns
+    // whether it lies there at all.
+    bool match(int& dx, int& dy) const
+    {
+        int sx = 0, sy = 0;
+        int best = INT_MAX;
+        const int top = LEVELS - 1;
+        for (int y = -SEARCH; y <= SEARCH; ++y) {
+            for (int x = -SEARCH; x <= SEARCH; ++x) {
+                const int error = difference(current[top], previous[top],
+                        x, y, INT_MAX / 2);
+                if (error < best) {
+                    best = error;
+                    sx = x;
+                    sy = y;
+                }
+            }
+        }
+
+        for (int level = top - 1; level >= 0; --level) {
+            const int cx = 2 * sx, cy = 2 * sy;
+            best = INT_MAX;
+            for (int y = cy - 1; y <= cy + 1; ++y) {
+                for (int x = cx - 1; x <= cx + 1; ++x) {
+                    const int error = difference(current[level],
+                            previous[level], x, y, WINDOW);
+                    if (error < best) {
+                        best = error;
+                        sx = x;
+                        sy = y;
+                    }
+                }
+            }
+        }
+
+        // The base level is in 2x2 cells.
+        dx = 2 * sx;
+        dy = 2 * sy;
+        return best <= MAX_ERROR;
+    }
+
+private:
+    const int width;
+    const int height;
+    const int channels;
+
+    std::vector<denoise_detail::Level> current;
+    std::vector<denoise_detail::Level> previous;
+
+    // Builds the thumbnails of a frame: the first level holds the mean
+    // brightness of each 2x2 cell times the gain, each further one
+    // halves the last.
+    void build_pyramid(const unsigned char* pixels, int pitch, double gain)
+    {
+        using denoise_detail::Level;
+        const int scale = static_cast<int>(std::lround(gain * 256));
+        Level& base = current[0];
+        base.width = width / 2;
+        base.height = height / 2;
+        base.pixels.resize(static_cast<size_t>(base.width) * base.height);
+        parallel_for(base.height, [&](int begin, int end) {
+            for (int v = begin; v < end; ++v) {
+                const unsigned char* top = pixels
+                    + static_cast<size_t>(2 * v) * pitch;
+                const unsigned char* bottom = top + pitch;
+                unsigned char* out = &base.pixels[
+                    static_cast<size_t>(v) * base.width];
+                for (int u = 0; u < base.width; ++u) {
+                    int sum = 0;
+                    for (int c = 0; c < 2 * channels; ++c)
+                        sum += top[2 * u * channels + c]
+                            + bottom[2 * u * channels + c];
+                    out[u] = std::min(255, sum * scale / (1024 * channels));
+                }
+            }
+        });
+
+        for (int i = 1; i < LEVELS; ++i) {
+            const Level& fine = current[i - 1];
+            Level& coarse = current[i];
+            coarse.width = std::max(1, fine.width / 2);
+            coarse.height = std::max(1, fine.height / 2);
+            coarse.pixels.resize(
+                    static_cast<size_t>(coarse.width) * coarse.height);
+            for (int v = 0; v < coarse.height; ++v)
+                for (int u = 0; u < coarse.width; ++u)
+                    coarse.pixels[static_cast<size_t>(v) * coarse.width + u] =
+                        (fine.at(2 * u, 2 * v) + fine.at(2 * u + 1, 2 * v)
+                         + fine.at(2 * u, 2 * v + 1)
+                         + fine.at(2 * u + 1, 2 * v + 1) + 2) / 4;
+        }
+    }
+
+    // The mean absolute difference between the current level and the
+    // previous one shifted by (sx, sy), over at most a window of the
+    // middle of the overlap, or INT_MAX if they hardly overlap.
+    static int difference(const denoise_detail::Level& a,
+            const denoise_detail::Level& b, int sx, int sy, int window)
+    {
+        const int left = std::max(0, -sx), right = std::min(a.width,
+                a.width - sx);
+        const int top = std::max(0, -sy), bottom = std::min(a.height,
+                a.height - sy);
+        if (right - left < 8 || bottom - top < 8)
+            return INT_MAX;
+        const int x0 = std::max(left, (left + right - window) / 2);
+        const int y0 = std::max(top, (top + bottom - window) / 2);
+        const int x1 = std::min(right, x0 + window);
+        const int y1 = std::min(bottom, y0 + window);
+
+        long sum = 0;
+        for (int y = y0; y < y1; ++y) {
+            const unsigned char* p = &a.pixels[
+                static_cast<size_t>(y) * a.width];
+            const unsigned char* q = &b.pixels[
+                static_cast<size_t>(y + sy) * b.width + sx];
+            for (int x = x0; x < x1; ++x)
+                sum += std::abs(p[x] - q[x]);
+        }
+        return sum / (static_cast<long>(x1 - x0) * (y1 - y0));
+    }
+};
+
+// Reduces the noise of a camera's frames by averaging each with the
+// last few, after shifting them into line as found by a
+// Thumbnail_matcher. A frame that does not line up with the one before,
+// such as after a turn, starts the history again.
+//
+// The previous frames are copied into a ring of buffers allocated up
+// front, and the average is taken in 16-bit vectors over bands of rows
+// on all cores. Where a shifted frame does not cover the current one,
+// at the edges, the current frame is passed through unchanged. Raw
+// Bayer frames are only ever shifted by whole 2x2 cells, so their
+// colour phase is kept.
+class Temporal_denoiser {
+public:
+    static const int MAX_FRAMES = 4;
+
+    // Averages up to frames frames, including the current one, of
+    // width by height pixels of channels bytes each (3 for BGR or RGB,
+    // 1 for raw Bayer).
+    Temporal_denoiser(int width, int height, int channels, int frames)
+        : width{width}, height{height}, channels{channels},
+          ring(std::max(1, std::min(frames, MAX_FRAMES)) - 1,
+                  std::vector<unsigned char>(
+                      static_cast<size_t>(width) * height * channels)),
+          offsets(ring.size()), stored{0}, next{0}, averaged{0}, shift{0, 0},
+          matcher{width, height, channels},
+          output(static_cast<size_t>(width) * height * channels)
+    {
+    }
+
+    // Disallow copying and moving.
+    Temporal_denoiser(const Temporal_denoiser&) = delete;
+    Temporal_denoiser& operator=(const Temporal_denoiser&) = delete;
+
+    // Whether the denoiser was built for frames of this shape.
+    bool fits(int frame_width, int frame_height, int frame_channels) const
+    {
+        return frame_width == width && frame_height == height
+            && frame_channels == channels;
+    }
+
+    // The number of frames averaged into the last output, one if the
+    // history was started again.
+    int frames_averaged() const
+    {
+        return averaged;
+    }
+
+    // How far the last frame moved from the one before, in pixels.
+    std::pair<int, int> last_shift() const
+    {
+        return shift;
+    }
+
+    // Denoises a frame, which may have a pitch larger than its width,
+    // into a tightly packed buffer that stays valid until the next call.
+    const unsigned char* apply(const unsigned char* pixels, int pitch)
+    {
+        {
+            Trace_span span{"thumbnails"};
+            matcher.add(pixels, pitch);
+        }
+
+        int dx = 0, dy = 0;
+        bool matched = false;
+        if (stored > 0) {
+            Trace_span span{"align"};
+            matched = matcher.match(dx, dy);
+        }
+        if (!matched)
+            stored = 0;
+        shift = {dx, dy};
+
+        // The stored frames are the newest ones, wherever the ring
+        // started again.
+        const int slots = ring.size();
+        for (int i = 0; i < stored; ++i) {
+            auto& offset = offsets[(next - 1 - i + 2 * slots) % slots];
+            offset.first += dx;
+            offset.second += dy;
+        }
+
+        average(pixels, pitch);
+
+        // Keep the frame itself, not the average, for the next ones.
+        if (!ring.empty()) {
+            Trace_span span{"keep frame"};
+            const size_t bytes = static_cast<size_t>(width) * channels;
+            auto& slot = ring[next];
+            for (int y = 0; y < height; ++y)
+                std::memcpy(&slot[y * bytes],
+                        pixels + static_cast<size_t>(y) * pitch, bytes);
+            offsets[next] = {0, 0};
+            next = (next + 1) % ring.size();
+            stored = std::min<int>(stored + 1, ring.size());
+        }
+        return output.data();
+    }
+
+private:
+    const int width;
+    const int height;
+    const int channels;
+
+    // The previous frames, with where each pixel of the current frame
+    // lies in each. The newest is at next - 1.
+    std::vector<std::vector<unsigned char>> ring;
+    std::vector<std::pair<int, int>> offsets;
+    int stored;
+    int next;
+    int averaged;
+    std::pair<int, int> shift;
+
+    Thumbnail_matcher matcher;
+    std::vector<unsigned char> output;
+
+    // Averages the current frame with the stored ones where they all
+    // cover it.
+    void average(const unsigned char* pixels, int pitch)
+    {
+        using namespace denoise_detail;
+        const int count = stored + 1;
+        averaged = count;
+
+        // The rows and columns every stored frame covers.
+        int left = 0, right = width, top = 0, bottom = height;
+        std::vector<const unsigned char*> sources{pixels};
+        std::vector<int> pitches{pitch};
+        std::vector<long> starts{0};
+        const int slots = ring.size();
+        for (int i = 0; i < stored; ++i) {
+            const int slot = (next - 1 - i + 2 * slots) % slots;
+            const auto offset = offsets[slot];
+            left = std::max(left, -offset.first);
+            right = std::min(right, width - offset.first);
+            top = std::max(top, -offset.second);
+            bottom = std::min(bottom, height - offset.second);
+            sources.push_back(ring[slot].data());
+            pitches.push_back(width * channels);
+            starts.push_back(static_cast<long>(offset.second) * width
+                    * channels + offset.first * channels);
+        }
+        if (left >= right || top >= bottom)
+            left = right = top = bottom = 0;
+
+        std::vector<uint16_t> weights;
+        for (int i = 0; i < count; ++i)
+            weights.push_back(WEIGHT_ONE / count
+                    + (i < WEIGHT_ONE % count ? 1 : 0));
+
+        const int bytes = width * channels;
+        const int first = left * channels;
+        const int span = (right - left) * channels;
+        const int row_size = (span + LANES - 1) / LANES * LANES;
+        parallel_for(height, [&](int begin, int end) {
+            Trace_span span_rows{"denoise rows"};
+            std::vector<uint16_t> wide(row_size), sums(row_size);
+            for (int y = begin; y < end; ++y) {
+                const unsigned char* row = pixels
+                    + static_cast<size_t>(y) * pitch;
+                unsigned char* out = &output[static_cast<size_t>(y) * bytes];
+                if (y < top || y >= bottom || span == 0) {
+                    std::memcpy(out, row, bytes);
+                    continue;
+                }
+                std::memcpy(out, row, first);
+                std::memcpy(out + first + span, row + first + span,
+                        bytes - first - span);
+
+                std::fill(sums.begin(), sums.end(), 0);
+                for (int i = 0; i < count; ++i) {
+                    const unsigned char* source = sources[i]
+                        + static_cast<long>(y) * pitches[i] + starts[i]
+                        + first;
+                    std::copy(source, source + span, wide.begin());
+                    const v8u16 weight = v8u16{} + weights[i];
+                    for (int x = 0; x < row_size; x += LANES)
+                        store(&sums[x], load(&sums[x])
+                                + load(&wide[x]) * weight);
+                }
+                const v8u16 half = v8u16{} + WEIGHT_ONE / 2;
+                for (int x = 0; x < span; x += LANES)
+                    store(&sums[x], (load(&sums[x]) + half) >> WEIGHT_BITS);
+                for (int x = 0; x < span; ++x)
+                    out[first + x] = sums[x];
+            }
+        });
+    }
+};
+
+#endif
@@ -0,0 +1,185 @@
+#ifndef MOSLEY_EVENT_LOOP_HPP
+#define MOSLEY_EVENT_LOOP_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <vector>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <zmq.h>
+
+// A single-threaded event loop built on zmq_poll. It multiplexes ZeroMQ
+// sockets, plain file descriptors and timers, and accepts work posted
+// from other threads (camera threads signalling that a frame is ready,
+// for example). Handlers run on the thread that called run() and
+// should return quickly; anything slow belongs on a worker thread that
+// posts its result back. The loop sleeps in zmq_poll until a socket is
+// readable, a timer is due or work is posted, so idle costs nothing.
+class Event_loop {
+public:
+    typedef std::function<void()> Handler;
+    typedef std::chrono::steady_clock Clock;
+
+    Event_loop() : wake_fd{eventfd(0, EFD_NONBLOCK)}, running{false},
+        next_timer{0}
+    {
+        add_fd(wake_fd, [this] { run_posted(); });
+    }
+
+    ~Event_loop()
+    {
+        close(wake_fd);
+    }
+
+    // Disallow copying and moving.
+    Event_loop(const Event_loop&) = delete;
+    Event_loop& operator=(const Event_loop&) = delete;
+
+    void add_socket(void* socket, Handler handler)
+    {
+        items.push_back({socket, 0, ZMQ_POLLIN, 0});
+        handlers.push_back(handler);
+    }
+
+    void add_fd(int fd, Handler handler)
+    {
+        items.push_back({nullptr, fd, ZMQ_POLLIN, 0});
+        handlers.push_back(handler);
+    }
+
+    // Calls the handler after the interval, and every interval after
+    // that if it repeats. Returns an id for cancel_timer().
+    template<typename Duration>
+    int add_timer(Duration interval, Handler handler, bool repeat = true)
+    {
+        const auto period = std::chrono::duration_cast<Clock::duration>(
+                interval);
+        timers[next_timer] = Timer{Clock::now() + period, period, repeat,
+            handler};
+        return next_timer++;
+    }
+
+    void cancel_timer(int id)
+    {
+        timers.erase(id);
+    }
+
+    // Queues a handler to run on the loop thread. Safe to call from any
+    // thread.
+    void post(Handler handler)
+    {
+        {
+            std::lock_guard<std::mutex> lock{mutex};
+            posted.push_back(handler);
+        }
+        const uint64_t one = 1;
+        ssize_t unused = write(wake_fd, &one, sizeof(one));
+        (void)unused;
+    }
+
+    void run()
+    {
+        running = true;
+        while (running) {
+            const int rc = zmq_poll(items.data(), items.size(), timeout());
+            if (rc < 0 && zmq_errno() != EINTR)
+                break;
+
+            // Handlers may register more sockets, so only look at the
+            // ones that were polled and copy each handler before use.
+            const size_t polled = rc > 0 ? items.size() : 0;
+            for (size_t i = 0; i < polled && running; ++i) {
+                if (items[i].revents & ZMQ_POLLIN) {
+                    const Handler handler = handlers[i];
+                    handler();
+                }
+            }
+            run_timers();
+        }
+    }
+
+    // Makes run() return once the current handler finishes.
+    void stop()
+    {
+        running = false;
+    }
+
+private:
+    struct Timer {
+        Clock::time_point due;
+        Clock::duration interval;
+        bool repeat;
+        Handler handler;
+    };
+
+    const int wake_fd;
+    bool running;
+    int next_timer;
+    std::vector<zmq_pollitem_t> items;
+    std::vector<Handler> handlers;
+    std::map<int, Timer> timers;
+
+    std::mutex mutex;
+    std::vector<Handler> posted;
+
+    // Milliseconds until the earliest timer is due, or -1 to block.
+    long timeout() const
+    {
+        if (timers.empty())
+            return -1;
+        auto due = timers.begin()->second.due;
+        for (const auto& timer : timers)
+            due = std::min(due, timer.second.due);
+
+        using namespace std::chrono;
+        const auto wait = duration_cast<microseconds>(due - Clock::now());
+        return std::max<long>(0, (wait.count() + 999) / 1000);
+    }
+
+    void run_timers()
+    {
+        const auto now = Clock::now();
+        std::vector<int> due;
+        for (const auto& timer : timers)
+            if (timer.second.due <= now)
+                due.push_back(timer.first);
+
+        for (int id : due) {
+            // The timer may have been cancelled by an earlier handler.
+            auto it = timers.find(id);
+            if (it == timers.end())
+                continue;
+            const Handler handler = it->second.handler;
+
+            // Repeating timers keep a fixed rate; ticks missed while
+            // a handler overran are skipped rather than run late.
+            if (it->second.repeat)
+                while (it->second.due <= now)
+                    it->second.due += it->second.interval;
+            else
+                timers.erase(it);
+            handler();
+        }
+    }
+
+    void run_posted()
+    {
+        uint64_t count;
+        ssize_t unused = read(wake_fd, &count, sizeof(count));
+        (void)unused;
+
+        std::vector<Handler> batch;
+        {
+            std::lock_guard<std::mutex> lock{mutex};
+            batch.swap(posted);
+        }
+        for (const auto& handler : batch)
+            handler();
+    }
+};
+
+#endif
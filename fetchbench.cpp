@@ -0,0 +1,132 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <zmq.h>
+#include "client.hpp"
+#include "link.hpp"
+
+// Measures how the frame rate a single client gets from mosley grows
+// with the number of requests it keeps in flight. A relay in front of
+// the server holds every message back for a fixed delay each way, and
+// can limit the bandwidth too, to stand in for the radio link on
+// localhost. Each step prints the frame rate, bandwidth and request
+// latency for one window size.
+//
+// For example, against `mosley --synthetic`:
+//
+//     fetchbench --delay 50 --window 8
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Options {
+    std::string endpoint = "tcp://localhost:5555";
+    int delay = 0;              // ms each way
+    double rate = 0;            // MB/s each way, 0 for no limit
+    int window = 8;             // largest number of requests in flight
+    double duration = 10;       // seconds per step
+    std::string command = "snap";
+};
+
+double percentile(std::vector<double>& sample, double p)
+{
+    if (sample.empty())
+        return 0;
+    std::sort(sample.begin(), sample.end());
+    const size_t i = std::min(sample.size() - 1,
+            static_cast<size_t>(p / 100 * sample.size()));
+    return sample[i];
+}
+
+void run_step(void* context, const Options& options,
+        const std::string& endpoint, int window)
+{
+    using namespace std::chrono;
+
+    Client client{context, endpoint, window, options.command};
+    std::vector<double> latencies;
+    unsigned long long bytes = 0;
+    const auto start = Clock::now();
+    const auto deadline = start + duration_cast<Clock::duration>(
+            duration<double>(options.duration));
+
+    Client_frame frame;
+    while (Clock::now() < deadline) {
+        if (!client.next(frame, Client::TIMEOUT_MS))
+            continue;
+        latencies.push_back(
+                duration<double, std::milli>(frame.latency).count());
+        bytes += frame.image_size;
+    }
+    const double wall = duration<double>(Clock::now() - start).count();
+
+    std::cout << std::setw(7) << window
+        << std::setw(10) << latencies.size() / wall
+        << std::setw(9) << bytes / wall / 1e6
+        << std::setw(9) << percentile(latencies, 50)
+        << std::setw(9) << percentile(latencies, 99)
+        << std::setw(8) << client.error_count() << std::endl;
+}
+
+void usage(const char* name)
+{
+    std::cerr << "usage: " << name << " [--endpoint addr] [--delay ms]"
+        << " [--rate MB/s] [--window max] [--duration s]"
+        << " [--command snap|next]\n";
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+    Options options;
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg{argv[i]};
+        const bool value = i+1 < argc;
+        if (arg == "--endpoint" && value) {
+            options.endpoint = argv[++i];
+        } else if (arg == "--delay" && value) {
+            options.delay = std::atoi(argv[++i]);
+        } else if (arg == "--rate" && value) {
+            options.rate = std::atof(argv[++i]);
+        } else if (arg == "--window" && value) {
+            options.window = std::atoi(argv[++i]);
+        } else if (arg == "--duration" && value) {
+            options.duration = std::atof(argv[++i]);
+        } else if (arg == "--command" && value) {
+            options.command = argv[++i];
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    void* context = zmq_ctx_new();
+    try {
+        std::unique_ptr<Link_relay> relay;
+        std::string endpoint = options.endpoint;
+        if (options.delay > 0 || options.rate > 0) {
+            relay.reset(new Link_relay{context, options.endpoint,
+                    options.delay, options.rate * 1e6});
+            endpoint = Link_relay::ENDPOINT;
+        }
+
+        std::cout << std::setw(7) << "window" << std::setw(10) << "frames/s"
+            << std::setw(9) << "MB/s" << std::setw(9) << "p50 ms"
+            << std::setw(9) << "p99 ms" << std::setw(8) << "errors"
+            << std::endl;
+        for (int window = 1; window < 2*options.window; window *= 2)
+            run_step(context, options, endpoint,
+                    std::min(window, options.window));
+    } catch (std::runtime_error& e) {
+        std::cerr << e.what() << std::endl;
+        zmq_ctx_destroy(context);
+        return 1;
+    }
+    zmq_ctx_destroy(context);
+}
@@ -0,0 +1,370 @@
+#ifndef MOSLEY_FOOTPRINT_HPP
+#define MOSLEY_FOOTPRINT_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <limits>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "position.hpp"
+#include "undistort.hpp"
+
+// A rectangle of latitude and longitude in degrees. Footprints are
+// assumed not to straddle the antimeridian.
+struct Ground_box {
+    double south;
+    double west;
+    double north;
+    double east;
+
+    static Ground_box empty()
+    {
+        const double inf = std::numeric_limits<double>::infinity();
+        return Ground_box{inf, inf, -inf, -inf};
+    }
+
+    void expand(const Ground_box& other)
+    {
+        south = std::min(south, other.south);
+        west = std::min(west, other.west);
+        north = std::max(north, other.north);
+        east = std::max(east, other.east);
+    }
+
+    double area() const
+    {
+        return (north - south) * (east - west);
+    }
+
+    // How much the area grows on taking in the other box.
+    double enlargement(const Ground_box& other) const
+    {
+        Ground_box both = *this;
+        both.expand(other);
+        return both.area() - area();
+    }
+
+    bool contains(double latitude, double longitude) const
+    {
+        return latitude >= south && latitude <= north
+            && longitude >= west && longitude <= east;
+    }
+};
+
+// The patch of ground one frame covers: the corners of the frame
+// projected onto the ground, in order around it.
+struct Footprint {
+    int camera;
+    unsigned long sequence;
+    uint64_t timestamp;
+    double latitude[4];
+    double longitude[4];
+
+    Ground_box bounds() const
+    {
+        Ground_box box = Ground_box::empty();
+        for (int i = 0; i < 4; ++i)
+            box.expand(Ground_box{latitude[i], longitude[i], latitude[i],
+                    longitude[i]});
+        return box;
+    }
+
+    // Whether the point is inside the quadrilateral, by counting the
+    // edges a ray from it crosses.
+    bool covers(double lat, double lon) const
+    {
+        bool inside = false;
+        for (int i = 0, j = 3; i < 4; j = i++)
+            if ((latitude[i] > lat) != (latitude[j] > lat)
+                    && lon < longitude[j] + (lat - latitude[j])
+                        * (longitude[i] - longitude[j])
+                        / (latitude[i] - latitude[j]))
+                inside = !inside;
+        return inside;
+    }
+};
+
+// Projects a frame of the given size onto flat ground at an altitude
+// in metres above the ellipsoid, seen from a position and heading in
+// degrees. The camera is taken to look straight down with the top of
+// its frames towards the heading; the lens intrinsics are adjusted to a
+// frame with its top-left pixel at (left, top) on the sensor, as
+// frame_intrinsics() does, and the distortion, slight at the corners,
+// is ignored. Returns false if the camera is not above the ground.
+inline bool ground_footprint(const Lens& calibration, int width,
+        int height, int left, int top, const Position& position,
+        double heading, double ground, Footprint& footprint)
+{
+    const double above = position.altitude - ground;
+    if (above <= 0)
+        return false;
+    const Lens lens = frame_intrinsics(calibration, width, height, left,
+            top);
+    const double c = std::cos(heading * DEGREES);
+    const double s = std::sin(heading * DEGREES);
+    const double corners[4][2] = {{0, 0}, {1, 0}, {1, 1}, {0, 1}};
+    for (int i = 0; i < 4; ++i) {
+        const double right = (corners[i][0] * width - lens.cx) / lens.fx
+            * above;
+        const double back = (corners[i][1] * height - lens.cy) / lens.fy
+            * above;
+        const Position ground_point = offset(position,
+                right * c - back * s, -right * s - back * c);
+        footprint.latitude[i] = ground_point.latitude;
+        footprint.longitude[i] = ground_point.longitude;
+    }
+    footprint.timestamp = position.timestamp;
+    return true;
+}
+
+// An R-tree over the footprints of the archived frames, for finding the
+// frames that cover a point on the ground without looking at them all.
+// Inner nodes hold the bounding boxes of up to NODE_SIZE children;
+// insertion descends to the leaf whose box grows least and splits full
+// nodes in two around the pair of entries that would waste the most
+// area together, as in Guttman's quadratic split.
+//
+// Every footprint is also appended to a text file, a line of
+//
+//     camera sequence timestamp lat0 lon0 lat1 lon1 lat2 lon2 lat3 lon3
+//
+// each, which is read back into the tree when the index is opened, so
+// the index survives restarts along with the archive. A line cut short
+// by a crash is skipped.
+//
+// Sequence numbers start again with every run, and the archive then
+// overwrites the frames of earlier runs. A footprint therefore replaces
+// any earlier one of the same camera and sequence number: the old one
+// stays in the tree but is never returned, and is left out of the file
+// when it is next opened.
+class Footprint_index {
+public:
+    static const int NODE_SIZE = 16;
+
+    explicit Footprint_index(const std::string& path)
+        : stale{0}, root{0}
+    {
+        nodes.push_back(Node{Ground_box::empty(), true, {}});
+        std::ifstream existing(path);
+        std::string line;
+        while (std::getline(existing, line)) {
+            std::istringstream fields{line};
+            Footprint footprint;
+            fields >> footprint.camera >> footprint.sequence
+                >> footprint.timestamp;
+            for (int i = 0; i < 4; ++i)
+                fields >> footprint.latitude[i] >> footprint.longitude[i];
+            if (fields)
+                add(footprint);
+        }
+        existing.close();
+
+        if (stale > 0) {
+            const std::string rewritten = path + ".new";
+            std::ofstream out(rewritten);
+            out << std::setprecision(12);
+            for (size_t i = 0; i < footprints.size(); ++i)
+                if (live[i])
+                    write(out, footprints[i]);
+            out.close();
+            if (!out || std::rename(rewritten.c_str(), path.c_str()) != 0)
+                throw std::runtime_error{"could not rewrite footprints "
+                    + path};
+        }
+
+        file.open(path, std::ios::app);
+        if (!file)
+            throw std::runtime_error{"could not open footprints " + path};
+        file << std::setprecision(12);
+    }
+
+    // Disallow copying and moving.
+    Footprint_index(const Footprint_index&) = delete;
+    Footprint_index& operator=(const Footprint_index&) = delete;
+
+    void insert(const Footprint& footprint)
+    {
+        add(footprint);
+        write(file, footprint);
+        file.flush();
+    }
+
+    // The footprints covering a point, in no particular order.
+    std::vector<const Footprint*> covering(double latitude,
+            double longitude) const
+    {
+        std::vector<const Footprint*> found;
+        std::vector<int> stack{root};
+        while (!stack.empty()) {
+            const Node& node = nodes[stack.back()];
+            stack.pop_back();
+            for (const int child : node.children) {
+                if (!box(node, child).contains(latitude, longitude))
+                    continue;
+                if (!node.leaf)
+                    stack.push_back(child);
+                else if (live[child]
+                        && footprints[child].covers(latitude, longitude))
+                    found.push_back(&footprints[child]);
+            }
+        }
+        return found;
+    }
+
+    // The footprints that have not been replaced.
+    size_t size() const
+    {
+        return footprints.size() - stale;
+    }
+
+private:
+    // The children of a leaf are footprints, those of other nodes are
+    // nodes, both by index.
+    struct Node {
+        Ground_box box;
+        bool leaf;
+        std::vector<int> children;
+    };
+
+    std::vector<Footprint> footprints;
+    std::vector<Ground_box> bounds;     // of each footprint
+    std::vector<bool> live;             // not replaced by a later one
+    std::map<std::pair<int, unsigned long>, int> latest;
+    size_t stale;
+    std::vector<Node> nodes;
+    int root;
+    std::ofstream file;
+
+    static void write(std::ostream& out, const Footprint& footprint)
+    {
+        out << footprint.camera << ' ' << footprint.sequence << ' '
+            << footprint.timestamp;
+        for (int i = 0; i < 4; ++i)
+            out << ' ' << footprint.latitude[i] << ' '
+                << footprint.longitude[i];
+        out << '\n';
+    }
+
+    const Ground_box& box(const Node& node, int child) const
+    {
+        return node.leaf ? bounds[child] : nodes[child].box;
+    }
+
+    void add(const Footprint& footprint)
+    {
+        const auto frame = std::make_pair(footprint.camera,
+                footprint.sequence);
+        const auto previous = latest.find(frame);
+        if (previous != latest.end()) {
+            live[previous->second] = false;
+            ++stale;
+        }
+        latest[frame] = footprints.size();
+        footprints.push_back(footprint);
+        bounds.push_back(footprint.bounds());
+        live.push_back(true);
+        const int sibling = insert(root, footprints.size() - 1,
+                bounds.back());
+        if (sibling < 0)
+            return;
+        Ground_box both = nodes[root].box;
+        both.expand(nodes[sibling].box);
+        nodes.push_back(Node{both, false, {root, sibling}});
+        root = nodes.size() - 1;
+    }
+
+    // Inserts a footprint under a node, returning the new node split off
+    // it if it overflowed, or -1. Nodes may move as others are added, so
+    // they are only held by index.
+    int insert(int node, int footprint, const Ground_box& area)
+    {
+        nodes[node].box.expand(area);
+        if (nodes[node].leaf) {
+            nodes[node].children.push_back(footprint);
+        } else {
+            int best = -1;
+            double best_growth = 0;
+            for (const int child : nodes[node].children) {
+                const double growth = nodes[child].box.enlargement(area);
+                if (best < 0 || growth < best_growth
+                        || (growth == best_growth && nodes[child].box.area()
+                            < nodes[best].box.area())) {
+                    best = child;
+                    best_growth = growth;
+                }
+            }
+            const int sibling = insert(best, footprint, area);
+            if (sibling >= 0)
+                nodes[node].children.push_back(sibling);
+        }
+        if (nodes[node].children.size() <= NODE_SIZE)
+            return -1;
+        return split(node);
+    }
+
+    // Splits the children of an overflowing node between it and a new
+    // node, which is returned.
+    int split(int node)
+    {
+        const std::vector<int> children = std::move(nodes[node].children);
+        const bool leaf = nodes[node].leaf;
+        auto child_box = [&](int child) {
+            return leaf ? bounds[child] : nodes[child].box;
+        };
+
+        // The seeds are the pair that would waste the most area in one
+        // node.
+        size_t first = 0;
+        size_t second = 1;
+        double worst = -std::numeric_limits<double>::infinity();
+        for (size_t i = 0; i < children.size(); ++i)
+            for (size_t j = i + 1; j < children.size(); ++j) {
+                Ground_box both = child_box(children[i]);
+                both.expand(child_box(children[j]));
+                const double waste = both.area()
+                    - child_box(children[i]).area()
+                    - child_box(children[j]).area();
+                if (waste > worst) {
+                    worst = waste;
+                    first = i;
+                    second = j;
+                }
+            }
+
+        Node groups[2] = {
+            Node{child_box(children[first]), leaf, {children[first]}},
+            Node{child_box(children[second]), leaf, {children[second]}},
+        };
+        const size_t minimum = NODE_SIZE / 3;
+        size_t left = children.size() - 2;
+        for (size_t i = 0; i < children.size(); ++i) {
+            if (i == first || i == second)
+                continue;
+            const Ground_box& area = child_box(children[i]);
+            int group;
+            if (groups[0].children.size() + left == minimum)
+                group = 0;
+            else if (groups[1].children.size() + left == minimum)
+                group = 1;
+            else
+                group = groups[1].box.enlargement(area)
+                    < groups[0].box.enlargement(area) ? 1 : 0;
+            groups[group].box.expand(area);
+            groups[group].children.push_back(children[i]);
+            --left;
+        }
+
+        nodes[node] = std::move(groups[0]);
+        nodes.push_back(std::move(groups[1]));
+        return nodes.size() - 1;
+    }
+};
+
+#endif
@@ -0,0 +1,147 @@
+#ifndef MOSLEY_FRAME_HPP
+#define MOSLEY_FRAME_HPP
+
+#include <chrono>
+#include <cstdint>
+#include <vector>
+#include <msgpack.hpp>
+#include "demosaic.hpp"
+#include "jpeg.hpp"
+#include "trace.hpp"
+#include "undistort.hpp"
+
+// The layout of the pixels in a frame. BGR is what the uEye driver
+// delivers in colour mode, RGB is what libjpeg decodes to and BAYER is
+// the unprocessed 8-bit sensor data.
+enum class Pixel_format { BGR, RGB, BAYER };
+
+// A captured image. The pixels belong to the source that produced the
+// frame and stay valid until the next call to grab() on that source.
+struct Frame {
+    int camera;
+    unsigned long sequence;  // counts the frames of each camera
+    uint64_t timestamp;  // capture time in microseconds since the epoch
+    int width;
+    int height;
+    int pitch;
+    Pixel_format format;
+    Bayer_pattern pattern;
+    const unsigned char* pixels;
+    int left;   // of the frame on the sensor, non-zero for an AOI
+    int top;
+};
+
+// Bus and transfer counters for one physical camera, as reported to
+// clients asking for "stats".
+struct Camera_stats {
+    int id;
+    unsigned pixel_clock;
+    double frame_rate;
+    unsigned long frames;
+    unsigned long retries;
+    unsigned long dropped;
+    unsigned long transfer_failures;
+
+    MSGPACK_DEFINE(id, pixel_clock, frame_rate, frames, retries, dropped,
+            transfer_failures);
+};
+
+// Anything that can feed frames into the serving path: the cameras, a
+// replay of recorded imagery or a synthetic pattern.
+class Frame_source {
+public:
+    virtual ~Frame_source() {}
+
+    // Blocks until the next frame is available.
+    virtual Frame grab() = 0;
+
+    virtual std::vector<Camera_stats> stats() const { return {}; }
+};
+
+inline uint64_t now_us()
+{
+    using namespace std::chrono;
+    return duration_cast<microseconds>(
+            system_clock::now().time_since_epoch()).count();
+}
+
+// Compresses frames of any pixel format, demosaicing raw frames into a
+// buffer that is kept between calls. Given an undistorter for the
+// frame's camera and size, the pixels are undistorted before encoding.
+class Frame_encoder {
+public:
+    std::vector<unsigned char> encode(const Frame& frame, int quality,
+            const Undistorter* undistorter = nullptr)
+    {
+        Trace_span span{"encode", static_cast<long>(frame.sequence)};
+        const unsigned char* pixels;
+        int pitch;
+        J_COLOR_SPACE space;
+        prepare(frame, undistorter, pixels, pitch, space);
+        return encode_jpeg(pixels, frame.width, frame.height, space,
+                quality, pitch);
+    }
+
+    // Encodes a frame like encode(), handing the JPEG to the sink in
+    // chunks of at most chunk_size bytes as they are compressed.
+    void encode(const Frame& frame, int quality,
+            const Undistorter* undistorter, size_t chunk_size,
+            const Jpeg_sink& sink)
+    {
+        Trace_span span{"encode", static_cast<long>(frame.sequence)};
+        const unsigned char* pixels;
+        int pitch;
+        J_COLOR_SPACE space;
+        prepare(frame, undistorter, pixels, pitch, space);
+        encode_jpeg(pixels, frame.width, frame.height, space, quality,
+                pitch, chunk_size, sink);
+    }
+
+    // Time the last call spent demosaicing, zero for colour frames.
+    std::chrono::steady_clock::duration demosaic_time;
+
+    // Time the last call spent undistorting, zero if it did not.
+    std::chrono::steady_clock::duration undistort_time;
+
+private:
+    std::vector<unsigned char> rgb;
+    std::vector<unsigned char> corrected;
+
+    // Works out the pixels to compress, demosaicing and undistorting as
+    // needed.
+    void prepare(const Frame& frame, const Undistorter* undistorter,
+            const unsigned char*& pixels, int& pitch, J_COLOR_SPACE& space)
+    {
+        using namespace std::chrono;
+        const long sequence = frame.sequence;
+        pixels = frame.pixels;
+        pitch = frame.pitch;
+        space = frame.format == Pixel_format::BGR ? JCS_EXT_BGR : JCS_RGB;
+        demosaic_time = {};
+        undistort_time = {};
+
+        if (frame.format == Pixel_format::BAYER) {
+            const auto start = steady_clock::now();
+            Trace_span span{"demosaic", sequence};
+            rgb.resize(static_cast<size_t>(frame.width) * frame.height * 3);
+            demosaic(frame.pixels, frame.width, frame.height,
+                    frame.pitch, frame.pattern, rgb.data());
+            pixels = rgb.data();
+            pitch = frame.width * 3;
+            demosaic_time = steady_clock::now() - start;
+        }
+
+        if (undistorter) {
+            const auto start = steady_clock::now();
+            Trace_span span{"undistort", sequence};
+            corrected.resize(
+                    static_cast<size_t>(frame.width) * frame.height * 3);
+            undistorter->apply(pixels, pitch, corrected.data());
+            pixels = corrected.data();
+            pitch = frame.width * 3;
+            undistort_time = steady_clock::now() - start;
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,208 @@
+#ifndef MOSLEY_HDR_HPP
+#define MOSLEY_HDR_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+#include "parallel.hpp"
+#include "simd.hpp"
+#include "trace.hpp"
+
+namespace hdr_detail {
+
+using namespace simd;
+
+} // namespace hdr_detail
+
+// Copies an exposure of a bracket into the output shifted into line
+// with the reference exposure, so that output pixel (x, y) is the
+// exposure's (x + dx, y + dy). Where the exposure does not cover the
+// reference, the reference's own pixel is taken instead. All three have
+// the same pitch.
+inline void shift_exposure(const unsigned char* exposure,
+        const unsigned char* reference, int width, int height, int pitch,
+        int channels, int dx, int dy, unsigned char* output)
+{
+    const int left = std::min(width, std::max(0, -dx));
+    const int right = std::max(left, std::min(width, width - dx));
+    parallel_for(height, [&](int begin, int end) {
+        for (int y = begin; y < end; ++y) {
+            const unsigned char* own = reference
+                + static_cast<size_t>(y) * pitch;
+            unsigned char* out = output + static_cast<size_t>(y) * pitch;
+            if (y + dy < 0 || y + dy >= height) {
+                std::memcpy(out, own, static_cast<size_t>(width) * channels);
+                continue;
+            }
+            const unsigned char* row = exposure
+                + static_cast<size_t>(y + dy) * pitch;
+            std::memcpy(out, own, left * channels);
+            std::memcpy(out + left * channels, row + (left + dx) * channels,
+                    (right - left) * channels);
+            std::memcpy(out + right * channels, own + right * channels,
+                    (width - right) * channels);
+        }
+    });
+}
+
+// Merges a bracket of differently exposed frames of the same scene into
+// one frame by exposure fusion: every pixel is a weighted average of the
+// exposures, each weighted by how well exposed it is there, that is how
+// close its brightness is to mid-grey. Nothing is tone mapped and the
+// exposure times need not be known, so the result can be encoded like
+// any other frame. The exposures must already be in line with each
+// other; see shift_exposure().
+//
+// The weights of BGR frames come from each pixel's luma. Raw Bayer
+// frames are fused before demosaicing, with one weight per 2x2 cell so
+// the colours of a cell stay in balance. The blend is a single-scale
+// one, done in 16-bit vectors over bands of rows on all cores; it is
+// cheaper than a pyramid blend, at the cost of softer transitions where
+// the best exposure changes.
+class Exposure_fusion {
+public:
+    static const int MAX_EXPOSURES = 3;
+
+    Exposure_fusion()
+    {
+        // A Gaussian around mid-grey, never quite zero so that a pixel
+        // clipped in every exposure still has weights to share.
+        for (int level = 0; level < 256; ++level) {
+            const double d = (level - 127.5) / 255 / SIGMA;
+            weight[level] = std::max(1, static_cast<int>(
+                        std::lround(255 * std::exp(-d * d / 2))));
+        }
+        for (size_t sum = 1; sum < share.size(); ++sum)
+            share[sum] = (hdr_detail::WEIGHT_ONE << 16) / sum;
+    }
+
+    // Fuses images of width by height pixels of channels bytes each (3
+    // for BGR or RGB, 1 for raw Bayer) with a common pitch into a tightly
+    // packed output.
+    void fuse(const std::vector<const unsigned char*>& images, int width,
+            int height, int pitch, int channels, unsigned char* output) const
+    {
+        using namespace hdr_detail;
+        const int count = images.size();
+        if (count < 1 || count > MAX_EXPOSURES)
+            throw std::runtime_error{"cannot fuse that many exposures"};
+        const int bytes = width * channels;
+        const int row_size = (bytes + LANES - 1) / LANES * LANES;
+
+        // Raw frames are weighted in pairs of rows, so bands start on
+        // even rows.
+        parallel_for((height + 1) / 2, [&](int begin, int end) {
+            Trace_span span{"fuse rows"};
+            std::vector<uint16_t> weights(count * row_size);
+            std::vector<uint16_t> wide(row_size);
+            std::vector<uint16_t> sums(row_size);
+            for (int y = 2 * begin; y < std::min(height, 2 * end); ++y) {
+                if (channels == 1 && y % 2 == 1) {
+                    // The second row of a cell keeps the first's weights.
+                } else if (channels == 1) {
+                    raw_weights(images, width, pitch, y,
+                            y + 1 < height ? y + 1 : y, row_size,
+                            weights.data());
+                } else {
+                    colour_weights(images, width, pitch, y, channels,
+                            row_size, weights.data());
+                }
+
+                std::fill(sums.begin(), sums.end(), 0);
+                for (int i = 0; i < count; ++i) {
+                    const unsigned char* row = images[i]
+                        + static_cast<size_t>(y) * pitch;
+                    std::copy(row, row + bytes, wide.begin());
+                    const uint16_t* w = &weights[i * row_size];
+                    for (int x = 0; x < row_size; x += LANES)
+                        store(&sums[x], load(&sums[x])
+                                + load(&wide[x]) * load(w + x));
+                }
+
+                const v8u16 half = v8u16{} + WEIGHT_ONE / 2;
+                for (int x = 0; x < row_size; x += LANES)
+                    store(&sums[x], (load(&sums[x]) + half) >> WEIGHT_BITS);
+                unsigned char* out = output
+                    + static_cast<size_t>(y) * bytes;
+                for (int x = 0; x < bytes; ++x)
+                    out[x] = sums[x];
+            }
+        });
+    }
+
+private:
+    static constexpr double SIGMA = 0.2;   // of the well-exposedness curve
+
+    int weight[256];
+    std::vector<uint32_t> share = std::vector<uint32_t>(
+            255 * MAX_EXPOSURES + 1);
+
+    // Splits WEIGHT_ONE between the exposures in proportion to their
+    // weights at one point; the last takes the rounding so the weights
+    // always sum exactly.
+    void normalise(const int* levels, int count, uint16_t* out) const
+    {
+        int sum = 0;
+        for (int i = 0; i < count; ++i)
+            sum += weight[levels[i]];
+        int given = 0;
+        for (int i = 0; i + 1 < count; ++i) {
+            out[i] = (weight[levels[i]] * share[sum]) >> 16;
+            given += out[i];
+        }
+        out[count - 1] = hdr_detail::WEIGHT_ONE - given;
+    }
+
+    // Weights per byte of a row of colour pixels, from their luma.
+    void colour_weights(const std::vector<const unsigned char*>& images,
+            int width, int pitch, int y, int channels, int row_size,
+            uint16_t* weights) const
+    {
+        const int count = images.size();
+        for (int x = 0; x < width; ++x) {
+            int levels[MAX_EXPOSURES];
+            for (int i = 0; i < count; ++i) {
+                const unsigned char* p = images[i]
+                    + static_cast<size_t>(y) * pitch + x * channels;
+                levels[i] = (p[0] + 2 * p[1] + p[2]) >> 2;
+            }
+            uint16_t w[MAX_EXPOSURES];
+            normalise(levels, count, w);
+            for (int i = 0; i < count; ++i)
+                std::fill_n(&weights[i * row_size + x * channels], channels,
+                        w[i]);
+        }
+    }
+
+    // Weights per byte of a pair of raw rows, from the mean of each 2x2
+    // cell.
+    void raw_weights(const std::vector<const unsigned char*>& images,
+            int width, int pitch, int y, int next, int row_size,
+            uint16_t* weights) const
+    {
+        const int count = images.size();
+        for (int x = 0; x < width; x += 2) {
+            const int right = x + 1 < width ? x + 1 : x;
+            int levels[MAX_EXPOSURES];
+            for (int i = 0; i < count; ++i) {
+                const unsigned char* top = images[i]
+                    + static_cast<size_t>(y) * pitch;
+                const unsigned char* bottom = images[i]
+                    + static_cast<size_t>(next) * pitch;
+                levels[i] = (top[x] + top[right] + bottom[x]
+                        + bottom[right]) >> 2;
+            }
+            uint16_t w[MAX_EXPOSURES];
+            normalise(levels, count, w);
+            for (int i = 0; i < count; ++i) {
+                weights[i * row_size + x] = w[i];
+                weights[i * row_size + right] = w[i];
+            }
+        }
+    }
+};
+
+#endif
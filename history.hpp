@@ -0,0 +1,344 @@
+#ifndef MOSLEY_HISTORY_HPP
+#define MOSLEY_HISTORY_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include <msgpack.hpp>
+#include "frame.hpp"
+#include "trace.hpp"
+
+#ifdef MOSLEY_LZ4
+#include <lz4.h>
+#endif
+
+// What the frame history holds and what keeping it has cost so far.
+struct History_stats {
+    unsigned long frames;       // held now, over all cameras
+    double seconds;             // between the oldest and newest held
+    unsigned long long bytes;   // held now, including frozen frames
+    unsigned long long limit;
+    unsigned long added;
+    unsigned long skipped;      // the compressor was still busy
+    unsigned long evicted;      // dropped early to stay within the limit
+    double ratio;               // raw over stored bytes
+    double compress_rate;       // MB/s of raw frames through the compressor
+
+    MSGPACK_DEFINE(frames, seconds, bytes, limit, added, skipped, evicted,
+            ratio, compress_rate);
+};
+
+// Keeps the last few seconds of full-resolution frames of every camera
+// in RAM, as they came off the sensor, so that an event noticed late can
+// still be captured from just before it happened. Frames older than the
+// window are dropped, and so are the oldest frames whenever keeping a
+// new one would go over the memory limit.
+//
+// add() copies a frame on the caller's thread and hands it to a thread
+// of its own, which compresses it with LZ4 when that is enabled and the
+// build has it. The copy is the only cost to the caller: a frame that
+// arrives while the last one is still being compressed is skipped
+// rather than queued, so compression never uses more than one core and
+// never holds up capture.
+//
+// freeze() takes a window of frames out of reach of eviction. Frozen
+// frames still count against the limit until the last reference to
+// them goes, so the history never holds more than the limit in all.
+class Frame_history {
+public:
+    // A frame of the history. The pixels are tightly packed rows,
+    // possibly compressed.
+    struct Entry {
+        Frame frame;            // with no pixels
+        std::vector<char> data;
+        size_t raw_size;
+        bool compressed;
+    };
+
+    typedef std::shared_ptr<const Entry> Entry_ref;
+
+    static bool lz4_available()
+    {
+#ifdef MOSLEY_LZ4
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    Frame_history(double seconds, size_t limit, bool compress)
+        : window_us{static_cast<uint64_t>(seconds * 1e6)}, limit{limit},
+          compress{compress}, held{std::make_shared<Held>()},
+          waiting{false}, done{false}, added{0}, skipped{0}, evicted{0},
+          raw_in{0}, stored{0}, compress_time{}
+    {
+        if (compress && !lz4_available())
+            throw std::runtime_error{"built without LZ4"};
+        worker = std::thread{&Frame_history::store_frames, this};
+    }
+
+    ~Frame_history()
+    {
+        {
+            std::lock_guard<std::mutex> lock{mutex};
+            done = true;
+        }
+        ready.notify_one();
+        worker.join();
+    }
+
+    // Disallow copying and moving.
+    Frame_history(const Frame_history&) = delete;
+    Frame_history& operator=(const Frame_history&) = delete;
+
+    // Copies a frame into the history, unless the last frame is still
+    // being stored, in which case it returns false.
+    bool add(const Frame& frame)
+    {
+        Trace_span span{"history", static_cast<long>(frame.sequence)};
+        std::unique_lock<std::mutex> lock{mutex};
+        if (waiting) {
+            ++skipped;
+            return false;
+        }
+        lock.unlock();
+
+        const int channels = frame.format == Pixel_format::BAYER ? 1 : 3;
+        const size_t row = static_cast<size_t>(frame.width) * channels;
+        incoming.resize(row * frame.height);
+        for (int y = 0; y < frame.height; ++y)
+            std::memcpy(&incoming[y * row],
+                    frame.pixels + static_cast<size_t>(y) * frame.pitch,
+                    row);
+        incoming_frame = frame;
+        incoming_frame.pitch = row;
+        incoming_frame.pixels = nullptr;
+
+        lock.lock();
+        waiting = true;
+        lock.unlock();
+        ready.notify_one();
+        return true;
+    }
+
+    // The frames of every camera taken from..to, in microseconds since
+    // the epoch, oldest first. They stay in memory while referenced.
+    std::vector<Entry_ref> freeze(uint64_t from, uint64_t to) const
+    {
+        std::vector<Entry_ref> frozen;
+        std::lock_guard<std::mutex> lock{mutex};
+        for (const auto& camera : cameras)
+            for (const auto& entry : camera.second)
+                if (entry->frame.timestamp >= from
+                        && entry->frame.timestamp <= to)
+                    frozen.push_back(entry);
+        std::sort(frozen.begin(), frozen.end(),
+                [](const Entry_ref& a, const Entry_ref& b) {
+                    return a->frame.timestamp < b->frame.timestamp;
+                });
+        return frozen;
+    }
+
+    // Restores the pixels of an entry into the buffer and returns the
+    // frame pointing at them.
+    static Frame expand(const Entry& entry,
+            std::vector<unsigned char>& buffer)
+    {
+        Frame frame = entry.frame;
+        buffer.resize(entry.raw_size);
+        if (!entry.compressed) {
+            std::copy(entry.data.begin(), entry.data.end(), buffer.begin());
+        } else {
+#ifdef MOSLEY_LZ4
+            const int size = LZ4_decompress_safe(entry.data.data(),
+                    reinterpret_cast<char*>(buffer.data()),
+                    entry.data.size(), buffer.size());
+            if (size != static_cast<int>(buffer.size()))
+                throw std::runtime_error{"corrupt frame in the history"};
+#endif
+        }
+        frame.pixels = buffer.data();
+        return frame;
+    }
+
+    History_stats stats() const
+    {
+        using namespace std::chrono;
+        std::lock_guard<std::mutex> lock{mutex};
+        History_stats stats{0, 0, bytes_held(), limit, added, skipped,
+            evicted, stored > 0 ? static_cast<double>(raw_in) / stored : 0,
+            0};
+        uint64_t oldest = UINT64_MAX;
+        uint64_t newest = 0;
+        for (const auto& camera : cameras) {
+            stats.frames += camera.second.size();
+            if (!camera.second.empty()) {
+                oldest = std::min(oldest,
+                        camera.second.front()->frame.timestamp);
+                newest = std::max(newest,
+                        camera.second.back()->frame.timestamp);
+            }
+        }
+        if (newest > oldest)
+            stats.seconds = (newest - oldest) / 1e6;
+        const double busy = duration<double>(compress_time).count();
+        if (compress && busy > 0)
+            stats.compress_rate = raw_in / busy / 1e6;
+        return stats;
+    }
+
+private:
+    // The bytes of all entries still referenced, shared with the entry
+    // deleters so that frozen frames can outlive the history.
+    struct Held {
+        std::mutex mutex;
+        unsigned long long bytes = 0;
+    };
+
+    const uint64_t window_us;
+    const unsigned long long limit;
+    const bool compress;
+    std::shared_ptr<Held> held;
+
+    mutable std::mutex mutex;
+    std::condition_variable ready;
+    bool waiting;               // incoming holds a frame to store
+    bool done;
+    std::vector<unsigned char> incoming;
+    Frame incoming_frame;
+    std::map<int, std::deque<Entry_ref>> cameras;
+    std::thread worker;
+
+    unsigned long added;
+    unsigned long skipped;
+    unsigned long evicted;
+    unsigned long long raw_in;
+    unsigned long long stored;
+    std::chrono::steady_clock::duration compress_time;
+
+    void store_frames()
+    {
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lock{mutex};
+                ready.wait(lock, [this] { return waiting || done; });
+                if (done)
+                    return;
+            }
+            store(make_entry());
+            std::lock_guard<std::mutex> lock{mutex};
+            waiting = false;
+        }
+    }
+
+    // Compresses the incoming frame if that pays, or copies it as is.
+    std::unique_ptr<Entry> make_entry()
+    {
+        using namespace std::chrono;
+        std::unique_ptr<Entry> entry{new Entry};
+        entry->frame = incoming_frame;
+        entry->raw_size = incoming.size();
+        entry->compressed = false;
+#ifdef MOSLEY_LZ4
+        if (compress) {
+            Trace_span span{"compress",
+                static_cast<long>(incoming_frame.sequence)};
+            const auto start = steady_clock::now();
+            entry->data.resize(LZ4_compressBound(incoming.size()));
+            const int size = LZ4_compress_default(
+                    reinterpret_cast<const char*>(incoming.data()),
+                    entry->data.data(), incoming.size(),
+                    entry->data.size());
+            const auto elapsed = steady_clock::now() - start;
+            if (size > 0 && static_cast<size_t>(size) < incoming.size()) {
+                entry->data.resize(size);
+                entry->data.shrink_to_fit();
+                entry->compressed = true;
+            }
+            std::lock_guard<std::mutex> lock{mutex};
+            compress_time += elapsed;
+        }
+#endif
+        if (!entry->compressed)
+            entry->data.assign(incoming.begin(), incoming.end());
+        return entry;
+    }
+
+    // Makes room for the entry and adds it to its camera's ring, or
+    // drops it if frozen frames leave no room.
+    void store(std::unique_ptr<Entry> entry)
+    {
+        const size_t size = entry->data.size();
+        const uint64_t oldest = entry->frame.timestamp > window_us
+            ? entry->frame.timestamp - window_us : 0;
+        std::lock_guard<std::mutex> lock{mutex};
+        raw_in += entry->raw_size;
+        stored += size;
+        for (auto& camera : cameras)
+            while (!camera.second.empty()
+                    && camera.second.front()->frame.timestamp < oldest)
+                camera.second.pop_front();
+        while (bytes_held() + size > limit && drop_oldest())
+            ++evicted;
+        if (bytes_held() + size > limit) {
+            ++evicted;
+            return;
+        }
+
+        // Count the bytes until the last reference goes, wherever that
+        // is.
+        std::shared_ptr<Held> counter = held;
+        {
+            std::lock_guard<std::mutex> lock{counter->mutex};
+            counter->bytes += size;
+        }
+        const int camera = entry->frame.camera;
+        cameras[camera].emplace_back(entry.release(), [counter, size]
+                (const Entry* done) {
+                    delete done;
+                    std::lock_guard<std::mutex> lock{counter->mutex};
+                    counter->bytes -= size;
+                });
+        ++added;
+    }
+
+    unsigned long long bytes_held() const
+    {
+        std::lock_guard<std::mutex> lock{held->mutex};
+        return held->bytes;
+    }
+
+    // Drops the oldest frame of all cameras that is not frozen, since
+    // dropping a frozen one would free nothing, if there is one.
+    bool drop_oldest()
+    {
+        std::deque<Entry_ref>* oldest = nullptr;
+        std::deque<Entry_ref>::iterator victim;
+        for (auto& camera : cameras)
+            for (auto i = camera.second.begin(); i != camera.second.end();
+                    ++i)
+                if (i->use_count() == 1) {
+                    if (!oldest || (*i)->frame.timestamp
+                            < (*victim)->frame.timestamp) {
+                        oldest = &camera.second;
+                        victim = i;
+                    }
+                    break;
+                }
+        if (!oldest)
+            return false;
+        oldest->erase(victim);
+        return true;
+    }
+};
+
+#endif
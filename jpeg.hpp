@@ -0,0 +1,334 @@
+#ifndef MOSLEY_JPEG_HPP
+#define MOSLEY_JPEG_HPP
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <jpeglib.h>
+
+// The general exception for errors raised by libjpeg.
+struct Jpeg_exception : std::runtime_error {
+    Jpeg_exception(const std::string& msg) : std::runtime_error{msg} {}
+};
+
+namespace jpeg_detail {
+
+// libjpeg calls exit() on errors by default; raise an exception instead
+// so that a bad frame does not take the whole server down.
+inline void throw_error(j_common_ptr cinfo)
+{
+    char msg[JMSG_LENGTH_MAX];
+    (*cinfo->err->format_message)(cinfo, msg);
+    throw Jpeg_exception{msg};
+}
+
+// Compresses the image into whatever destination the compressor has.
+inline void compress(jpeg_compress_struct& cinfo,
+        const unsigned char* pixels, int width, int height,
+        J_COLOR_SPACE space, int quality, size_t pitch)
+{
+    cinfo.image_width = width;
+    cinfo.image_height = height;
+    cinfo.input_components = space == JCS_GRAYSCALE ? 1 : 3;
+    cinfo.in_color_space = space;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, quality, TRUE);
+    cinfo.dct_method = JDCT_IFAST;
+
+    jpeg_start_compress(&cinfo, TRUE);
+    const size_t stride = pitch > 0 ? pitch
+        : static_cast<size_t>(width) * cinfo.input_components;
+    while (cinfo.next_scanline < cinfo.image_height) {
+        JSAMPROW row = const_cast<JSAMPROW>(pixels + cinfo.next_scanline * stride);
+        jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+}
+
+} // namespace jpeg_detail
+
+// Receives the compressed data in chunks as it is produced.
+typedef std::function<void(const unsigned char*, size_t)> Jpeg_sink;
+
+// Compresses an interleaved 8-bit image held in memory. The color space
+// describes the layout of the input pixels (JCS_RGB, JCS_EXT_BGR or
+// JCS_GRAYSCALE). Rows are tightly packed unless a pitch is given.
+inline std::vector<unsigned char> encode_jpeg(const unsigned char* pixels,
+        int width, int height, J_COLOR_SPACE space, int quality,
+        size_t pitch = 0)
+{
+    jpeg_compress_struct cinfo;
+    jpeg_error_mgr jerr;
+    cinfo.err = jpeg_std_error(&jerr);
+    jerr.error_exit = jpeg_detail::throw_error;
+
+    unsigned char* buffer = nullptr;
+    unsigned long size = 0;
+
+    // Release the compressor and its output on every exit path.
+    struct Guard {
+        jpeg_compress_struct& cinfo;
+        unsigned char*& buffer;
+        ~Guard() { jpeg_destroy_compress(&cinfo); std::free(buffer); }
+    };
+
+    jpeg_create_compress(&cinfo);
+    Guard guard{cinfo, buffer};
+    jpeg_mem_dest(&cinfo, &buffer, &size);
+    jpeg_detail::compress(cinfo, pixels, width, height, space, quality,
+            pitch);
+
+    return std::vector<unsigned char>(buffer, buffer + size);
+}
+
+// Compresses an image like encode_jpeg, but hands the output to the sink
+// a chunk of at most chunk_size bytes at a time while the rows are still
+// being compressed, so that sending can start before encoding is done.
+// The last chunk may be shorter.
+inline void encode_jpeg(const unsigned char* pixels, int width, int height,
+        J_COLOR_SPACE space, int quality, size_t pitch, size_t chunk_size,
+        const Jpeg_sink& sink)
+{
+    // The compressor's destination, with the sink and its buffer.
+    struct Destination : jpeg_destination_mgr {
+        const Jpeg_sink* sink;
+        std::vector<unsigned char> buffer;
+
+        static void start(j_compress_ptr cinfo)
+        {
+            Destination& self = *static_cast<Destination*>(cinfo->dest);
+            self.next_output_byte = self.buffer.data();
+            self.free_in_buffer = self.buffer.size();
+        }
+
+        static boolean flush(j_compress_ptr cinfo)
+        {
+            Destination& self = *static_cast<Destination*>(cinfo->dest);
+            (*self.sink)(self.buffer.data(), self.buffer.size());
+            start(cinfo);
+            return TRUE;
+        }
+
+        static void finish(j_compress_ptr cinfo)
+        {
+            Destination& self = *static_cast<Destination*>(cinfo->dest);
+            const size_t size = self.buffer.size() - self.free_in_buffer;
+            if (size > 0)
+                (*self.sink)(self.buffer.data(), size);
+        }
+    };
+
+    jpeg_compress_struct cinfo;
+    jpeg_error_mgr jerr;
+    cinfo.err = jpeg_std_error(&jerr);
+    jerr.error_exit = jpeg_detail::throw_error;
+
+    struct Guard {
+        jpeg_compress_struct& cinfo;
+        ~Guard() { jpeg_destroy_compress(&cinfo); }
+    };
+
+    Destination destination;
+    destination.init_destination = Destination::start;
+    destination.empty_output_buffer = Destination::flush;
+    destination.term_destination = Destination::finish;
+    destination.sink = &sink;
+    destination.buffer.resize(std::max<size_t>(chunk_size, 1));
+
+    jpeg_create_compress(&cinfo);
+    Guard guard{cinfo};
+    cinfo.dest = &destination;
+    jpeg_detail::compress(cinfo, pixels, width, height, space, quality,
+            pitch);
+}
+
+// A rectangle of an image in pixels.
+struct Jpeg_region {
+    int x;
+    int y;
+    int width;
+    int height;
+};
+
+// Coarsens a JPEG held in memory outside the given regions, as though
+// the background had been encoded at a lower quality, and returns the
+// result, which is still a baseline JPEG with a single set of tables.
+// The DCT coefficients are read without decoding the pixels; every
+// block that does not touch a region has each coefficient rounded to
+// the step it would have at the background quality, which zeroes most
+// of the high frequencies, and the coefficients are then written back
+// with Huffman tables optimised for the new statistics. Blocks touching
+// a region are kept exactly, so the regions lose nothing.
+inline std::vector<unsigned char> requantize_jpeg(const unsigned char* data,
+        size_t size, const std::vector<Jpeg_region>& regions,
+        int background_quality)
+{
+    jpeg_decompress_struct source;
+    jpeg_compress_struct target;
+    jpeg_compress_struct reference;
+    jpeg_error_mgr jerr;
+    source.err = jpeg_std_error(&jerr);
+    target.err = &jerr;
+    reference.err = &jerr;
+    jerr.error_exit = jpeg_detail::throw_error;
+
+    unsigned char* buffer = nullptr;
+    unsigned long buffer_size = 0;
+
+    struct Guard {
+        jpeg_decompress_struct& source;
+        jpeg_compress_struct& target;
+        jpeg_compress_struct& reference;
+        unsigned char*& buffer;
+        ~Guard()
+        {
+            jpeg_destroy_compress(&reference);
+            jpeg_destroy_compress(&target);
+            jpeg_destroy_decompress(&source);
+            std::free(buffer);
+        }
+    };
+
+    jpeg_create_decompress(&source);
+    jpeg_create_compress(&target);
+    jpeg_create_compress(&reference);
+    Guard guard{source, target, reference, buffer};
+
+    // The quantisation steps of the background quality, from the same
+    // standard tables the encoder scales.
+    reference.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&reference);
+    jpeg_set_quality(&reference, background_quality, TRUE);
+
+    jpeg_mem_src(&source, const_cast<unsigned char*>(data), size);
+    jpeg_read_header(&source, TRUE);
+    jvirt_barray_ptr* coefficients = jpeg_read_coefficients(&source);
+
+    const int max_h = source.max_h_samp_factor;
+    const int max_v = source.max_v_samp_factor;
+    for (int c = 0; c < source.num_components; ++c) {
+        jpeg_component_info& component = source.comp_info[c];
+        const JQUANT_TBL* fine = component.quant_table;
+        const JQUANT_TBL* coarse =
+            reference.quant_tbl_ptrs[component.quant_tbl_no > 0 ? 1 : 0];
+        if (!fine || !coarse)
+            continue;
+
+        // How many image pixels a block of this component spans.
+        const int block_width = DCTSIZE * max_h / component.h_samp_factor;
+        const int block_height = DCTSIZE * max_v / component.v_samp_factor;
+
+        for (JDIMENSION row = 0; row < component.height_in_blocks; ++row) {
+            JBLOCKARRAY blocks = (*source.mem->access_virt_barray)(
+                    reinterpret_cast<j_common_ptr>(&source),
+                    coefficients[c], row, 1, TRUE);
+            const int top = row * block_height;
+            for (JDIMENSION column = 0; column < component.width_in_blocks;
+                    ++column) {
+                const int left = column * block_width;
+                bool kept = false;
+                for (const auto& region : regions)
+                    kept = kept || (left < region.x + region.width
+                            && region.x < left + block_width
+                            && top < region.y + region.height
+                            && region.y < top + block_height);
+                if (kept)
+                    continue;
+
+                JCOEF* block = blocks[0][column];
+                for (int k = 0; k < DCTSIZE2; ++k) {
+                    const int step = fine->quantval[k];
+                    const int target_step = coarse->quantval[k];
+                    if (target_step <= step || block[k] == 0)
+                        continue;
+                    // Round the value to the coarse step, in fine steps.
+                    const long value = static_cast<long>(block[k]) * step;
+                    const long rounded = (value >= 0
+                            ? (value + target_step / 2) / target_step
+                            : -((-value + target_step / 2) / target_step))
+                        * target_step;
+                    block[k] = static_cast<JCOEF>(rounded >= 0
+                            ? (rounded + step / 2) / step
+                            : -((-rounded + step / 2) / step));
+                }
+            }
+        }
+    }
+
+    jpeg_copy_critical_parameters(&source, &target);
+    target.optimize_coding = TRUE;
+    jpeg_mem_dest(&target, &buffer, &buffer_size);
+    jpeg_write_coefficients(&target, coefficients);
+    jpeg_finish_compress(&target);
+    jpeg_finish_decompress(&source);
+
+    return std::vector<unsigned char>(buffer, buffer + buffer_size);
+}
+
+// Reads the size of a JPEG held in memory from its header alone.
+inline void read_jpeg_size(const unsigned char* data, size_t size,
+        int& width, int& height)
+{
+    jpeg_decompress_struct cinfo;
+    jpeg_error_mgr jerr;
+    cinfo.err = jpeg_std_error(&jerr);
+    jerr.error_exit = jpeg_detail::throw_error;
+
+    struct Guard {
+        jpeg_decompress_struct& cinfo;
+        ~Guard() { jpeg_destroy_decompress(&cinfo); }
+    };
+
+    jpeg_create_decompress(&cinfo);
+    Guard guard{cinfo};
+    jpeg_mem_src(&cinfo, const_cast<unsigned char*>(data), size);
+    jpeg_read_header(&cinfo, TRUE);
+    width = cinfo.image_width;
+    height = cinfo.image_height;
+}
+
+// Decompresses a JPEG held in memory into interleaved 8-bit pixels of
+// the requested color space, reusing the capacity of the output buffer.
+// A scale of 2, 4 or 8 decodes at that fraction of the full size by
+// dropping high-frequency DCT coefficients, which is far cheaper than
+// decoding in full and shrinking, for previews.
+inline void decode_jpeg(const unsigned char* data, size_t size,
+        J_COLOR_SPACE space, int& width, int& height,
+        std::vector<unsigned char>& pixels, int scale = 1)
+{
+    jpeg_decompress_struct cinfo;
+    jpeg_error_mgr jerr;
+    cinfo.err = jpeg_std_error(&jerr);
+    jerr.error_exit = jpeg_detail::throw_error;
+
+    struct Guard {
+        jpeg_decompress_struct& cinfo;
+        ~Guard() { jpeg_destroy_decompress(&cinfo); }
+    };
+
+    jpeg_create_decompress(&cinfo);
+    Guard guard{cinfo};
+    jpeg_mem_src(&cinfo, const_cast<unsigned char*>(data), size);
+    jpeg_read_header(&cinfo, TRUE);
+    cinfo.out_color_space = space;
+    cinfo.dct_method = JDCT_IFAST;
+    cinfo.scale_num = 1;
+    cinfo.scale_denom = scale;
+    jpeg_start_decompress(&cinfo);
+
+    width = cinfo.output_width;
+    height = cinfo.output_height;
+    const size_t stride = static_cast<size_t>(width) * cinfo.output_components;
+    pixels.resize(stride * height);
+    while (cinfo.output_scanline < cinfo.output_height) {
+        JSAMPROW row = pixels.data() + cinfo.output_scanline * stride;
+        jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_decompress(&cinfo);
+}
+
+#endif
@@ -0,0 +1,147 @@
+#ifndef MOSLEY_LINK_HPP
+#define MOSLEY_LINK_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <zmq.h>
+
+// Stands in for the radio link on localhost. Requests and replies are
+// forwarded between a ROUTER facing the clients and a DEALER facing the
+// server, and each message is released only once it has been held for
+// the delay. With a rate, each direction also carries only so many
+// bytes a second: a message goes out once the ones before it have, and
+// its own bytes have been paid for. Messages are held the same way in
+// each direction, so both stay in order.
+class Link_relay {
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    static constexpr const char* ENDPOINT = "inproc://relay";
+
+    Link_relay(void* context, const std::string& server, int delay_ms,
+            double rate = 0, const std::string& endpoint = ENDPOINT)
+        : delay{std::chrono::milliseconds(delay_ms)}, rate{rate},
+          running{true}, front{zmq_socket(context, ZMQ_ROUTER)},
+          back{zmq_socket(context, ZMQ_DEALER)}
+    {
+        const int linger = 0;
+        zmq_setsockopt(front, ZMQ_LINGER, &linger, sizeof(linger));
+        zmq_setsockopt(back, ZMQ_LINGER, &linger, sizeof(linger));
+        if (zmq_bind(front, endpoint.c_str()) != 0 ||
+                zmq_connect(back, server.c_str()) != 0)
+            throw std::runtime_error{"could not start relay to " + server};
+        thread = std::thread{&Link_relay::run, this};
+    }
+
+    ~Link_relay()
+    {
+        running = false;
+        thread.join();
+        for (auto* held : {&upstream, &downstream})
+            for (auto& message : *held)
+                for (auto* part : message.parts)
+                    release(part);
+        zmq_close(front);
+        zmq_close(back);
+    }
+
+    // Disallow copying and moving.
+    Link_relay(const Link_relay&) = delete;
+    Link_relay& operator=(const Link_relay&) = delete;
+
+private:
+    struct Held {
+        Clock::time_point due;
+        std::vector<zmq_msg_t*> parts;
+    };
+
+    const Clock::duration delay;
+    const double rate;              // bytes/s each way, 0 for no limit
+    std::atomic<bool> running;
+    void* const front;
+    void* const back;
+    std::deque<Held> upstream;      // to the server
+    std::deque<Held> downstream;    // to the clients
+    Clock::time_point upstream_free;    // when the link is next idle
+    Clock::time_point downstream_free;
+    std::thread thread;
+
+    static void release(zmq_msg_t* part)
+    {
+        zmq_msg_close(part);
+        delete part;
+    }
+
+    void hold(void* socket, std::deque<Held>& queue,
+            Clock::time_point& free)
+    {
+        Held message{Clock::now(), {}};
+        size_t size = 0;
+        do {
+            zmq_msg_t* part = new zmq_msg_t;
+            zmq_msg_init(part);
+            if (zmq_msg_recv(part, socket, 0) < 0) {
+                release(part);
+                break;
+            }
+            size += zmq_msg_size(part);
+            message.parts.push_back(part);
+        } while (zmq_msg_more(message.parts.back()));
+
+        if (rate > 0) {
+            free = std::max(free, message.due)
+                + std::chrono::duration_cast<Clock::duration>(
+                        std::chrono::duration<double>(size / rate));
+            message.due = free;
+        }
+        message.due += delay;
+        queue.push_back(std::move(message));
+    }
+
+    void forward(std::deque<Held>& queue, void* socket)
+    {
+        const auto now = Clock::now();
+        while (!queue.empty() && queue.front().due <= now) {
+            auto& parts = queue.front().parts;
+            for (size_t i = 0; i < parts.size(); ++i) {
+                zmq_msg_send(parts[i], socket,
+                        i+1 < parts.size() ? ZMQ_SNDMORE : 0);
+                release(parts[i]);
+            }
+            queue.pop_front();
+        }
+    }
+
+    void run()
+    {
+        using namespace std::chrono;
+        while (running) {
+            auto next = Clock::now() + milliseconds(100);
+            for (auto* held : {&upstream, &downstream})
+                if (!held->empty())
+                    next = std::min(next, held->front().due);
+            const long timeout = std::max<long>(0,
+                    duration_cast<milliseconds>(next - Clock::now()).count());
+
+            zmq_pollitem_t items[] = {
+                {front, 0, ZMQ_POLLIN, 0},
+                {back, 0, ZMQ_POLLIN, 0},
+            };
+            zmq_poll(items, 2, timeout);
+            if (items[0].revents & ZMQ_POLLIN)
+                hold(front, upstream, upstream_free);
+            if (items[1].revents & ZMQ_POLLIN)
+                hold(back, downstream, downstream_free);
+            forward(upstream, back);
+            forward(downstream, front);
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,265 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <zmq.h>
+
+// A load generator for the mosley data socket. It runs a series of steps
+// with a growing number of concurrent clients (1, 2, 4, ... up to the
+// maximum), each client issuing a mix of image and "stats" requests at
+// a fixed rate or back to back, and prints one line of the scaling
+// curve per step: throughput, latency percentiles and server CPU use.
+//
+// To measure on localhost without cameras, either start the server with
+// `mosley --synthetic` and pass its pid, or let loadgen --spawn it.
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Options {
+    std::string endpoint = "tcp://localhost:5555";
+    int clients = 16;
+    double rate = 0;            // requests/s per client, 0 for closed loop
+    double stats_fraction = 0;  // share of requests that ask for "stats"
+    double duration = 10;       // seconds per step
+    int timeout = 5000;         // ms before a request counts as failed
+    pid_t pid = 0;              // server process to sample CPU from
+    bool spawn = false;
+    bool per_client = false;
+};
+
+struct Client_result {
+    std::vector<double> latencies;  // ms
+    unsigned long images = 0;
+    unsigned long stats = 0;
+    unsigned long errors = 0;
+    unsigned long long bytes = 0;
+};
+
+void* connect(void* context, const Options& options)
+{
+    void* socket = zmq_socket(context, ZMQ_REQ);
+    const int linger = 0;
+    zmq_setsockopt(socket, ZMQ_LINGER, &linger, sizeof(linger));
+    zmq_setsockopt(socket, ZMQ_RCVTIMEO, &options.timeout,
+            sizeof(options.timeout));
+    zmq_connect(socket, options.endpoint.c_str());
+    return socket;
+}
+
+// Issues requests until the deadline. With a fixed rate, latency is
+// measured from when the request was due rather than when it was sent,
+// so a stalled server shows up as latency instead of fewer samples.
+void run_client(void* context, const Options& options, int id,
+        Clock::time_point deadline, Client_result& result)
+{
+    using namespace std::chrono;
+
+    void* socket = connect(context, options);
+    std::minstd_rand rng(id + 1);
+    std::uniform_real_distribution<double> mix{0, 1};
+    const auto period = options.rate > 0
+        ? duration_cast<Clock::duration>(duration<double>(1 / options.rate))
+        : Clock::duration::zero();
+
+    auto due = Clock::now();
+    while (due < deadline) {
+        if (options.rate > 0)
+            std::this_thread::sleep_until(due);
+        else
+            due = Clock::now();
+
+        const bool stats = mix(rng) < options.stats_fraction;
+        const std::string request = stats ? "stats" : "snap";
+        zmq_send(socket, request.data(), request.size(), 0);
+
+        zmq_msg_t msg;
+        zmq_msg_init(&msg);
+        if (zmq_msg_recv(&msg, socket, 0) < 0) {
+            // A REQ socket cannot send again without a reply, so start
+            // over with a fresh one.
+            ++result.errors;
+            zmq_close(socket);
+            socket = connect(context, options);
+        } else {
+            result.latencies.push_back(
+                    duration<double, std::milli>(Clock::now() - due).count());
+            result.bytes += zmq_msg_size(&msg);
+            ++(stats ? result.stats : result.images);
+        }
+        zmq_msg_close(&msg);
+        due += period;
+    }
+    zmq_close(socket);
+}
+
+// Returns the given percentile of a sorted sample.
+double percentile(const std::vector<double>& sorted, double p)
+{
+    if (sorted.empty())
+        return 0;
+    const size_t i = std::min(sorted.size() - 1,
+            static_cast<size_t>(p / 100 * sorted.size()));
+    return sorted[i];
+}
+
+// CPU time used by a process so far in seconds, or -1 if unknown.
+double cpu_seconds(pid_t pid)
+{
+    if (pid <= 0)
+        return -1;
+    std::ifstream file("/proc/" + std::to_string(pid) + "/stat");
+    std::string field;
+    unsigned long utime = 0, stime = 0;
+
+    // The second field is the command name in parentheses and may hold
+    // spaces, so skip to its closing parenthesis first.
+    std::getline(file, field, ')');
+    for (int i = 3; i <= 15 && file >> field; ++i) {
+        if (i == 14)
+            utime = std::stoul(field);
+        else if (i == 15)
+            stime = std::stoul(field);
+    }
+    if (!file)
+        return -1;
+    return static_cast<double>(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+void run_step(void* context, const Options& options, int clients)
+{
+    using namespace std::chrono;
+
+    std::vector<Client_result> results(clients);
+    std::vector<std::thread> threads;
+    const double cpu_start = cpu_seconds(options.pid);
+    const auto start = Clock::now();
+    const auto deadline = start + duration_cast<Clock::duration>(
+            duration<double>(options.duration));
+
+    for (int i = 0; i < clients; ++i)
+        threads.emplace_back(run_client, context, std::cref(options), i,
+                deadline, std::ref(results[i]));
+    for (auto& thread : threads)
+        thread.join();
+
+    const double wall = duration<double>(Clock::now() - start).count();
+    const double cpu_end = cpu_seconds(options.pid);
+
+    Client_result total;
+    for (size_t i = 0; i < results.size(); ++i) {
+        auto& result = results[i];
+        std::sort(result.latencies.begin(), result.latencies.end());
+        if (options.per_client)
+            std::cout << "  client " << i << ": "
+                << result.latencies.size() << " replies "
+                << "p50 " << percentile(result.latencies, 50) << "ms "
+                << "p99 " << percentile(result.latencies, 99) << "ms "
+                << "errors " << result.errors << '\n';
+
+        total.latencies.insert(total.latencies.end(),
+                result.latencies.begin(), result.latencies.end());
+        total.images += result.images;
+        total.stats += result.stats;
+        total.errors += result.errors;
+        total.bytes += result.bytes;
+    }
+    std::sort(total.latencies.begin(), total.latencies.end());
+
+    std::cout << std::setw(7) << clients
+        << std::setw(11) << total.latencies.size() / wall
+        << std::setw(9) << total.bytes / wall / 1e6
+        << std::setw(9) << percentile(total.latencies, 50)
+        << std::setw(9) << percentile(total.latencies, 90)
+        << std::setw(9) << percentile(total.latencies, 99)
+        << std::setw(9) << (total.latencies.empty()
+                ? 0 : total.latencies.back())
+        << std::setw(8) << total.errors;
+    if (cpu_start >= 0 && cpu_end >= 0)
+        std::cout << std::setw(9) << (cpu_end - cpu_start) / wall * 100;
+    std::cout << std::endl;
+}
+
+// Starts a server on the synthetic source and waits for it to bind.
+pid_t spawn_server()
+{
+    const pid_t pid = fork();
+    if (pid == 0) {
+        execl("./mosley", "mosley", "--synthetic", static_cast<char*>(nullptr));
+        std::perror("./mosley");
+        std::_Exit(1);
+    }
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+    return pid;
+}
+
+void usage(const char* name)
+{
+    std::cerr << "usage: " << name << " [--endpoint addr] [--clients max]"
+        << " [--rate req/s] [--stats fraction] [--duration s]"
+        << " [--timeout ms] [--pid server | --spawn] [--per-client]\n";
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+    Options options;
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg{argv[i]};
+        const bool value = i+1 < argc;
+        if (arg == "--endpoint" && value) {
+            options.endpoint = argv[++i];
+        } else if (arg == "--clients" && value) {
+            options.clients = std::atoi(argv[++i]);
+        } else if (arg == "--rate" && value) {
+            options.rate = std::atof(argv[++i]);
+        } else if (arg == "--stats" && value) {
+            options.stats_fraction = std::atof(argv[++i]);
+        } else if (arg == "--duration" && value) {
+            options.duration = std::atof(argv[++i]);
+        } else if (arg == "--timeout" && value) {
+            options.timeout = std::atoi(argv[++i]);
+        } else if (arg == "--pid" && value) {
+            options.pid = std::atoi(argv[++i]);
+        } else if (arg == "--spawn") {
+            options.spawn = true;
+        } else if (arg == "--per-client") {
+            options.per_client = true;
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (options.spawn)
+        options.pid = spawn_server();
+
+    void* context = zmq_ctx_new();
+    std::cout << std::setw(7) << "clients" << std::setw(11) << "requests/s"
+        << std::setw(9) << "MB/s" << std::setw(9) << "p50 ms"
+        << std::setw(9) << "p90 ms" << std::setw(9) << "p99 ms"
+        << std::setw(9) << "max ms" << std::setw(8) << "errors";
+    if (options.pid > 0)
+        std::cout << std::setw(9) << "cpu %";
+    std::cout << std::endl;
+    for (int clients = 1; clients < 2*options.clients; clients *= 2)
+        run_step(context, options, std::min(clients, options.clients));
+    zmq_ctx_destroy(context);
+
+    if (options.spawn) {
+        kill(options.pid, SIGTERM);
+        waitpid(options.pid, nullptr, 0);
+    }
+}
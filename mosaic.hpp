@@ -0,0 +1,300 @@
+#ifndef MOSLEY_MOSAIC_HPP
+#define MOSLEY_MOSAIC_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "parallel.hpp"
+#include "remap.hpp"
+#include "simd.hpp"
+#include "trace.hpp"
+
+// How the right camera's frames sit against the left camera's: a
+// homography taking right-frame pixel coordinates to left-frame ones,
+// for frames of the given size, as found once from ground control or
+// overlapping features.
+struct Homography {
+    int left;                   // camera ids
+    int right;
+    int width;
+    int height;
+    double h[9];                // row major
+};
+
+// Reads a homography from a text file holding one line
+//
+//     left right width height h00 h01 h02 h10 h11 h12 h20 h21 h22
+//
+// Lines starting with '#' are skipped.
+inline Homography read_homography(const std::string& path)
+{
+    std::ifstream file(path);
+    if (!file)
+        throw std::runtime_error{"could not open homography " + path};
+
+    std::string line;
+    while (std::getline(file, line)) {
+        if (line.empty() || line[0] == '#')
+            continue;
+        std::istringstream fields{line};
+        Homography homography;
+        fields >> homography.left >> homography.right >> homography.width
+            >> homography.height;
+        for (double& h : homography.h)
+            fields >> h;
+        if (!fields)
+            throw std::runtime_error{"bad homography line: " + line};
+        return homography;
+    }
+    throw std::runtime_error{"no homography in " + path};
+}
+
+namespace mosaic_detail {
+
+using namespace simd;
+
+// Adds a row of pixels times their weights to the accumulated row.
+inline void accumulate(const unsigned char* pixels, const uint16_t* weights,
+        int count, uint16_t* sums)
+{
+    for (int i = 0; i < count; i += LANES) {
+        uint16_t wide[LANES];
+        for (int j = 0; j < LANES; ++j)
+            wide[j] = pixels[i + j];
+        store(sums + i, load(sums + i) + load(wide) * load(weights + i));
+    }
+}
+
+// Applies h to (x, y), returning false for points at infinity.
+inline bool transform(const double* h, double x, double y, double& tx,
+        double& ty)
+{
+    const double w = h[6] * x + h[7] * y + h[8];
+    if (std::fabs(w) < 1e-12)
+        return false;
+    tx = (h[0] * x + h[1] * y + h[2]) / w;
+    ty = (h[3] * x + h[4] * y + h[5]) / w;
+    return true;
+}
+
+inline void invert(const double* m, double* inverse)
+{
+    const double det = m[0] * (m[4] * m[8] - m[5] * m[7])
+        - m[1] * (m[3] * m[8] - m[5] * m[6])
+        + m[2] * (m[3] * m[7] - m[4] * m[6]);
+    if (std::fabs(det) < 1e-12)
+        throw std::runtime_error{"homography is singular"};
+    inverse[0] = (m[4] * m[8] - m[5] * m[7]) / det;
+    inverse[1] = (m[2] * m[7] - m[1] * m[8]) / det;
+    inverse[2] = (m[1] * m[5] - m[2] * m[4]) / det;
+    inverse[3] = (m[5] * m[6] - m[3] * m[8]) / det;
+    inverse[4] = (m[0] * m[8] - m[2] * m[6]) / det;
+    inverse[5] = (m[2] * m[3] - m[0] * m[5]) / det;
+    inverse[6] = (m[3] * m[7] - m[4] * m[6]) / det;
+    inverse[7] = (m[1] * m[6] - m[0] * m[7]) / det;
+    inverse[8] = (m[0] * m[4] - m[1] * m[3]) / det;
+}
+
+// How far a point lies inside a frame, zero if it is outside.
+inline double inside(double x, double y, int width, int height)
+{
+    return std::max(0.0, std::min(std::min(x + 0.5, width - 0.5 - x),
+                std::min(y + 0.5, height - 0.5 - y)));
+}
+
+} // namespace mosaic_detail
+
+// Warps a left and a right frame into one downscaled quick-look mosaic
+// in the left frame's coordinates. Everything that depends only on the
+// geometry is worked out when the mosaic is built: a remap table from
+// each camera into the mosaic, and the blend weights, which feather the
+// overlap by how far each point lies inside either frame. Composing a
+// mosaic is then a remap and a weighted sum per camera, in bands of rows
+// on all cores. Each frame is added as soon as it is grabbed, so the
+// cameras' buffers need not both stay valid. The mosaic keeps the
+// channel order of the frames.
+class Mosaic {
+public:
+    // The homography is scaled to the frame size if it was found at
+    // another resolution. Each mosaic pixel covers scale frame pixels a
+    // side.
+    Mosaic(const Homography& homography, int width, int height, int scale)
+        : left_camera{homography.left}, right_camera{homography.right},
+          frame_width{width}, frame_height{height}
+    {
+        using namespace mosaic_detail;
+
+        // Scale the homography to the frame: S H S^-1.
+        const double sx = static_cast<double>(width) / homography.width;
+        const double sy = static_cast<double>(height) / homography.height;
+        double h[9];
+        std::copy(homography.h, homography.h + 9, h);
+        h[1] *= sx / sy;
+        h[2] *= sx;
+        h[3] *= sy / sx;
+        h[5] *= sy;
+        h[6] /= sx;
+        h[7] /= sy;
+        double inverse[9];
+        invert(h, inverse);
+
+        // The mosaic spans the left frame and the right frame's corners.
+        double left = 0, top = 0, right = width, bottom = height;
+        for (const double x : {0.0, static_cast<double>(width)}) {
+            for (const double y : {0.0, static_cast<double>(height)}) {
+                double tx, ty;
+                if (!transform(h, x, y, tx, ty))
+                    continue;
+                left = std::min(left, tx);
+                right = std::max(right, tx);
+                top = std::min(top, ty);
+                bottom = std::max(bottom, ty);
+            }
+        }
+        mosaic_width = std::max(1, static_cast<int>(
+                    std::ceil((right - left) / scale)));
+        mosaic_height = std::max(1, static_cast<int>(
+                    std::ceil((bottom - top) / scale)));
+
+        // The point of the left frame at the centre of mosaic pixel (u, v).
+        const auto point = [=](int u, int v, double& x, double& y) {
+            x = left + (u + 0.5) * scale - 0.5;
+            y = top + (v + 0.5) * scale - 0.5;
+        };
+        const auto from_right = [=](int u, int v, double& x, double& y) {
+            double lx, ly;
+            point(u, v, lx, ly);
+            if (!transform(inverse, lx, ly, x, y))
+                x = y = -1;
+        };
+        left_map.reset(new Remap_table{mosaic_width, mosaic_height, width,
+                height, point});
+        right_map.reset(new Remap_table{mosaic_width, mosaic_height, width,
+                height, from_right});
+
+        // Weights per byte rather than per pixel, so the sums need no
+        // shuffling; rows are padded to whole vectors.
+        row_size = (mosaic_width * 3 + LANES - 1) / LANES * LANES;
+        left_weights.resize(static_cast<size_t>(row_size) * mosaic_height);
+        right_weights.resize(left_weights.size());
+        parallel_for(mosaic_height, [&](int begin, int end) {
+            for (int v = begin; v < end; ++v) {
+                for (int u = 0; u < mosaic_width; ++u) {
+                    double lx, ly, rx, ry;
+                    point(u, v, lx, ly);
+                    from_right(u, v, rx, ry);
+                    const double dl = inside(lx, ly, width, height);
+                    const double dr = inside(rx, ry, width, height);
+                    const int wl = dl + dr > 0 ? static_cast<int>(
+                            std::lround(WEIGHT_ONE * dl / (dl + dr))) : 0;
+                    const int wr = dl + dr > 0 ? WEIGHT_ONE - wl : 0;
+                    const size_t i = static_cast<size_t>(v) * row_size + 3*u;
+                    for (int c = 0; c < 3; ++c) {
+                        left_weights[i + c] = wl;
+                        right_weights[i + c] = wr;
+                    }
+                }
+            }
+        });
+        sums.resize(left_weights.size());
+        pixels.resize(static_cast<size_t>(mosaic_width) * mosaic_height * 3);
+    }
+
+    // Disallow copying and moving.
+    Mosaic(const Mosaic&) = delete;
+    Mosaic& operator=(const Mosaic&) = delete;
+
+    int left() const
+    {
+        return left_camera;
+    }
+
+    int right() const
+    {
+        return right_camera;
+    }
+
+    // Whether the mosaic was built for frames of this size.
+    bool fits(int width, int height) const
+    {
+        return width == frame_width && height == frame_height;
+    }
+
+    int width() const
+    {
+        return mosaic_width;
+    }
+
+    int height() const
+    {
+        return mosaic_height;
+    }
+
+    // Starts a new mosaic.
+    void clear()
+    {
+        std::fill(sums.begin(), sums.end(), 0);
+    }
+
+    // Warps a frame of 3-byte pixels from the left or right camera into
+    // the mosaic.
+    void add(bool right, const unsigned char* frame, int pitch)
+    {
+        const Remap_table& map = right ? *right_map : *left_map;
+        const std::vector<uint16_t>& weights = right
+            ? right_weights : left_weights;
+        parallel_for(mosaic_height, [&](int begin, int end) {
+            Trace_span span{"mosaic rows"};
+            std::vector<unsigned char> row(row_size);
+            for (int v = begin; v < end; ++v) {
+                const size_t offset = static_cast<size_t>(v) * row_size;
+                map.remap_row(frame, pitch, v, row.data());
+                mosaic_detail::accumulate(row.data(), &weights[offset],
+                        row_size, &sums[offset]);
+            }
+        });
+    }
+
+    // Divides out the weights and returns the tightly packed mosaic.
+    const std::vector<unsigned char>& result()
+    {
+        using namespace mosaic_detail;
+        const int bytes = mosaic_width * 3;
+        const v8u16 half = v8u16{} + WEIGHT_ONE / 2;
+        parallel_for(mosaic_height, [&](int begin, int end) {
+            for (int v = begin; v < end; ++v) {
+                uint16_t* row = &sums[static_cast<size_t>(v) * row_size];
+                for (int i = 0; i < row_size; i += LANES)
+                    store(row + i, (load(row + i) + half) >> WEIGHT_BITS);
+                unsigned char* out = &pixels[static_cast<size_t>(v) * bytes];
+                for (int i = 0; i < bytes; ++i)
+                    out[i] = row[i];
+            }
+        });
+        return pixels;
+    }
+
+private:
+    const int left_camera;
+    const int right_camera;
+    const int frame_width;
+    const int frame_height;
+    int mosaic_width;
+    int mosaic_height;
+    int row_size;               // bytes per padded row
+    std::unique_ptr<Remap_table> left_map;
+    std::unique_ptr<Remap_table> right_map;
+    std::vector<uint16_t> left_weights;
+    std::vector<uint16_t> right_weights;
+    std::vector<uint16_t> sums;
+    std::vector<unsigned char> pixels;
+};
+
+#endif
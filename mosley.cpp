@@ -1,16 +1,49 @@
+#include <algorithm>
 #include <array>
+#include <atomic>
 #include <chrono>
+#include <cmath>
+#include <deque>
+#include <functional>
 #include <iostream>
+#include <iterator>
 #include <fstream>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <stdexcept>
 #include <string>
 #include <sstream>
+#include <thread>
 #include <vector>
+#include <cerrno>
 #include <cstdlib>
+#include <ctime>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
 #include <ueye.h>
 #include <zmq.h>
 #include <msgpack.hpp>
+#include "broadcast.hpp"
+#include "client.hpp"
+#include "demosaic.hpp"
+#include "denoise.hpp"
+#include "event_loop.hpp"
+#include "footprint.hpp"
+#include "frame.hpp"
+#include "hdr.hpp"
+#include "history.hpp"
+#include "jpeg.hpp"
+#include "mosaic.hpp"
+#include "position.hpp"
+#include "replay.hpp"
+#include "swath.hpp"
+#include "synthetic.hpp"
+#include "telemetry.hpp"
+#include "trace.hpp"
+#include "undistort.hpp"
 
 // The general exception for errors related to camera operations.
 struct Camera_exception : std::runtime_error {
@@ -22,12 +55,43 @@ struct Camera_exception : std::runtime_error {
 // and will clean up any allocated memory on the cameras when the
 // Camera object goes out of scope. Images are snapped in an alternating
 // fashion between the two cameras.
-class Camera {
+class Camera : public Frame_source {
 public:
     static const int LEFT_DEV_ID = 1;
     static const int RIGHT_DEV_ID = 2;
 
-    Camera() : cameras{{{LEFT_DEV_ID,nullptr,0}, {RIGHT_DEV_ID,nullptr,0}}} {}
+    // The UI-1495LE-C cameras operate in full 10MP mode.
+    static const int WIDTH = 3840;
+    static const int HEIGHT = 2748;
+    static const int QUALITY = 80;
+
+    // Sustained USB 2.0 bulk throughput in MB/s that the cameras on the
+    // bus may use between them, unless told otherwise.
+    static const int BUS_BUDGET = 40;
+
+    // In strip mode each camera captures a narrow AOI across the middle
+    // of the sensor continuously and stacks the strips into swaths.
+    static const int STRIP_X = 800;
+    static const int STRIP_WIDTH = 3040;
+    static const int STRIP_HEIGHT = 406;
+    static const int STRIP_BUFFERS = 8;
+    static const int SWATH_STRIPS = 8;
+    static const int MAX_SWATHS = 4;
+
+    // In COLOR mode the camera converts to 24bpp BGR before transfer. In
+    // BAYER mode the 8-bit sensor data is transferred as is, which is a
+    // third of the USB traffic, and demosaiced on the host instead.
+    enum Mode { COLOR, BAYER };
+
+    // While nobody is listening the cameras can idle at their lowest
+    // pixel clock and frame rate, which still answers a grab, or be put
+    // in standby, which saves the most but takes longest to wake.
+    enum Power { FULL, LOW, STANDBY };
+
+    explicit Camera(Mode mode = COLOR, int bus_budget = BUS_BUDGET)
+        : mode{mode}, bus_budget{bus_budget}, strip_height{0},
+          aoi{0, 0, WIDTH, HEIGHT}, current{0}, power{FULL}, scanning{false},
+          cameras{{{LEFT_DEV_ID,nullptr,0}, {RIGHT_DEV_ID,nullptr,0}}} {}
 
     // Disallow copying and moving.
     Camera(const Camera&) = delete;
@@ -37,6 +101,8 @@ public:
 
     ~Camera()
     {
+        stop_strips();
+
         // Call the exit routine and free any memory for each camera.
         for (auto& camera : cameras)
             destroy(camera);
@@ -53,75 +119,407 @@ public:
         // Initialize each camera and setup the auto exit handler.
         for (auto& camera : cameras)
             initialize(camera);
+
+        plan_bus();
+    }
+
+    std::vector<Camera_stats> stats() const override
+    {
+        std::vector<Camera_stats> result;
+        for (const auto& camera : cameras) {
+            // The driver keeps its own count of failed USB transfers,
+            // which includes failures during frames that were retried.
+            UEYE_CAPTURE_STATUS_INFO info;
+            unsigned long failed = 0;
+            if (is_CaptureStatus(camera.id, IS_CAPTURE_STATUS_INFO_CMD_GET,
+                        &info, sizeof(info)) == IS_SUCCESS)
+                failed = info.adwCapStatusCnt_Detail[
+                    IS_CAP_STATUS_USB_TRANSFER_FAILED];
+
+            result.push_back({static_cast<int>(camera.id),
+                    camera.pixel_clock, camera.frame_rate, camera.frames,
+                    camera.retries, camera.dropped, failed});
+        }
+        return result;
+    }
+
+    // Starts continuous strip capture of the given height on the active
+    // cameras. Each camera is drained by its own thread so that a slow
+    // client never stalls the sensor; completed swaths wait in a short
+    // queue, oldest dropped. The callback runs on the capture thread
+    // whenever a swath is ready.
+    void start_strips(int height, std::function<void()> on_swath)
+    {
+        stop_strips();
+        strip_height = height;
+        swath_ready = on_swath;
+
+        // The strip runs across the middle of the sensor. The offsets are
+        // kept even so the strip starts on the same Bayer phase as the
+        // full frame.
+        const IS_RECT strip{STRIP_X, (HEIGHT - height) / 2 & ~1,
+            STRIP_WIDTH, height};
+        for (const auto& camera : cameras) {
+            if (!camera.active)
+                continue;
+            set_aoi(camera, strip);
+
+            // Queue a ring of strip-sized buffers for continuous capture.
+            for (int i = 0; i < STRIP_BUFFERS; ++i) {
+                std::pair<char*, int> buffer;
+                is_AllocImageMem(camera.id, STRIP_WIDTH, height,
+                        bits_per_pixel(), &buffer.first, &buffer.second);
+                is_AddToSequence(camera.id, buffer.first, buffer.second);
+                camera.sequence.push_back(buffer);
+            }
+            is_GetImageMemPitch(camera.id, &camera.strip_pitch);
+        }
+        plan_bus();
+
+        scanning = true;
+        for (const auto& camera : cameras) {
+            if (!camera.active)
+                continue;
+            is_InitImageQueue(camera.id, 0);
+            if (is_CaptureVideo(camera.id, IS_DONT_WAIT) != IS_SUCCESS) {
+                // Undo the cameras already scanning, so that a failure
+                // leaves both in full-frame capture.
+                stop_strips();
+                throw Camera_exception{"could not start strip capture"};
+            }
+            strip_threads.emplace_back(&Camera::scan, this, std::cref(camera));
+        }
+    }
+
+    // Stops strip capture, releases the strip buffers and returns the
+    // cameras to full-frame capture.
+    void stop_strips()
+    {
+        if (!scanning)
+            return;
+        scanning = false;
+        for (auto& thread : strip_threads)
+            thread.join();
+        strip_threads.clear();
+
+        for (const auto& camera : cameras) {
+            if (camera.sequence.empty())
+                continue;
+            is_StopLiveVideo(camera.id, IS_WAIT);
+            is_ExitImageQueue(camera.id);
+            is_ClearSequence(camera.id);
+            for (const auto& buffer : camera.sequence)
+                is_FreeImageMem(camera.id, buffer.first, buffer.second);
+            camera.sequence.clear();
+            is_SetImageMem(camera.id, camera.mem, camera.mem_id);
+            set_aoi(camera, aoi);
+        }
+        strip_height = 0;
+        plan_bus();
+    }
+
+    bool strips() const
+    {
+        return scanning;
+    }
+
+    int strip_rows() const
+    {
+        return strip_height;
     }
 
-    std::vector<unsigned char> snap()
+    // Takes the oldest completed swath from either camera, if any.
+    bool next_swath(Swath& swath)
+    {
+        std::lock_guard<std::mutex> lock{swath_mutex};
+        if (swaths.empty())
+            return false;
+        swath = std::move(swaths.front());
+        swaths.pop_front();
+        return true;
+    }
+
+    Swath_telemetry encode(const Swath& swath, int quality)
     {
         using namespace std::chrono;
-        time_point<system_clock> start, end;
+        Trace_span span{"encode swath"};
+        const auto start = system_clock::now();
+
+        std::vector<unsigned char> image;
+        if (mode == BAYER) {
+            const auto& camera = swath.camera == LEFT_DEV_ID
+                ? cameras[0] : cameras[1];
+            std::vector<unsigned char> pixels(swath.pixels.size() * 3);
+            demosaic(swath.pixels.data(), swath.width, swath.height,
+                    swath.width, camera.pattern, pixels.data());
+            image = encode_jpeg(pixels.data(), swath.width, swath.height,
+                    JCS_RGB, quality);
+        } else {
+            image = encode_jpeg(swath.pixels.data(), swath.width,
+                    swath.height, JCS_EXT_BGR, quality);
+        }
 
-        static size_t current = 0;
-        static size_t count[2] = {0, 0};
-        const Physical_camera& camera = cameras[current];
+        const auto end = system_clock::now();
+        std::clog << "camera: " << swath.camera << " "
+            << "swath: " << swath.width << "x" << swath.height << " "
+            << "encode: " << duration_cast<milliseconds>(end-start).count()
+            << "ms\n";
+        return Swath_telemetry{swath.camera, swath.width, swath.height,
+            swath.timestamps, std::move(image)};
+    }
 
-        // Use next camera when snap() is called again.
-        current = (current+1) % cameras.size();
+    // Snaps the next active camera in turn. The frame points into the
+    // memory of that camera and stays valid until it is snapped again.
+    Frame grab() override
+    {
+        const Physical_camera* next = &cameras[current];
+        for (size_t i = 0; i < cameras.size(); ++i) {
+            next = &cameras[current];
+            // Use next camera when grab() is called again.
+            current = (current+1) % cameras.size();
+            if (next->active)
+                break;
+        }
+        const Physical_camera& camera = *next;
 
-        start = system_clock::now();
         INT result;
         do {
             is_SetImageMem(camera.id, camera.mem, camera.mem_id);
             result = is_FreezeVideo(camera.id, IS_WAIT);
+            if (result != IS_SUCCESS)
+                ++camera.retries;
         } while (result != IS_SUCCESS);
 
-        IMAGE_FILE_PARAMS params;
-        params.pnImageID = (UINT*)&camera.mem_id;
-        params.ppcImageMem = &camera.mem;
+        // The AOI is read out to the start of the image memory.
+        return Frame{static_cast<int>(camera.id), camera.frames++, now_us(),
+            aoi.s32Width, aoi.s32Height, camera.pitch,
+            mode == BAYER ? Pixel_format::BAYER : Pixel_format::BGR,
+            camera.pattern, reinterpret_cast<const unsigned char*>(camera.mem),
+            aoi.s32X, aoi.s32Y};
+    }
 
-        std::wstringstream wss;
-        wss << "images/camera-" << camera.id
-            << "-" << count[current]++ << ".jpg";
+    // Snaps the next active camera in turn once per exposure time in ms,
+    // back to back, each into image memory of its own, and restores the
+    // exposure set before. The frames stay valid until the next bracket.
+    std::vector<Frame> bracket(const std::vector<double>& exposures)
+    {
+        if (scanning)
+            throw Camera_exception{"cannot bracket while capturing strips"};
+        const Physical_camera* next = &cameras[current];
+        for (size_t i = 0; i < cameras.size(); ++i) {
+            next = &cameras[current];
+            current = (current+1) % cameras.size();
+            if (next->active)
+                break;
+        }
+        const Physical_camera& camera = *next;
 
-        const std::wstring ws = wss.str();
-        const std::string filename{ws.begin(), ws.end()};
+        while (camera.brackets.size() < exposures.size()) {
+            std::pair<char*, int> buffer;
+            if (is_AllocImageMem(camera.id, WIDTH, HEIGHT, bits_per_pixel(),
+                        &buffer.first, &buffer.second) != IS_SUCCESS)
+                throw Camera_exception{"could not allocate bracket memory"};
+            camera.brackets.push_back(buffer);
+        }
 
-        params.pwchFileName = const_cast<wchar_t*>(ws.c_str());
-        params.nFileType = IS_IMG_JPG;
-        params.nQuality = 80;
-        auto r = is_ImageFile(camera.id, IS_IMAGE_FILE_CMD_SAVE,
-                (void*)&params, sizeof(params));
-        switch (r) {
-        case IS_SUCCESS:
-            break;
-        case IS_INVALID_PARAMETER:
-            std::cerr << "IS_INVALID_PARAMETER\n";
-            break;
-        case IS_FILE_READ_INVALID_BMP_ID:
-            std::cerr << "IS_FILE_READ_INVALID_BMP\n";
-            break;
-        case IS_FILE_READ_OPEN_ERROR:
-            std::cerr << "IS_FILE_READ_OPEN_ERROR\n";
-            break;
-        case IS_NO_SUCCESS:
-            std::cerr << "IS_NO_SUCCESS\n";
+        double previous = 0;
+        is_Exposure(camera.id, IS_EXPOSURE_CMD_GET_EXPOSURE, &previous,
+                sizeof(previous));
+        std::vector<Frame> frames;
+        for (size_t i = 0; i < exposures.size(); ++i) {
+            double ms = exposures[i];
+            if (is_Exposure(camera.id, IS_EXPOSURE_CMD_SET_EXPOSURE, &ms,
+                        sizeof(ms)) != IS_SUCCESS)
+                throw Camera_exception{"could not set exposure"};
+            const auto& buffer = camera.brackets[i];
+            INT result;
+            do {
+                is_SetImageMem(camera.id, buffer.first, buffer.second);
+                result = is_FreezeVideo(camera.id, IS_WAIT);
+                if (result != IS_SUCCESS)
+                    ++camera.retries;
+            } while (result != IS_SUCCESS);
+            frames.push_back(Frame{static_cast<int>(camera.id),
+                camera.frames++, now_us(), aoi.s32Width, aoi.s32Height,
+                camera.pitch,
+                mode == BAYER ? Pixel_format::BAYER : Pixel_format::BGR,
+                camera.pattern,
+                reinterpret_cast<const unsigned char*>(buffer.first),
+                aoi.s32X, aoi.s32Y});
+        }
+        is_Exposure(camera.id, IS_EXPOSURE_CMD_SET_EXPOSURE, &previous,
+                sizeof(previous));
+        is_SetImageMem(camera.id, camera.mem, camera.mem_id);
+        return frames;
+    }
+
+    // The settings below may be changed at runtime between frames. They
+    // apply to every camera and throw a Camera_exception if the driver
+    // rejects them.
+
+    Mode get_mode() const
+    {
+        return mode;
+    }
+
+    // Switches between on-camera colour conversion and raw transfer,
+    // reallocating the image memory for the new pixel size.
+    void set_mode(Mode new_mode)
+    {
+        if (scanning)
+            throw Camera_exception{"cannot change mode while capturing strips"};
+        mode = new_mode;
+        for (const auto& camera : cameras) {
+            is_FreeImageMem(camera.id, camera.mem, camera.mem_id);
+            for (const auto& buffer : camera.brackets)
+                is_FreeImageMem(camera.id, buffer.first, buffer.second);
+            camera.brackets.clear();
+            allocate(camera);
+            set_aoi(camera, aoi);
+        }
+        plan_bus();
+    }
+
+    // Exposure time in milliseconds.
+    double exposure() const
+    {
+        double ms = 0;
+        is_Exposure(cameras[0].id, IS_EXPOSURE_CMD_GET_EXPOSURE, &ms,
+                sizeof(ms));
+        return ms;
+    }
+
+    void set_exposure(double ms)
+    {
+        for (const auto& camera : cameras)
+            if (is_Exposure(camera.id, IS_EXPOSURE_CMD_SET_EXPOSURE, &ms,
+                        sizeof(ms)) != IS_SUCCESS)
+                throw Camera_exception{"could not set exposure"};
+    }
+
+    double frame_rate() const
+    {
+        return cameras[0].frame_rate;
+    }
+
+    // The driver clamps the rate to what the pixel clock allows.
+    void set_frame_rate(double fps)
+    {
+        for (const auto& camera : cameras)
+            if (is_SetFrameRate(camera.id, fps, &camera.frame_rate)
+                    != IS_SUCCESS)
+                throw Camera_exception{"could not set frame rate"};
+    }
+
+    const IS_RECT& area() const
+    {
+        return aoi;
+    }
+
+    // Restricts full-frame capture to an area of interest; a zero width
+    // or height restores the full sensor. Offsets are rounded down to
+    // even values to keep the Bayer phase.
+    void set_area(int x, int y, int width, int height)
+    {
+        if (scanning)
+            throw Camera_exception{"cannot change AOI while capturing strips"};
+        IS_RECT area{x & ~1, y & ~1, width, height};
+        if (width <= 0 || height <= 0)
+            area = IS_RECT{0, 0, WIDTH, HEIGHT};
+        for (size_t i = 0; i < cameras.size(); ++i) {
+            try {
+                set_aoi(cameras[i], area);
+            } catch (Camera_exception&) {
+                // Put the cameras already changed back on the old area,
+                // so that they all still capture the same one.
+                for (size_t j = 0; j < i; ++j)
+                    is_AOI(cameras[j].id, IS_AOI_IMAGE_SET_AOI, &aoi,
+                            sizeof(aoi));
+                throw;
+            }
+        }
+        aoi = area;
+        plan_bus();
+    }
+
+    Power get_power() const
+    {
+        return power;
+    }
+
+    // Strip capture must be stopped before leaving full power. Waking
+    // replans the bus and then restores the frame rate set before.
+    void set_power(Power level)
+    {
+        if (level == power)
+            return;
+        if (scanning)
+            throw Camera_exception{"cannot idle while capturing strips"};
+
+        if (power == STANDBY)
+            for (const auto& camera : cameras)
+                if (is_CameraStatus(camera.id, IS_STANDBY, FALSE)
+                        != IS_SUCCESS)
+                    throw Camera_exception{"could not wake camera"};
+        if (power == FULL)
+            full_rate = frame_rate();
+
+        switch (level) {
+        case FULL:
+            plan_bus();
+            set_frame_rate(full_rate);
             break;
-        case IS_NOT_SUPPORTED:
-            std::cerr << "IS_NOT_SUPPORTED\n";
+        case LOW:
+            for (const auto& camera : cameras) {
+                UINT range[3];
+                is_PixelClock(camera.id, IS_PIXELCLOCK_CMD_GET_RANGE, range,
+                        sizeof(range));
+                is_PixelClock(camera.id, IS_PIXELCLOCK_CMD_SET, &range[0],
+                        sizeof(range[0]));
+                double min_time, max_time, interval;
+                is_GetFrameTimeRange(camera.id, &min_time, &max_time,
+                        &interval);
+                is_SetFrameRate(camera.id, 1 / max_time, &camera.frame_rate);
+                camera.pixel_clock = range[0];
+            }
             break;
-        default:
-            std::cerr << "unknown:" << r << '\n';
+        case STANDBY:
+            for (const auto& camera : cameras)
+                if (is_CameraStatus(camera.id, IS_STANDBY, TRUE)
+                        != IS_SUCCESS)
+                    throw Camera_exception{"could not put camera in standby"};
             break;
         }
+        power = level;
+    }
 
-        end = system_clock::now();
-        const auto elapsed = duration_cast<milliseconds>(end-start).count();
-        std::clog << "camera: " << camera.id << " "
-            << "time: " << elapsed << "ms\n";
+    std::vector<int> active_cameras() const
+    {
+        std::vector<int> ids;
+        for (const auto& camera : cameras)
+            if (camera.active)
+                ids.push_back(camera.id);
+        return ids;
+    }
 
-        std::ifstream file(filename, std::ios::binary);
-        return std::vector<unsigned char>((
-                std::istreambuf_iterator<char>(file)),
-                std::istreambuf_iterator<char>());
+    // Chooses which cameras grab() alternates between.
+    void set_active_cameras(const std::vector<int>& ids)
+    {
+        if (scanning)
+            throw Camera_exception{
+                "cannot change cameras while capturing strips"};
+        bool any = false;
+        for (const auto& camera : cameras) {
+            camera.active = std::find(ids.begin(), ids.end(),
+                    static_cast<int>(camera.id)) != ids.end();
+            any = any || camera.active;
+        }
+        if (!any) {
+            for (const auto& camera : cameras)
+                camera.active = true;
+            throw Camera_exception{"no such camera"};
+        }
+        plan_bus();
     }
 
 private:
@@ -129,8 +527,32 @@ private:
         HIDS id;
         mutable char* mem;
         mutable int mem_id;
+        mutable int pitch;
+        mutable Bayer_pattern pattern;
+        mutable unsigned pixel_clock;
+        mutable double frame_rate;
+        mutable std::atomic<unsigned long> frames;
+        mutable std::atomic<unsigned long> retries;
+        mutable std::atomic<unsigned long> dropped;
+        mutable bool active;
+        mutable int strip_pitch;
+        mutable std::vector<std::pair<char*, int>> sequence;
+        mutable std::vector<std::pair<char*, int>> brackets;
     };
 
+    Mode mode;
+    const int bus_budget;
+    int strip_height;
+    IS_RECT aoi;
+    size_t current;
+    Power power;
+    double full_rate;
+
+    std::atomic<bool> scanning;
+    std::vector<std::thread> strip_threads;
+    std::mutex swath_mutex;
+    std::function<void()> swath_ready;
+    std::deque<Swath> swaths;
     std::array<Physical_camera, 2> cameras;
 
     void initialize(const Physical_camera& camera)
@@ -148,30 +570,220 @@ private:
         if (result != IS_SUCCESS)
             throw Camera_exception{"could not enable auto exit"};
 
+        // Find out which colour the top-left pixel carries, for when
+        // raw sensor data is demosaiced on the host.
+        SENSORINFO info;
+        is_GetSensorInfo(camera.id, &info);
+        switch (info.nUpperLeftBayerPixel) {
+        case BAYER_PIXEL_RED:
+            camera.pattern = Bayer_pattern::RGGB;
+            break;
+        case BAYER_PIXEL_BLUE:
+            camera.pattern = Bayer_pattern::BGGR;
+            break;
+        default:
+            // The sensor info does not say which green; GRBG is the
+            // layout of the Aptina sensors used by uEye cameras.
+            camera.pattern = Bayer_pattern::GRBG;
+            break;
+        }
+
         // Set the UI-1495LE-C cameras to operate in full 10MP mode
         // and allocate a memory buffer.
-        const int width = 3840;
-        const int height = 2748;
-        const int bitspixel = 24;
         const int format = 21;
-        is_AllocImageMem(camera.id, width, height, bitspixel,
-                &camera.mem, &camera.mem_id);
-        is_SetImageMem(camera.id, camera.mem, camera.mem_id);
+        allocate(camera);
         is_ImageFormat(camera.id, IMGFRMT_CMD_SET_FORMAT,
                 const_cast<int*>(&format), sizeof(format));
+        camera.active = true;
+    }
 
-#if 0
-        // Set the area of interest for this camera.
-        IS_RECT aoi;
-        aoi.s32X = 800;
-        aoi.s32Y = 1372;
-        aoi.s32Width = 3040;
-        aoi.s32Height = 406;
+    int bits_per_pixel() const
+    {
+        return mode == BAYER ? 8 : 24;
+    }
 
-        result = is_AOI(camera.id, IS_AOI_IMAGE_SET_AOI, &aoi, sizeof(aoi));
+    // Sets the colour mode and allocates full-frame image memory for it.
+    // In BAYER mode the camera delivers unprocessed sensor data.
+    void allocate(const Physical_camera& camera)
+    {
+        const auto result = is_SetColorMode(camera.id,
+                mode == BAYER ? IS_CM_SENSOR_RAW8 : IS_CM_BGR8_PACKED);
+        if (result != IS_SUCCESS)
+            throw Camera_exception{"could not set color mode"};
+
+        is_AllocImageMem(camera.id, WIDTH, HEIGHT, bits_per_pixel(),
+                &camera.mem, &camera.mem_id);
+        is_SetImageMem(camera.id, camera.mem, camera.mem_id);
+        is_GetImageMemPitch(camera.id, &camera.pitch);
+    }
+
+    void set_aoi(const Physical_camera& camera, IS_RECT area)
+    {
+        const auto result = is_AOI(camera.id, IS_AOI_IMAGE_SET_AOI, &area,
+                sizeof(area));
         if (result != IS_SUCCESS)
             throw Camera_exception{"could not set AOI for camera"};
-#endif
+    }
+
+    // Drains the capture queue of one camera into swaths until strip
+    // capture is stopped, logging the strip rate about once a second.
+    void scan(const Physical_camera& camera)
+    {
+        using namespace std::chrono;
+
+        const int bytes_per_pixel = bits_per_pixel() / 8;
+        Swath_assembler assembler{static_cast<int>(camera.id), STRIP_WIDTH,
+            strip_height, bytes_per_pixel, SWATH_STRIPS};
+
+        UINT64 last_frame = 0;
+        unsigned long strips = 0;
+        auto window = steady_clock::now();
+        while (scanning) {
+            char* mem;
+            INT mem_id;
+            if (is_WaitForNextImage(camera.id, 100, &mem, &mem_id)
+                    != IS_SUCCESS)
+                continue;
+
+            // Gaps in the device frame counter are strips the driver
+            // had no free buffer for. A swath must not span one, so the
+            // strips since the last complete swath go too.
+            UEYEIMAGEINFO info;
+            is_GetImageInfo(camera.id, mem_id, &info, sizeof(info));
+            if (last_frame > 0 && info.u64FrameNumber > last_frame + 1)
+                camera.dropped += info.u64FrameNumber - last_frame - 1
+                    + assembler.restart();
+            last_frame = info.u64FrameNumber;
+
+            bool complete;
+            {
+                Trace_span span{"strip",
+                    static_cast<long>(info.u64FrameNumber)};
+                complete = assembler.add(
+                        reinterpret_cast<const unsigned char*>(mem),
+                        camera.strip_pitch, info.u64TimestampDevice);
+                is_UnlockSeqBuf(camera.id, mem_id, mem);
+            }
+            ++camera.frames;
+            ++strips;
+
+            if (complete) {
+                {
+                    std::lock_guard<std::mutex> lock{swath_mutex};
+                    if (swaths.size() == MAX_SWATHS) {
+                        drop_swath(swaths.front());
+                        swaths.pop_front();
+                    }
+                    swaths.push_back(assembler.take());
+                }
+                swath_ready();
+            }
+
+            const auto now = steady_clock::now();
+            const double elapsed = duration<double>(now - window).count();
+            if (elapsed >= 1) {
+                std::clog << "camera: " << camera.id << " "
+                    << "strips: " << strips / elapsed << "/s "
+                    << "dropped: " << camera.dropped << '\n';
+                strips = 0;
+                window = now;
+            }
+        }
+    }
+
+    // Counts an unsent swath against the camera it came from, which is
+    // not necessarily the one whose swath pushed it out of the queue.
+    void drop_swath(const Swath& swath)
+    {
+        for (const auto& camera : cameras)
+            if (static_cast<int>(camera.id) == swath.camera)
+                camera.dropped += SWATH_STRIPS;
+    }
+
+    // Shares the USB bus between the cameras. While a frame is read out a
+    // camera streams at its pixel clock times the bytes per pixel, and
+    // when the cameras together exceed what the bus carries, transfers
+    // fail and frames have to be retried. Each camera gets an equal share
+    // of the budget, rounded down to a pixel clock it supports, and then
+    // runs at the highest frame rate that pixel clock allows. A camera
+    // whose driver will not go along with that is left at the driver's
+    // default pixel clock and frame rate instead.
+    void plan_bus()
+    {
+        const int bytes_per_pixel = bits_per_pixel() / 8;
+        const unsigned share = bus_budget
+            / std::max<size_t>(1, active_cameras().size()) / bytes_per_pixel;
+
+        for (const auto& camera : cameras) {
+            if (!camera.active)
+                continue;
+            if (!plan_camera(camera, share)) {
+                std::clog << "camera: " << camera.id << " "
+                    << "bus plan failed, using driver defaults\n";
+                use_driver_defaults(camera);
+            }
+            std::clog << "camera: " << camera.id << " "
+                << "pixel clock: " << camera.pixel_clock << "MHz "
+                << "frame rate: " << camera.frame_rate << "fps "
+                << "bus: " << camera.pixel_clock * bytes_per_pixel
+                << "MB/s\n";
+        }
+    }
+
+    // Sets a camera's pixel clock to its share of the bus in MHz and its
+    // frame rate to the highest that clock allows. Returns false if the
+    // driver fails to report or take either.
+    bool plan_camera(const Physical_camera& camera, unsigned share)
+    {
+        // The range is {min, max, increment} in MHz; an increment of
+        // zero means only discrete values are supported, in which case
+        // the driver picks the closest one.
+        UINT range[3];
+        if (is_PixelClock(camera.id, IS_PIXELCLOCK_CMD_GET_RANGE, range,
+                    sizeof(range)) != IS_SUCCESS
+                || range[0] == 0 || range[0] > range[1])
+            return false;
+
+        UINT clock = std::min(std::max(share, range[0]), range[1]);
+        if (range[2] > 0)
+            clock = range[0] + (clock - range[0]) / range[2] * range[2];
+        if (clock > share)
+            std::clog << "camera: " << camera.id << " "
+                << "bus budget below minimum pixel clock\n";
+        if (is_PixelClock(camera.id, IS_PIXELCLOCK_CMD_SET, &clock,
+                    sizeof(clock)) != IS_SUCCESS)
+            return false;
+
+        double min_time, max_time, interval;
+        if (is_GetFrameTimeRange(camera.id, &min_time, &max_time, &interval)
+                != IS_SUCCESS || !(min_time > 0) || min_time > max_time)
+            return false;
+        if (is_SetFrameRate(camera.id, 1 / min_time, &camera.frame_rate)
+                != IS_SUCCESS)
+            return false;
+
+        camera.pixel_clock = clock;
+        return true;
+    }
+
+    // Puts a camera back on the pixel clock and frame rate the driver
+    // starts it with.
+    void use_driver_defaults(const Physical_camera& camera)
+    {
+        UINT clock;
+        if (is_PixelClock(camera.id, IS_PIXELCLOCK_CMD_GET_DEFAULT, &clock,
+                    sizeof(clock)) != IS_SUCCESS
+                || is_PixelClock(camera.id, IS_PIXELCLOCK_CMD_SET, &clock,
+                    sizeof(clock)) != IS_SUCCESS)
+            throw Camera_exception{"could not set default pixel clock"};
+
+        double rate;
+        if (is_SetFrameRate(camera.id, IS_GET_DEFAULT_FRAMERATE, &rate)
+                != IS_SUCCESS
+                || is_SetFrameRate(camera.id, rate, &camera.frame_rate)
+                != IS_SUCCESS)
+            throw Camera_exception{"could not set default frame rate"};
+        camera.pixel_clock = clock;
     }
 
     void destroy(const Physical_camera& camera)
@@ -183,41 +795,1911 @@ private:
     }
 };
 
-struct Telemetry {
-    int width;
-    int height;
-    std::vector<unsigned char> image;
-
-    MSGPACK_DEFINE(width, height, image);
+// A captured frame as shared between the consumers in the server.
+struct Capture {
+    Telemetry telemetry;
+    bool triggered;             // by the scheduler rather than a request
+    std::vector<unsigned char> archived;    // if the archive's differs
 };
 
-int main()
+// Where the archive keeps a frame.
+std::string archive_path(int camera, unsigned long sequence)
 {
-    try {
-        Camera camera;
-        camera.initialize();
+    std::ostringstream name;
+    name << "images/camera-" << camera << "-" << sequence << ".jpg";
+    return name.str();
+}
 
-        void* context = zmq_ctx_new();
-        void* socket = zmq_socket(context, ZMQ_REP);
-        int rc = zmq_bind(socket, "tcp://*:5555");
+// Whether a directory is the archive's. A replay of it would overwrite
+// the recording as it went, since sequence numbers start again.
+bool is_archive(const std::string& directory)
+{
+    struct stat given;
+    struct stat archive;
+    return stat(directory.c_str(), &given) == 0
+        && stat("images", &archive) == 0
+        && given.st_dev == archive.st_dev && given.st_ino == archive.st_ino;
+}
+
+// Writes an encoded frame to the on-board archive.
+void archive(const Capture& capture)
+{
+    const Telemetry& frame = capture.telemetry;
+    const auto& image = capture.archived.empty()
+        ? frame.image : capture.archived;
+    Trace_span span{"archive", static_cast<long>(frame.sequence)};
+    std::ofstream file(archive_path(frame.camera, frame.sequence),
+            std::ios::binary);
+    file.write(reinterpret_cast<const char*>(image.data()), image.size());
+}
+
+// Packs a value with msgpack and sends it as the reply to a request.
+template<typename T>
+void reply(void* socket, const T& value)
+{
+    msgpack::sbuffer sbuf;
+    {
+        Trace_span span{"pack"};
+        msgpack::pack(sbuf, value);
+    }
+
+    Trace_span span{"send"};
+    zmq_msg_t msg;
+    zmq_msg_init_size(&msg, sbuf.size());
+    memcpy(zmq_msg_data(&msg), sbuf.data(), sbuf.size());
+    zmq_msg_send(&msg, socket, 0);
+    zmq_msg_close(&msg);
+}
+
+// The Server answers requests on the data socket from an event loop.
+// Image requests grab and encode a frame in the handler; in strip mode
+// a request waits for the next swath without blocking the loop, and is
+// answered when the capture threads signal that one is ready.
+//
+// Every captured frame is published once to a broadcast ring shared by
+// the consumers: an archive thread, which holds capture back rather
+// than lose frames, and "next" requests, which take the oldest frame
+// triggered by the capture scheduler that the ground station has not
+// had yet, waiting for one if there is none, and skip frames when the
+// link falls a ring behind. A "consumers" request returns the read,
+// drop and lag counters of each. A periodic heartbeat logs the source,
+// pool and consumer counters.
+//
+// On the stream socket, two ports up, a request is answered with a
+// series of messages rather than one: the frame's Telemetry without the
+// image, the JPEG in chunks sent as the encoder produces them, and an
+// empty message to end the frame. ZeroMQ only delivers a multipart
+// message once its last part is sent, so the chunks go as messages of
+// their own on a ROUTER socket, which lets transmission overlap with
+// encoding. Any parts before the request are its envelope and are sent
+// back on every reply, so the socket works through proxies. Streamed
+// frames are archived and queued like any other.
+//
+// A catalogue thread publishes every frame in the ring on the catalogue
+// socket, three ports up, as a Catalogue_entry with a thumbnail decoded
+// straight from the JPEG at an eighth of its size. It skips frames when
+// it falls a ring behind. A client can then fetch any frame it saw in
+// the catalogue with "get camera sequence": from the ring if it is still
+// there, otherwise from the archive.
+//
+// With a frame history, every captured frame is also kept in RAM at full
+// resolution, as it was grabbed, and a timer captures frames between
+// requests whenever the history would otherwise fall below its rate.
+// An "event" request freezes the frames of every camera from the
+// history's length before it to a little after it, archives them again
+// from the raw frames on a thread of their own, and is answered with a
+// Catalogue_entry, without a thumbnail, for each, so that they can be
+// fetched with "get camera sequence". A "history" request returns the
+// History_stats, which the heartbeat logs as well.
+//
+// With a footprint index, every frame published is placed on the ground
+// from the aircraft's track at its timestamp and the intrinsics of its
+// camera, and added to an R-tree kept next to the archive, which the
+// controller queries for the frames covering a point.
+class Server {
+public:
+    static const int HEARTBEAT_SECONDS = 30;
+    static const int PORT = 5555;
+    static const size_t RING_SLOTS = 32;
+    static const size_t STREAM_CHUNK = 64 * 1024;
+    static const int STREAM_WAIT_MS = 500;  // for a client to make room
+    static const int THUMBNAIL_SCALE = 8;
+    static const int THUMBNAIL_QUALITY = 50;
+    static const int BACKGROUND_QUALITY = 30;
+
+    // With temporal denoising, every so many frames are also encoded
+    // as captured to measure what denoising saves.
+    static const int DENOISE_SAMPLE = 10;
+
+    typedef Broadcast_ring<Capture>::Ref Capture_ref;
+
+    // The camera is null when frames come from a replay or synthetic
+    // source; strip mode is only available with the cameras.
+    Server(Event_loop& loop, void* context, Frame_source& source,
+            Camera* camera, int strip_height, int port = PORT)
+        : loop(loop), source(source), camera{camera},
+          socket{zmq_socket(context, ZMQ_REP)},
+          streamer{zmq_socket(context, ZMQ_ROUTER)},
+          catalogue{zmq_socket(context, ZMQ_PUB)}, quality{Camera::QUALITY},
+          background_quality{BACKGROUND_QUALITY},
+          pending{NONE}, undistort_network{false}, undistort_archive{false},
+          mosaic_scale{1}, denoise_frames{1}, denoised{0},
+          history_before{0}, history_after{0}, history_period{},
+          history_added{}, event_time{0}, ground{0},
+          captures{RING_SLOTS}, newest_capture{0}
+    {
+        const std::string endpoint = "tcp://*:" + std::to_string(port);
+        if (zmq_bind(socket.get(), endpoint.c_str()) != 0)
+            throw std::runtime_error{"could not bind data socket"};
+
+        // Block rather than silently drop chunks a slow client has not
+        // taken yet.
+        const int mandatory = 1;
+        zmq_setsockopt(streamer.get(), ZMQ_ROUTER_MANDATORY, &mandatory,
+                sizeof(mandatory));
+        const std::string stream_endpoint = "tcp://*:"
+            + std::to_string(port + 2);
+        if (zmq_bind(streamer.get(), stream_endpoint.c_str()) != 0)
+            throw std::runtime_error{"could not bind stream socket"};
+        const std::string catalogue_endpoint = "tcp://*:"
+            + std::to_string(port + 3);
+        if (zmq_bind(catalogue.get(), catalogue_endpoint.c_str()) != 0)
+            throw std::runtime_error{"could not bind catalogue socket"};
+
+        network = captures.add_consumer("network",
+                Broadcast_ring<Capture>::SKIP);
+        archive_reader = captures.add_consumer("archive",
+                Broadcast_ring<Capture>::BLOCK);
+        catalogue_reader = captures.add_consumer("catalogue",
+                Broadcast_ring<Capture>::SKIP);
+
+        loop.add_socket(socket.get(), [this] { handle_request(); });
+        loop.add_socket(streamer.get(), [this] { handle_stream(); });
+        loop.add_timer(std::chrono::seconds(HEARTBEAT_SECONDS),
+                [this] { heartbeat(); });
+        set_strips(strip_height);
+
+        // Threads go last: a constructor that throws must not leave one
+        // joinable.
+        archiver = std::thread{&Server::archive_frames, this};
+        cataloguer = std::thread{&Server::catalogue_frames, this};
+    }
+
+    ~Server()
+    {
+        // The capture threads post to the loop, so stop them first.
+        set_strips(0);
+        captures.close();
+        archiver.join();
+        cataloguer.join();
+        if (event_writer.joinable())
+            event_writer.join();
+    }
+
+    // Disallow copying and moving.
+    Server(const Server&) = delete;
+    Server& operator=(const Server&) = delete;
+
+    // Calls the handler before each request is served, for example to
+    // wake the cameras.
+    void on_request(std::function<void()> handler)
+    {
+        request_hook = handler;
+    }
+
+    int jpeg_quality() const
+    {
+        return quality;
+    }
+
+    void set_quality(int value)
+    {
+        quality = std::min(100, std::max(1, value));
+    }
+
+    const std::vector<Jpeg_region>& quality_regions() const
+    {
+        return regions;
+    }
+
+    int background_jpeg_quality() const
+    {
+        return background_quality;
+    }
+
+    // Keeps the JPEG quality only in the given regions of each frame sent
+    // to clients and coarsens the rest to the background quality; no
+    // regions sends whole frames at one quality again. The archive keeps
+    // the frames at full quality. Streamed frames are sent before they
+    // could be requantised and are not affected.
+    void set_quality_regions(const std::vector<Jpeg_region>& areas,
+            int background)
+    {
+        regions = areas;
+        background_quality = std::min(100, std::max(1, background));
+    }
+
+    // Switches between strip capture with the given strip height and
+    // full frames (height zero). A request waiting for a swath when
+    // strips stop is answered with a full frame instead.
+    void set_strips(int height)
+    {
+        if (!camera)
+            return;
+        if (height > 0) {
+            camera->start_strips(height, [this] {
+                this->loop.post([this] { send_swath(); });
+            });
+        } else if (camera->strips()) {
+            camera->stop_strips();
+            if (pending == SWATH) {
+                pending = NONE;
+                send_frame();
+            }
+        }
+    }
+
+    bool strip_mode() const
+    {
+        return camera && camera->strips();
+    }
+
+    // Undistorts the frames of the calibrated cameras for the chosen
+    // outputs: the replies on the data socket, the archive or both. The
+    // remap tables of a camera are built by prepare_undistortion(), or
+    // on its first frame, and again if the frame's area of the sensor
+    // changes. When just one output is undistorted each frame is encoded
+    // twice.
+    void set_undistortion(const std::map<int, Lens>& calibration,
+            bool network, bool archive)
+    {
+        lenses = calibration;
+        undistorters.clear();
+        undistort_network = network;
+        undistort_archive = archive;
+    }
+
+    // Builds the undistortion tables of every calibrated camera for
+    // frames of the given area of the sensor ahead of time, so that the
+    // first frame after start-up or an AOI change does not wait for
+    // them.
+    void prepare_undistortion(int left, int top, int width, int height)
+    {
+        if (!undistort_network && !undistort_archive)
+            return;
+        for (const auto& lens : lenses)
+            build_undistorter(lens.first, left, top, width, height);
+    }
+
+    // Enables "mosaic" requests, which are answered with the next frame
+    // of each camera warped into one quick-look image, each mosaic pixel
+    // covering scale pixels of the frames a side. The mosaic tables are
+    // built on the first request and again only if the frame size
+    // changes.
+    void set_mosaic(const Homography& homography, int scale)
+    {
+        mosaic_layout.reset(new Homography(homography));
+        mosaic_scale = std::max(1, scale);
+        mosaic.reset();
+    }
+
+    // Captures every frame as a bracket of exposures the given number
+    // of stops from the camera's exposure, such as {-1, 0, 1}, fused
+    // into one; an empty list captures single frames again. Bracketing
+    // needs the cameras and is suspended in strip mode.
+    void set_bracket(const std::vector<double>& stops)
+    {
+        if (!camera && !stops.empty())
+            throw std::runtime_error{"bracketing needs the cameras"};
+        if (stops.size() > Exposure_fusion::MAX_EXPOSURES)
+            throw std::runtime_error{"too many exposures in a bracket"};
+        bracket_stops = stops;
+    }
+
+    // Averages each frame with up to frames - 1 earlier frames of its
+    // camera, shifted into line, before it is encoded; one turns
+    // denoising off. The denoiser of a camera is built on its first
+    // frame and again only if the frame size or format changes.
+    void set_denoise(int frames)
+    {
+        denoise_frames = std::max(1,
+                std::min(frames, Temporal_denoiser::MAX_FRAMES));
+        denoisers.clear();
+    }
+
+    // Keeps the captured frames of the last seconds in at most megabytes
+    // of RAM, compressed if asked, capturing frames as needed to keep at
+    // least rate frames a second over all cameras. An event takes in the
+    // frames up to after seconds later as well. The history is not kept
+    // in strip mode.
+    void set_history(double seconds, double after, double megabytes,
+            bool compress, double rate)
+    {
+        using namespace std::chrono;
+        history.reset(new Frame_history{seconds + after,
+                static_cast<size_t>(megabytes * 1e6), compress});
+        history_before = seconds;
+        history_after = after;
+        history_period = duration_cast<steady_clock::duration>(
+                duration<double>(1 / rate));
+        loop.add_timer(duration<double>(1 / rate),
+                [this] { record_history(); });
+    }
+
+    // Indexes the ground footprint of every frame of the calibrated
+    // cameras, with the ground at an altitude in metres above the
+    // ellipsoid, loading the footprints already in the archive.
+    void set_footprints(const std::map<int, Lens>& calibration,
+            double ground_altitude)
+    {
+        footprint_lenses = calibration;
+        ground = ground_altitude;
+        footprints.reset(new Footprint_index{"images/footprints.txt"});
+        std::clog << "footprints: " << footprints->size() << " loaded"
+            << std::endl;
+    }
+
+    // Passes on a position fix for placing frames on the ground.
+    void add_fix(const Position& fix)
+    {
+        track.add(fix);
+    }
+
+    // The camera and sequence number of every indexed frame covering a
+    // point in degrees.
+    std::vector<std::vector<uint64_t>> covering(double latitude,
+            double longitude) const
+    {
+        std::vector<std::vector<uint64_t>> frames;
+        if (!footprints)
+            throw std::runtime_error{"no footprint index"};
+        for (const Footprint* footprint
+                : footprints->covering(latitude, longitude))
+            frames.push_back({static_cast<uint64_t>(footprint->camera),
+                    footprint->sequence});
+        return frames;
+    }
+
+    // Grabs and encodes a frame and publishes it to the consumers. Given
+    // the envelope of a request on the stream socket, the frame is also
+    // streamed to it while it is encoded. Given a frame to fill, it is
+    // set to the frame as encoded, whose pixels stay valid until the
+    // next grab.
+    Capture_ref capture(bool triggered = false,
+            const std::vector<std::string>* stream = nullptr,
+            Frame* encoded_frame = nullptr)
+    {
+        using namespace std::chrono;
+        Trace_span span{"capture"};
+        const auto start = steady_clock::now();
+        Frame frame;
+        {
+            Trace_span span{"grab"};
+            frame = bracket_stops.empty() || camera->strips()
+                ? source.grab() : grab_bracket();
+            span.set_frame(frame.sequence);
+        }
+        span.set_frame(frame.sequence);
+        const Frame original = frame;
+        if (history) {
+            history->add(original);
+            history_added = steady_clock::now();
+        }
+        if (denoise_frames > 1)
+            frame = denoise(frame);
+        const auto captured = steady_clock::now();
+        const Undistorter* lens = undistort_network || undistort_archive
+            ? undistorter(frame) : nullptr;
+        auto jpeg = stream
+            ? stream_frame(frame, undistort_network ? lens : nullptr, *stream)
+            : encoder.encode(frame, quality,
+                    undistort_network ? lens : nullptr);
+        auto undistort_time = encoder.undistort_time;
+        std::vector<unsigned char> archived;
+        if (lens && undistort_network != undistort_archive) {
+            archived = encoder.encode(frame, quality,
+                    undistort_archive ? lens : nullptr);
+            undistort_time += encoder.undistort_time;
+        }
+        if (!regions.empty() && !stream)
+            requantize(frame, jpeg, archived);
+        const auto encoded = steady_clock::now();
+
+        std::clog << "camera: " << frame.camera << " "
+            << "time: "
+            << duration_cast<milliseconds>(encoded-start).count()
+            << "ms (capture: "
+            << duration_cast<milliseconds>(captured-start).count()
+            << "ms demosaic: "
+            << duration_cast<milliseconds>(encoder.demosaic_time).count()
+            << "ms undistort: "
+            << duration_cast<milliseconds>(undistort_time).count()
+            << "ms encode: "
+            << duration_cast<milliseconds>(encoded-captured).count()
+            << "ms)\n";
+        if (!bracket_stops.empty() && !camera->strips()) {
+            std::clog << "camera: " << frame.camera << " "
+                << "bracket: " << bracket_stops.size() << " exposures in "
+                << duration_cast<milliseconds>(bracket_time).count()
+                << "ms fuse: "
+                << duration_cast<milliseconds>(fuse_time).count()
+                << "ms shifts:";
+            for (const auto& shift : bracket_shifts)
+                std::clog << ' ' << shift.first << ',' << shift.second;
+            std::clog << '\n';
+        }
+
+        if (denoise_frames > 1 && denoised % DENOISE_SAMPLE == 0) {
+            const auto noisy = encoder.encode(original, quality,
+                    undistort_network ? lens : nullptr);
+            std::clog << "camera: " << frame.camera << " "
+                << "denoise saved: "
+                << static_cast<long>(noisy.size() - jpeg.size())
+                << " bytes (" << 100 - 100.0 * jpeg.size() / noisy.size()
+                << "%)\n";
+        }
+
+        Capture& slot = captures.claim();
+        slot.telemetry = Telemetry{frame.width, frame.height,
+            std::move(jpeg), frame.camera, frame.sequence, frame.timestamp};
+        slot.triggered = triggered;
+        slot.archived = std::move(archived);
+        Capture_ref ref = captures.publish();
+        newest_capture = ref.sequence();
+        index_footprint(frame);
+        if (encoded_frame)
+            *encoded_frame = frame;
+        send_queued();
+        return ref;
+    }
+
+private:
+    // The kind of reply an outstanding request is waiting for.
+    enum Pending { NONE, SWATH, QUEUED, EVENT };
+
+    Event_loop& loop;
+    Frame_source& source;
+    Camera* const camera;
+    const Zmq_socket socket;
+    const Zmq_socket streamer;
+    const Zmq_socket catalogue; // only the catalogue thread uses it
+    Frame_encoder encoder;
+    int quality;
+    std::vector<Jpeg_region> regions;
+    int background_quality;
+    Pending pending;
+    std::function<void()> request_hook;
+
+    std::map<int, Lens> lenses;
+    std::map<int, std::shared_ptr<const Undistorter>> undistorters;
+    bool undistort_network;
+    bool undistort_archive;
+
+    std::unique_ptr<Homography> mosaic_layout;
+    int mosaic_scale;
+    std::unique_ptr<Mosaic> mosaic;
+    std::vector<unsigned char> mosaic_rgb;  // demosaiced raw frames
+
+    std::vector<double> bracket_stops;
+    Exposure_fusion fusion;
+    std::unique_ptr<Thumbnail_matcher> bracket_matcher;
+    std::vector<std::vector<unsigned char>> aligned;    // shifted exposures
+    std::vector<std::pair<int, int>> bracket_shifts;
+    std::vector<unsigned char> fused;
+    std::chrono::steady_clock::duration bracket_time;
+    std::chrono::steady_clock::duration fuse_time;
+
+    int denoise_frames;
+    std::map<int, std::unique_ptr<Temporal_denoiser>> denoisers;
+    unsigned long denoised;
+
+    std::unique_ptr<Frame_history> history;
+    double history_before;      // seconds of frames an event takes in
+    double history_after;
+    std::chrono::steady_clock::duration history_period;
+    std::chrono::steady_clock::time_point history_added;
+    uint64_t event_time;        // of the waiting event request
+    std::thread event_writer;
+    Frame_encoder event_encoder;    // only the event writer uses it
+
+    Track track;
+    std::map<int, Lens> footprint_lenses;
+    double ground;              // metres above the ellipsoid
+    std::unique_ptr<Footprint_index> footprints;
+
+    Broadcast_ring<Capture> captures;
+    int network;
+    int archive_reader;
+    std::thread archiver;
+    int catalogue_reader;
+    std::thread cataloguer;
+    uint64_t newest_capture;    // the ring sequence of the last capture
+
+    // The undistorter for the frame's camera, size and place on the
+    // sensor, or null if the camera is not calibrated. Tables prepared
+    // for another area are built again here, on the loop.
+    const Undistorter* undistorter(const Frame& frame)
+    {
+        const auto lens = lenses.find(frame.camera);
+        if (lens == lenses.end())
+            return nullptr;
+        auto& undistorter = undistorters[frame.camera];
+        if (!undistorter || !undistorter->fits(frame.width, frame.height,
+                    frame.left, frame.top))
+            build_undistorter(frame.camera, frame.left, frame.top,
+                    frame.width, frame.height);
+        return undistorter.get();
+    }
+
+    void build_undistorter(int camera, int left, int top, int width,
+            int height)
+    {
+        const auto start = std::chrono::steady_clock::now();
+        undistorters[camera].reset(new Undistorter{lenses.at(camera), width,
+                height, left, top});
+        std::clog << "camera: " << camera << " "
+            << "undistortion tables: "
+            << std::chrono::duration_cast<std::chrono::milliseconds>(
+                    std::chrono::steady_clock::now() - start).count()
+            << "ms\n";
+    }
+
+    // Snaps a bracket on the next camera and fuses it into a frame that
+    // stays valid until the next bracket. The fused frame takes the
+    // timestamp and sequence number of the middle exposure. The aircraft
+    // moves between exposures, so each of the others is first shifted
+    // into line with the middle one, as far as their thumbnails match
+    // once brought to its brightness; one that does not match is fused
+    // as it is, and logged.
+    Frame grab_bracket()
+    {
+        using namespace std::chrono;
+        const double exposure = camera->exposure();
+        std::vector<double> exposures;
+        for (const double stop : bracket_stops)
+            exposures.push_back(exposure * std::pow(2.0, stop));
+
+        const auto start = steady_clock::now();
+        const std::vector<Frame> frames = camera->bracket(exposures);
+        const auto bracketed = steady_clock::now();
+
+        const size_t middle = frames.size() / 2;
+        Frame frame = frames[middle];
+        const int channels = frame.format == Pixel_format::BAYER ? 1 : 3;
+        std::vector<const unsigned char*> images;
+        {
+            Trace_span span{"register", static_cast<long>(frame.sequence)};
+            if (!bracket_matcher || !bracket_matcher->fits(frame.width,
+                        frame.height, channels))
+                bracket_matcher.reset(new Thumbnail_matcher{frame.width,
+                        frame.height, channels});
+            aligned.resize(frames.size());
+            bracket_shifts.assign(frames.size(), std::make_pair(0, 0));
+            for (size_t i = 0; i < frames.size(); ++i) {
+                images.push_back(frames[i].pixels);
+                if (i == middle)
+                    continue;
+                int dx = 0, dy = 0;
+                bracket_matcher->add(frames[i].pixels, frames[i].pitch,
+                        exposures[middle] / exposures[i]);
+                bracket_matcher->add(frame.pixels, frame.pitch);
+                if (!bracket_matcher->match(dx, dy)) {
+                    std::clog << "camera: " << frame.camera << " "
+                        << "bracket: exposure " << i << " not matched\n";
+                    continue;
+                }
+                bracket_shifts[i] = std::make_pair(dx, dy);
+                if (dx == 0 && dy == 0)
+                    continue;
+                aligned[i].resize(
+                        static_cast<size_t>(frame.pitch) * frame.height);
+                shift_exposure(frames[i].pixels, frame.pixels, frame.width,
+                        frame.height, frame.pitch, channels, dx, dy,
+                        aligned[i].data());
+                images.back() = aligned[i].data();
+            }
+        }
+        fused.resize(static_cast<size_t>(frame.width) * frame.height
+                * channels);
+        {
+            Trace_span span{"fuse", static_cast<long>(frame.sequence)};
+            fusion.fuse(images, frame.width, frame.height, frame.pitch,
+                    channels, fused.data());
+        }
+        bracket_time = bracketed - start;
+        fuse_time = steady_clock::now() - bracketed;
+
+        frame.pixels = fused.data();
+        frame.pitch = frame.width * channels;
+        return frame;
+    }
+
+    // Denoises a frame with the denoiser of its camera, logging the
+    // time taken and the processor time spent on all cores. The frame
+    // returned stays valid until the camera's next frame.
+    Frame denoise(Frame frame)
+    {
+        using namespace std::chrono;
+        Trace_span span{"denoise", static_cast<long>(frame.sequence)};
+        const int channels = frame.format == Pixel_format::BAYER ? 1 : 3;
+        auto& denoiser = denoisers[frame.camera];
+        if (!denoiser || !denoiser->fits(frame.width, frame.height,
+                    channels))
+            denoiser.reset(new Temporal_denoiser{frame.width, frame.height,
+                    channels, denoise_frames});
+
+        const auto start = steady_clock::now();
+        const std::clock_t cpu = std::clock();
+        frame.pixels = denoiser->apply(frame.pixels, frame.pitch);
+        frame.pitch = frame.width * channels;
+        ++denoised;
+
+        std::clog << "camera: " << frame.camera << " "
+            << "denoise: "
+            << duration_cast<milliseconds>(steady_clock::now() - start)
+                .count()
+            << "ms cpu: " << (std::clock() - cpu) * 1000 / CLOCKS_PER_SEC
+            << "ms frames: " << denoiser->frames_averaged() << " "
+            << "shift: " << denoiser->last_shift().first << ","
+            << denoiser->last_shift().second << '\n';
+        return frame;
+    }
+
+    void handle_request()
+    {
+        char request[32];
+        const int size = zmq_recv(socket.get(), request, sizeof(request),
+                ZMQ_DONTWAIT);
+        if (size < 0)
+            return;
+        if (request_hook)
+            request_hook();
+        const std::string command{request,
+            std::min<size_t>(size, sizeof(request))};
+
+        // Any other request asks for a new image.
+        if (command == "stats") {
+            reply(socket.get(), source.stats());
+            std::clog << "...sent stats" << std::endl;
+        } else if (command == "consumers") {
+            reply(socket.get(), captures.stats());
+        } else if (command == "next") {
+            pending = QUEUED;
+            send_queued();
+        } else if (command.compare(0, 4, "get ") == 0) {
+            send_archived(command);
+        } else if (command == "event" && history) {
+            start_event();
+        } else if (command == "history" && history) {
+            reply(socket.get(), history->stats());
+        } else if (command == "mosaic" && mosaic_layout) {
+            send_mosaic();
+        } else if (strip_mode()) {
+            pending = SWATH;
+            send_swath();
+        } else {
+            send_frame();
+        }
+    }
+
+    // Coarsens the background of a frame for the network, keeping the
+    // uniform JPEG for the archive unless it already has its own, and
+    // logs what that saves against sending the whole frame at the
+    // regions' quality.
+    void requantize(const Frame& frame, std::vector<unsigned char>& jpeg,
+            std::vector<unsigned char>& archived)
+    {
+        using namespace std::chrono;
+        Trace_span span{"requantize", static_cast<long>(frame.sequence)};
+        const auto start = steady_clock::now();
+        auto coarse = requantize_jpeg(jpeg.data(), jpeg.size(), regions,
+                background_quality);
+        const size_t uniform = jpeg.size();
+        if (archived.empty())
+            archived = std::move(jpeg);
+        jpeg = std::move(coarse);
+
+        std::clog << "camera: " << frame.camera << " "
+            << "regions: " << regions.size() << " "
+            << "bytes: " << jpeg.size() << " of " << uniform << " "
+            << "saved: " << 100 - 100.0 * jpeg.size() / uniform << "% "
+            << "requantize: "
+            << duration_cast<milliseconds>(steady_clock::now() - start)
+                .count()
+            << "ms\n";
+    }
+
+    // Reads a request on the stream socket and streams the next frame
+    // back. Requests are not told apart; strip mode is not streamed.
+    void handle_stream()
+    {
+        std::vector<std::string> envelope;
+        zmq_msg_t part;
+        zmq_msg_init(&part);
+        bool more = true;
+        while (more && zmq_msg_recv(&part, streamer.get(), ZMQ_DONTWAIT) >= 0) {
+            envelope.emplace_back(static_cast<char*>(zmq_msg_data(&part)),
+                    zmq_msg_size(&part));
+            more = zmq_msg_more(&part);
+        }
+        zmq_msg_close(&part);
+        if (envelope.size() < 2)
+            return;
+        envelope.pop_back();        // the request itself
+        if (request_hook)
+            request_hook();
+        capture(false, &envelope);
+        std::clog << "...streamed image" << std::endl;
+    }
+
+    // Sends one message of a streamed frame to the client with the
+    // envelope while the stream is open. A client that has gone away or
+    // stopped reading loses the rest of the frame: the stream is closed,
+    // and the frame is still encoded for the consumers.
+    void send_stream(const std::vector<std::string>& envelope,
+            const void* data, size_t size, bool& open)
+    {
+        Trace_span span{"send chunk"};
+        for (size_t i = 0; open && i < envelope.size(); ++i)
+            open = send_stream_part(envelope[i].data(), envelope[i].size(),
+                    ZMQ_SNDMORE);
+        if (open)
+            open = send_stream_part(data, size, 0);
+    }
+
+    // Sends a part on the stream socket without blocking the loop for
+    // more than STREAM_WAIT_MS while the client's queue is full. Returns
+    // false, having logged why, if the part could not be sent.
+    bool send_stream_part(const void* data, size_t size, int flags)
+    {
+        using namespace std::chrono;
+        const auto deadline = steady_clock::now()
+            + milliseconds(STREAM_WAIT_MS);
+        while (zmq_send(streamer.get(), data, size, flags | ZMQ_DONTWAIT) < 0) {
+            const int error = zmq_errno();
+            if (error == EAGAIN && steady_clock::now() < deadline) {
+                std::this_thread::sleep_for(milliseconds(1));
+                continue;
+            }
+            std::cerr << "stream: abandoned: "
+                << (error == EAGAIN ? "client not reading"
+                        : zmq_strerror(error))
+                << '\n';
+            return false;
+        }
+        return true;
+    }
+
+    // Encodes a frame while streaming it, and returns the whole JPEG for
+    // the consumers. Logs when the first chunk went out.
+    std::vector<unsigned char> stream_frame(const Frame& frame,
+            const Undistorter* lens, const std::vector<std::string>& envelope)
+    {
+        using namespace std::chrono;
+        const auto start = steady_clock::now();
+        msgpack::sbuffer header;
+        msgpack::pack(header, Telemetry{frame.width, frame.height, {},
+                frame.camera, frame.sequence, frame.timestamp});
+        bool open = true;
+        send_stream(envelope, header.data(), header.size(), open);
+
+        std::vector<unsigned char> jpeg;
+        steady_clock::duration first{};
+        encoder.encode(frame, quality, lens, STREAM_CHUNK,
+                [&](const unsigned char* data, size_t size) {
+            if (jpeg.empty())
+                first = steady_clock::now() - start;
+            send_stream(envelope, data, size, open);
+            jpeg.insert(jpeg.end(), data, data + size);
+        });
+        send_stream(envelope, nullptr, 0, open);
+
+        std::clog << "camera: " << frame.camera << " "
+            << "first chunk: "
+            << duration_cast<milliseconds>(first).count() << "ms "
+            << "streamed: "
+            << duration_cast<milliseconds>(steady_clock::now() - start)
+                .count()
+            << "ms chunks: "
+            << (jpeg.size() + STREAM_CHUNK - 1) / STREAM_CHUNK << '\n';
+        return jpeg;
+    }
+
+    void send_frame()
+    {
+        reply(socket.get(), capture()->telemetry);
+        std::clog << "...sent image" << std::endl;
+    }
+
+    // Captures until it has a frame of each camera of the mosaic,
+    // warping each into the mosaic as it arrives, then encodes the mosaic
+    // once. The cameras are read one after the other, so the two halves
+    // are a frame time apart; the skew is logged. The frames themselves
+    // are published like any other capture, so they are archived,
+    // catalogued and indexed; the mosaic is only sent to the client.
+    void send_mosaic()
+    {
+        using namespace std::chrono;
+        Trace_span span{"mosaic"};
+        const auto start = steady_clock::now();
+        const Homography& layout = *mosaic_layout;
+
+        bool have[2] = {false, false};
+        uint64_t timestamps[2] = {0, 0};
+        unsigned long sequence = 0;
+        J_COLOR_SPACE space = JCS_RGB;
+        for (int i = 0; i < 4 && !(have[0] && have[1]); ++i) {
+            Frame frame;
+            capture(false, nullptr, &frame);
+            const int side = frame.camera == layout.left ? 0
+                : frame.camera == layout.right ? 1 : -1;
+            if (side < 0 || have[side])
+                continue;
+
+            if (!mosaic || !mosaic->fits(frame.width, frame.height)) {
+                mosaic.reset(new Mosaic{layout, frame.width, frame.height,
+                        mosaic_scale});
+                have[0] = have[1] = false;
+            }
+            if (!have[0] && !have[1])
+                mosaic->clear();
+
+            const unsigned char* pixels = frame.pixels;
+            int pitch = frame.pitch;
+            if (frame.format == Pixel_format::BAYER) {
+                mosaic_rgb.resize(
+                        static_cast<size_t>(frame.width) * frame.height * 3);
+                demosaic(frame.pixels, frame.width, frame.height,
+                        frame.pitch, frame.pattern, mosaic_rgb.data());
+                pixels = mosaic_rgb.data();
+                pitch = frame.width * 3;
+            }
+            space = frame.format == Pixel_format::BGR ? JCS_EXT_BGR : JCS_RGB;
+            mosaic->add(side == 1, pixels, pitch);
+            have[side] = true;
+            timestamps[side] = frame.timestamp;
+            if (side == 0)
+                sequence = frame.sequence;
+        }
+        if (!(have[0] && have[1])) {
+            std::cerr << "mosaic: cameras " << layout.left << " and "
+                << layout.right << " not both available\n";
+            send_frame();
+            return;
+        }
+
+        auto jpeg = encode_jpeg(mosaic->result().data(), mosaic->width(),
+                mosaic->height(), space, quality);
+        reply(socket.get(), Telemetry{mosaic->width(), mosaic->height(),
+                std::move(jpeg), Telemetry::MOSAIC_CAMERA, sequence,
+                std::min(timestamps[0], timestamps[1])});
+        std::clog << "...sent mosaic "
+            << duration_cast<milliseconds>(steady_clock::now() - start).count()
+            << "ms skew: "
+            << (std::max(timestamps[0], timestamps[1])
+                    - std::min(timestamps[0], timestamps[1])) / 1000
+            << "ms" << std::endl;
+    }
+
+    // Answers a waiting "next" request if a triggered frame is waiting
+    // in the ring; otherwise the next capture calls this again.
+    void send_queued()
+    {
+        if (pending != QUEUED)
+            return;
+        Capture_ref ref;
+        while (captures.try_read(network, ref)) {
+            if (!ref->triggered)
+                continue;
+            pending = NONE;
+            reply(socket.get(), ref->telemetry);
+            std::clog << "...sent queued image" << std::endl;
+            return;
+        }
+    }
+
+    // Answers "get camera sequence" with that frame, from the ring if it
+    // is still there and from the archive if not. Frames read back from
+    // the archive have no timestamp; the catalogue entry has it. A frame
+    // that cannot be found is answered with an empty image.
+    void send_archived(const std::string& command)
+    {
+        Trace_span span{"get"};
+        std::istringstream fields{command.substr(4)};
+        int camera = 0;
+        unsigned long sequence = 0;
+        fields >> camera >> sequence;
 
-        while (true) {
-            char unused[10];
-            std::clog << "waiting for request..." << std::endl;
-            zmq_recv(socket, unused, 10, 0);
+        Capture_ref ref;
+        for (uint64_t id = newest_capture + 1; id-- > 0
+                && id + RING_SLOTS > newest_capture;) {
+            if (captures.get(id, ref) && ref->telemetry.camera == camera
+                    && ref->telemetry.sequence == sequence) {
+                reply(socket.get(), ref->telemetry);
+                std::clog << "...sent image " << sequence << " from ring"
+                    << std::endl;
+                return;
+            }
+        }
+
+        Telemetry frame{0, 0, {}, camera, sequence, 0};
+        std::ifstream file(archive_path(camera, sequence), std::ios::binary);
+        if (file) {
+            frame.image.assign(std::istreambuf_iterator<char>(file),
+                    std::istreambuf_iterator<char>());
+            try {
+                read_jpeg_size(frame.image.data(), frame.image.size(),
+                        frame.width, frame.height);
+            } catch (Jpeg_exception& e) {
+                std::cerr << "bad archived frame: " << e.what() << '\n';
+                frame.image.clear();
+            }
+        }
+        reply(socket.get(), frame);
+        std::clog << "...sent image " << sequence
+            << (frame.image.empty() ? " (not found)" : " from archive")
+            << std::endl;
+    }
+
+    // Publishes a catalogue entry for every frame it can keep up with.
+    // Scaling in the decoder makes the thumbnail cheap: only an eighth of
+    // each block's coefficients are transformed.
+    void catalogue_frames()
+    {
+        Capture_ref ref;
+        std::vector<unsigned char> pixels;
+        while (captures.read(catalogue_reader, ref)) {
+            const Telemetry& frame = ref->telemetry;
+            Trace_span span{"catalogue", static_cast<long>(frame.sequence)};
+            Catalogue_entry entry{frame.camera, frame.sequence,
+                frame.timestamp, frame.width, frame.height,
+                frame.image.size(), ref->triggered, 0, 0, {}};
+            try {
+                decode_jpeg(frame.image.data(), frame.image.size(), JCS_RGB,
+                        entry.thumbnail_width, entry.thumbnail_height,
+                        pixels, THUMBNAIL_SCALE);
+                entry.thumbnail = encode_jpeg(pixels.data(),
+                        entry.thumbnail_width, entry.thumbnail_height,
+                        JCS_RGB, THUMBNAIL_QUALITY);
+            } catch (Jpeg_exception& e) {
+                std::cerr << "catalogue: " << e.what() << '\n';
+            }
+            ref.reset();
 
-            Telemetry t{3840, 2748, camera.snap()};
             msgpack::sbuffer sbuf;
-            msgpack::pack(sbuf, t);
+            msgpack::pack(sbuf, entry);
+            zmq_send(catalogue.get(), sbuf.data(), sbuf.size(), 0);
+        }
+    }
+
+    // Adds the footprint of a frame to the index if its camera is
+    // calibrated and the track reaches its timestamp.
+    void index_footprint(const Frame& frame)
+    {
+        if (!footprints)
+            return;
+        const auto lens = footprint_lenses.find(frame.camera);
+        Position position;
+        double heading;
+        if (lens == footprint_lenses.end()
+                || !track.locate(frame.timestamp, position, heading))
+            return;
+        Footprint footprint;
+        footprint.camera = frame.camera;
+        footprint.sequence = frame.sequence;
+        if (ground_footprint(lens->second, frame.width, frame.height,
+                    frame.left, frame.top, position, heading, ground,
+                    footprint))
+            footprints->insert(footprint);
+    }
+
+    // Captures a frame, which goes into the history like any other, if
+    // none has gone in for a period. The frame is published, so sequence
+    // numbers seen by the clients stay continuous.
+    void record_history()
+    {
+        using namespace std::chrono;
+        if (strip_mode() || steady_clock::now() - history_added
+                < history_period)
+            return;
+        capture();
+    }
+
+    // Notes the time of an event and freezes its window once the history
+    // has caught up with the end of it.
+    void start_event()
+    {
+        using namespace std::chrono;
+        pending = EVENT;
+        event_time = now_us();
+        loop.add_timer(duration<double>(history_after),
+                [this] { freeze_event(); }, false);
+    }
+
+    // Hands the frames of the event's window to a writer thread, with
+    // the undistortion tables of each if the archive is undistorted.
+    // The tables are shared so that the loop can replace them meanwhile.
+    // The last writer is done with, as it answered the request before
+    // this one.
+    void freeze_event()
+    {
+        const uint64_t before = history_before * 1e6;
+        auto frames = history->freeze(
+                event_time > before ? event_time - before : 0,
+                event_time + static_cast<uint64_t>(history_after * 1e6));
+        std::vector<std::shared_ptr<const Undistorter>> tables;
+        for (const auto& entry : frames)
+            tables.push_back(undistort_archive && undistorter(entry->frame)
+                    ? undistorters[entry->frame.camera] : nullptr);
+        if (event_writer.joinable())
+            event_writer.join();
+        event_writer = std::thread{&Server::write_event, this,
+            std::move(frames), std::move(tables), quality};
+    }
+
+    // Encodes and archives the frames of an event at full resolution, as
+    // they were grabbed, then answers the event request from the loop.
+    void write_event(const std::vector<Frame_history::Entry_ref>& frames,
+            const std::vector<std::shared_ptr<const Undistorter>>& tables,
+            int quality)
+    {
+        using namespace std::chrono;
+        Trace_span span{"event"};
+        const auto start = steady_clock::now();
+        std::vector<Catalogue_entry> entries;
+        std::vector<unsigned char> pixels;
+        unsigned long long bytes = 0;
+        for (size_t i = 0; i < frames.size(); ++i) {
+            Frame frame;
+            try {
+                frame = Frame_history::expand(*frames[i], pixels);
+            } catch (std::runtime_error& e) {
+                std::cerr << "event: " << e.what() << '\n';
+                continue;
+            }
+            const Capture capture{Telemetry{frame.width, frame.height,
+                event_encoder.encode(frame, quality, tables[i].get()),
+                frame.camera, frame.sequence, frame.timestamp}, false, {}};
+            archive(capture);
+            const Telemetry& written = capture.telemetry;
+            entries.push_back(Catalogue_entry{written.camera,
+                    written.sequence, written.timestamp, written.width,
+                    written.height, written.image.size(), false, 0, 0, {}});
+            bytes += written.image.size();
+        }
+        std::clog << "event: " << entries.size() << " frames "
+            << bytes / 1e6 << "MB archived in "
+            << duration_cast<milliseconds>(steady_clock::now() - start)
+                .count()
+            << "ms" << std::endl;
+
+        loop.post([this, entries] {
+            pending = NONE;
+            reply(socket.get(), entries);
+            std::clog << "...sent event" << std::endl;
+        });
+    }
+
+    // Writes every frame to the archive on a thread of its own, so the
+    // disk never stalls the loop unless it falls a whole ring behind.
+    void archive_frames()
+    {
+        Capture_ref ref;
+        while (captures.read(archive_reader, ref))
+            archive(*ref);
+    }
+
+    // Answers a waiting request if a swath is ready; otherwise the next
+    // swath-ready event calls this again.
+    void send_swath()
+    {
+        Swath swath;
+        if (pending != SWATH || !camera->next_swath(swath))
+            return;
+        pending = NONE;
+        reply(socket.get(), camera->encode(swath, quality));
+        std::clog << "...sent swath" << std::endl;
+    }
+
+    void heartbeat()
+    {
+        for (const auto& camera : source.stats())
+            std::clog << "camera: " << camera.id << " "
+                << "frames: " << camera.frames << " "
+                << "retries: " << camera.retries << " "
+                << "dropped: " << camera.dropped << " "
+                << "transfer failures: " << camera.transfer_failures << '\n';
+        const auto workers = thread_pool().take_stats();
+        for (size_t i = 0; i < workers.size(); ++i)
+            std::clog << "worker: " << i << " "
+                << "tasks: " << workers[i].tasks << " "
+                << "steals: " << workers[i].steals << " "
+                << "busy: " << workers[i].utilisation * 100 << "%\n";
+        for (const auto& consumer : captures.stats())
+            std::clog << "consumer: " << consumer.name << " "
+                << "read: " << consumer.read << " "
+                << "dropped: " << consumer.dropped << " "
+                << "lag: " << consumer.lag << '\n';
+        if (history) {
+            const History_stats stats = history->stats();
+            std::clog << "history: " << stats.frames << " frames "
+                << stats.seconds << "s "
+                << "memory: " << stats.bytes / 1e6 << " of "
+                << stats.limit / 1e6 << "MB "
+                << "ratio: " << stats.ratio << " "
+                << "compress: " << stats.compress_rate << "MB/s "
+                << "skipped: " << stats.skipped << " "
+                << "evicted: " << stats.evicted << '\n';
+        }
+    }
+};
+
+// When and how the Scheduler triggers captures; zero disables a
+// trigger.
+struct Schedule {
+    double interval;            // seconds
+    double distance;            // metres
+    std::string position;       // endpoint of the position feed
+    double speed;               // simulated ground speed in m/s
+};
+
+// The Scheduler triggers captures on board so that coverage does not
+// depend on how often the ground station asks: every interval, every
+// so many metres travelled, or both. Triggered frames are archived and
+// queued on the server for delivery with "next" requests. Positions
+// come from a feed publishing msgpack Positions on a PUB socket or, for
+// testing, from a simulator flying due east at a steady speed. Every
+// fix is passed on to the server, which places frames on the ground
+// with them, whether or not distance triggers are set. Each trigger
+// logs the latency from when it was due to the frame timestamp.
+class Scheduler {
+public:
+    static const int SIMULATOR_HZ = 10;
+
+    Scheduler(Event_loop& loop, void* context, Server& server,
+            const Schedule& schedule)
+        : server(server), schedule(schedule), socket{nullptr}, period{0},
+          due{0},
+          have_fix{false}, travelled{schedule.distance}, triggers{0},
+          skipped{0}, total_latency{0}, max_latency{0}
+    {
+        using namespace std::chrono;
+        if (schedule.interval > 0) {
+            period = static_cast<uint64_t>(schedule.interval * 1e6);
+            due = now_us() + period;
+            loop.add_timer(microseconds(period), [this] { tick(); });
+        }
+        if (schedule.position.empty() && schedule.speed <= 0)
+            return;
+
+        if (!schedule.position.empty()) {
+            socket = zmq_socket(context, ZMQ_SUB);
+            zmq_setsockopt(socket, ZMQ_SUBSCRIBE, "", 0);
+            if (zmq_connect(socket, schedule.position.c_str()) != 0) {
+                zmq_close(socket);
+                throw std::runtime_error{"could not connect to position feed "
+                    + schedule.position};
+            }
+            loop.add_socket(socket, [this] { receive(); });
+        } else {
+            // Start over Tucson with the wings level.
+            simulated = Position{32.2319, -110.9501, 1000, now_us()};
+            loop.add_timer(microseconds(1000000 / SIMULATOR_HZ), [this] {
+                simulated = offset(simulated,
+                        this->schedule.speed / SIMULATOR_HZ, 0);
+                simulated.timestamp = now_us();
+                fix(simulated);
+            });
+        }
+    }
+
+    ~Scheduler()
+    {
+        if (socket)
+            zmq_close(socket);
+    }
+
+    // Disallow copying and moving.
+    Scheduler(const Scheduler&) = delete;
+    Scheduler& operator=(const Scheduler&) = delete;
+
+private:
+    Server& server;
+    const Schedule schedule;
+    void* socket;
+
+    uint64_t period;            // interval trigger, microseconds
+    uint64_t due;
+    Position last;
+    Position simulated;
+    bool have_fix;
+    double travelled;           // metres since the last distance trigger
+
+    unsigned long triggers;
+    unsigned long skipped;
+    int64_t total_latency;      // microseconds
+    int64_t max_latency;
+
+    // The loop keeps the timer at a fixed rate, so the trigger was due
+    // at the start plus a whole number of periods.
+    void tick()
+    {
+        const uint64_t now = now_us();
+        const uint64_t when = due;
+        do
+            due += period;
+        while (due <= now);
+        trigger(when);
+    }
+
+    void receive()
+    {
+        zmq_msg_t msg;
+        zmq_msg_init(&msg);
+        while (zmq_msg_recv(&msg, socket, ZMQ_DONTWAIT) >= 0) {
+            try {
+                msgpack::unpacked unpacked;
+                msgpack::unpack(&unpacked,
+                        static_cast<const char*>(zmq_msg_data(&msg)),
+                        zmq_msg_size(&msg));
+                fix(unpacked.get().as<Position>());
+            } catch (std::exception& e) {
+                std::cerr << "bad position: " << e.what() << '\n';
+            }
+        }
+        zmq_msg_close(&msg);
+    }
+
+    // The first fix triggers a capture so coverage starts at once.
+    void fix(const Position& position)
+    {
+        server.add_fix(position);
+        if (have_fix)
+            travelled += ground_distance(last, position);
+        last = position;
+        have_fix = true;
+        if (schedule.distance > 0 && travelled >= schedule.distance) {
+            travelled = std::fmod(travelled, schedule.distance);
+            trigger(now_us());
+        }
+    }
+
+    void trigger(uint64_t when)
+    {
+        // Strip capture owns the cameras.
+        if (server.strip_mode()) {
+            ++skipped;
+            return;
+        }
+
+        const auto frame = server.capture(true);
+        const int64_t latency = static_cast<int64_t>(
+                frame->telemetry.timestamp - when);
+        ++triggers;
+        total_latency += latency;
+        max_latency = std::max(max_latency, latency);
+        std::clog << "trigger: " << triggers << " "
+            << "latency: " << latency / 1000 << "ms "
+            << "(mean: " << total_latency / triggers / 1000 << "ms "
+            << "max: " << max_latency / 1000 << "ms "
+            << "skipped: " << skipped << ")\n";
+    }
+};
+
+// The Controller accepts runtime reconfiguration on its own socket so
+// that it never queues behind image requests. A command is a msgpack
+// map holding any of the keys of Settings; an empty map just reads the
+// settings back. Commands run on the event loop between frames, so the
+// data path never sees a half-applied change. Changing the mode, AOI
+// or cameras while capturing strips restarts strip capture. The extra
+// key "trace" names a file to dump the recorded pipeline spans to.
+// Quality regions are [x, y, width, height] lists in frame pixels. The
+// extra key "covering" takes a [latitude, longitude] point and returns
+// the [camera, sequence] of every indexed frame covering it.
+class Controller {
+public:
+    static const int PORT = Server::PORT + 1;
+
+    Controller(Event_loop& loop, void* context, Server& server,
+            Camera* camera, int port = PORT)
+        : server(server), camera{camera},
+          socket{zmq_socket(context, ZMQ_REP)}
+    {
+        const std::string endpoint = "tcp://*:" + std::to_string(port);
+        if (zmq_bind(socket, endpoint.c_str()) != 0)
+            throw std::runtime_error{"could not bind control socket"};
+        loop.add_socket(socket, [this] { handle_command(); });
+    }
+
+    ~Controller()
+    {
+        zmq_close(socket);
+    }
+
+    // Disallow copying and moving.
+    Controller(const Controller&) = delete;
+    Controller& operator=(const Controller&) = delete;
+
+    // Calls the handler before each command is applied.
+    void on_command(std::function<void()> handler)
+    {
+        command_hook = handler;
+    }
+
+private:
+    Server& server;
+    Camera* const camera;
+    void* const socket;
+    std::function<void()> command_hook;
 
-            zmq_msg_t msg;
-            zmq_msg_init_size(&msg, sbuf.size());
-            memcpy(zmq_msg_data(&msg), sbuf.data(), sbuf.size());
-            zmq_msg_send(&msg, socket, 0);
+    typedef std::map<std::string, msgpack::object> Command;
+
+    void handle_command()
+    {
+        zmq_msg_t msg;
+        zmq_msg_init(&msg);
+        if (zmq_msg_recv(&msg, socket, ZMQ_DONTWAIT) < 0) {
             zmq_msg_close(&msg);
-            std::clog << "...sent image" << std::endl;
+            return;
+        }
+        if (command_hook)
+            command_hook();
+
+        using namespace std::chrono;
+        const auto start = steady_clock::now();
+        Control_reply result{true, "", 0, {}, {}};
+        try {
+            msgpack::unpacked unpacked;
+            msgpack::unpack(&unpacked,
+                    static_cast<const char*>(zmq_msg_data(&msg)),
+                    zmq_msg_size(&msg));
+            apply(unpacked.get().as<Command>(), result);
+        } catch (std::exception& e) {
+            result.ok = false;
+            result.error = e.what();
+        }
+        zmq_msg_close(&msg);
+
+        result.latency_us = duration_cast<microseconds>(
+                steady_clock::now() - start).count();
+        result.settings = settings();
+        reply(socket, result);
+        std::clog << "control: " << (result.ok ? "applied" : result.error)
+            << " in " << result.latency_us << "us" << std::endl;
+    }
+
+    // Numbers may arrive as integers or floats depending on the client.
+    static double number(const msgpack::object& o)
+    {
+        switch (o.type) {
+        case msgpack::type::POSITIVE_INTEGER:
+            return static_cast<double>(o.via.u64);
+        case msgpack::type::NEGATIVE_INTEGER:
+            return static_cast<double>(o.via.i64);
+        default:
+            return o.as<double>();
+        }
+    }
+
+    // Applies a command as a whole. Every value is read and checked
+    // before any is applied, and if the camera then rejects one, the
+    // settings from before the command are put back, so a command that
+    // fails leaves things as they were as far as the driver allows.
+    void apply(const Command& command, Control_reply& result)
+    {
+        static const char* const known[] = {"mode", "exposure",
+            "frame_rate", "quality", "aoi", "cameras", "strip_height",
+            "trace", "regions", "background_quality", "covering"};
+        static const char* const server_side[] = {"quality", "trace",
+            "regions", "background_quality", "covering"};
+        for (const auto& entry : command) {
+            if (std::find(std::begin(known), std::end(known), entry.first)
+                    == std::end(known))
+                throw std::runtime_error{"unknown setting: " + entry.first};
+            if (!camera && std::find(std::begin(server_side),
+                        std::end(server_side), entry.first)
+                    == std::end(server_side))
+                throw std::runtime_error{"no cameras to configure"};
+        }
+
+        auto has = [&](const char* key) { return command.count(key) > 0; };
+        const Settings before = settings();
+        Settings wanted = before;
+        if (has("mode")) {
+            wanted.mode = command.at("mode").as<std::string>();
+            if (wanted.mode != "color" && wanted.mode != "bayer")
+                throw std::runtime_error{"unknown mode: " + wanted.mode};
+        }
+        if (has("aoi")) {
+            wanted.aoi = command.at("aoi").as<std::vector<int>>();
+            if (wanted.aoi.size() != 4)
+                throw std::runtime_error{"aoi needs x, y, width, height"};
+        }
+        if (has("cameras"))
+            wanted.cameras = command.at("cameras").as<std::vector<int>>();
+        if (has("exposure"))
+            wanted.exposure = number(command.at("exposure"));
+        if (has("strip_height"))
+            wanted.strip_height = static_cast<int>(number(
+                        command.at("strip_height"))) & ~1;
+        if (has("frame_rate"))
+            wanted.frame_rate = number(command.at("frame_rate"));
+        if (has("quality"))
+            wanted.quality = static_cast<int>(number(command.at("quality")));
+        if (has("regions")) {
+            wanted.regions = command.at("regions")
+                .as<std::vector<std::vector<int>>>();
+            for (const auto& region : wanted.regions)
+                if (region.size() != 4)
+                    throw std::runtime_error{
+                        "regions need x, y, width, height"};
+        }
+        if (has("background_quality"))
+            wanted.background_quality = static_cast<int>(number(
+                        command.at("background_quality")));
+        const std::string trace = has("trace")
+            ? command.at("trace").as<std::string>() : "";
+        if (has("covering")) {
+            const auto point = command.at("covering")
+                .as<std::vector<msgpack::object>>();
+            if (point.size() != 2)
+                throw std::runtime_error{
+                    "covering needs latitude, longitude"};
+            result.covering = server.covering(number(point[0]),
+                    number(point[1]));
+        }
+
+        try {
+            change(command, before, wanted);
+        } catch (std::exception& e) {
+            std::clog << "control: " << e.what() << ", restoring settings"
+                << std::endl;
+            change(command, wanted, before, true);
+            throw;
+        }
+
+        if (!trace.empty())
+            std::clog << "wrote " << write_trace(trace) << " spans to "
+                << trace << std::endl;
+    }
+
+    // Moves from one set of settings to another, changing those the
+    // command names. When restoring, a setting the driver rejects is
+    // logged and skipped rather than thrown, so that the others are
+    // still put back; strip capture, which a failed command may have
+    // left stopped or running, is stopped first either way.
+    void change(const Command& command, const Settings& from,
+            const Settings& to, bool restoring = false)
+    {
+        auto has = [&](const char* key) { return command.count(key) > 0; };
+        auto step = [&](const char* what, std::function<void()> set) {
+            if (!restoring) {
+                set();
+                return;
+            }
+            try {
+                set();
+            } catch (std::exception& e) {
+                std::clog << "control: could not restore " << what << ": "
+                    << e.what() << std::endl;
+            }
+        };
+
+        const bool restart = (from.strip_height > 0 || restoring)
+            && (has("mode") || has("aoi") || has("cameras"));
+        if (restart)
+            step("strips", [&] { server.set_strips(0); });
+        if (has("mode"))
+            step("mode", [&] {
+                camera->set_mode(to.mode == "bayer"
+                        ? Camera::BAYER : Camera::COLOR);
+            });
+        if (has("aoi"))
+            step("aoi", [&] {
+                camera->set_area(to.aoi[0], to.aoi[1], to.aoi[2], to.aoi[3]);
+                const auto& area = camera->area();
+                server.prepare_undistortion(area.s32X, area.s32Y,
+                        area.s32Width, area.s32Height);
+            });
+        if (has("cameras"))
+            step("cameras", [&] { camera->set_active_cameras(to.cameras); });
+        if (has("exposure"))
+            step("exposure", [&] { camera->set_exposure(to.exposure); });
+        if (restart || has("strip_height"))
+            step("strips", [&] { server.set_strips(to.strip_height); });
+
+        // Strip capture and mode changes replan the bus, which resets
+        // the frame rate to the maximum, so the rate goes last.
+        if (has("frame_rate"))
+            step("frame rate", [&] {
+                camera->set_frame_rate(to.frame_rate);
+            });
+        if (has("quality"))
+            server.set_quality(to.quality);
+        if (has("regions") || has("background_quality")) {
+            std::vector<Jpeg_region> regions;
+            for (const auto& region : to.regions)
+                regions.push_back(Jpeg_region{region[0], region[1],
+                        region[2], region[3]});
+            server.set_quality_regions(regions, to.background_quality);
+        }
+    }
+
+    Settings settings() const
+    {
+        Settings result{"color", 0, 0, server.jpeg_quality(), {}, {}, 0, {},
+            server.background_jpeg_quality()};
+        for (const auto& region : server.quality_regions())
+            result.regions.push_back(
+                    {region.x, region.y, region.width, region.height});
+        if (camera) {
+            const auto& aoi = camera->area();
+            result.mode = camera->get_mode() == Camera::BAYER
+                ? "bayer" : "color";
+            result.exposure = camera->exposure();
+            result.frame_rate = camera->frame_rate();
+            result.aoi = {aoi.s32X, aoi.s32Y, aoi.s32Width, aoi.s32Height};
+            result.cameras = camera->active_cameras();
+            result.strip_height = camera->strip_rows();
+        }
+        return result;
+    }
+};
+
+// CPU time used by the process so far, in seconds.
+double cpu_seconds()
+{
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec
+        + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+// The Power_manager idles the payload while the ground station is out
+// of range. After a period without requests or commands it parks the
+// strip capture threads and turns the cameras down to their lowest
+// pixel clock; after STANDBY_FACTOR such periods it puts them in
+// standby. The next request or command wakes everything before it is
+// served, restoring strip capture, and the wake-up latency is logged.
+// Leaving each state logs the time spent in it and the CPU used, so the
+// saving can be read straight off the log. While the scheduler captures
+// on board, or the server keeps a frame history, the cameras stay at
+// full power and only strips are parked.
+class Power_manager {
+public:
+    static const int STANDBY_FACTOR = 10;
+
+    Power_manager(Event_loop& loop, Server& server, Controller& controller,
+            Camera* camera, double idle_seconds, bool keep_awake)
+        : server(server), camera{camera}, idle{idle_seconds},
+          deepest{keep_awake ? Camera::FULL : Camera::STANDBY},
+          state{ACTIVE}, strip_height{0}, last_activity{Clock::now()},
+          entered{Clock::now()}, cpu_entered{cpu_seconds()}
+    {
+        server.on_request([this] { activity(); });
+        controller.on_command([this] { activity(); });
+        loop.add_timer(std::chrono::seconds(1), [this] { check(); });
+    }
+
+    // Disallow copying and moving.
+    Power_manager(const Power_manager&) = delete;
+    Power_manager& operator=(const Power_manager&) = delete;
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    enum State { ACTIVE, IDLE, STANDBY };
+
+    Server& server;
+    Camera* const camera;
+    const double idle;          // seconds
+    const Camera::Power deepest;
+    State state;
+    int strip_height;           // strip capture to restore on waking
+    Clock::time_point last_activity;
+    Clock::time_point entered;
+    double cpu_entered;
+
+    static const char* name(State state)
+    {
+        static const char* const names[] = {"active", "idle", "standby"};
+        return names[state];
+    }
+
+    void check()
+    {
+        using namespace std::chrono;
+        const double quiet = duration<double>(
+                Clock::now() - last_activity).count();
+        if (state == ACTIVE && quiet >= idle) {
+            enter(IDLE);
+            if (camera) {
+                strip_height = camera->strip_rows();
+                server.set_strips(0);
+                camera->set_power(std::min(deepest, Camera::LOW));
+            }
+        } else if (state == IDLE && quiet >= idle * STANDBY_FACTOR
+                && deepest == Camera::STANDBY) {
+            enter(STANDBY);
+            if (camera)
+                camera->set_power(Camera::STANDBY);
+        }
+    }
+
+    void activity()
+    {
+        using namespace std::chrono;
+        last_activity = Clock::now();
+        if (state == ACTIVE)
+            return;
+
+        const State from = state;
+        enter(ACTIVE);
+        if (camera) {
+            camera->set_power(Camera::FULL);
+            server.set_strips(strip_height);
+        }
+        std::clog << "power: woke from " << name(from) << " in "
+            << duration_cast<microseconds>(
+                    Clock::now() - last_activity).count() / 1000.0
+            << "ms" << std::endl;
+    }
+
+    // Logs how long the current state lasted and the CPU it used.
+    void enter(State next)
+    {
+        using namespace std::chrono;
+        const auto now = Clock::now();
+        const double cpu = cpu_seconds();
+        const double wall = duration<double>(now - entered).count();
+        std::clog << "power: " << name(state) << " for " << wall << "s "
+            << "cpu: " << (wall > 0 ? (cpu - cpu_entered) / wall * 100 : 0)
+            << "%, now " << name(next) << std::endl;
+        state = next;
+        entered = now;
+        cpu_entered = cpu;
+    }
+};
+
+int main(int argc, char* argv[])
+{
+    // Termination signals, and SIGUSR1 asking for a trace dump, are
+    // delivered through the event loop, so they must be blocked before
+    // any thread is started.
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+    Camera::Mode mode = Camera::COLOR;
+    int bus_budget = Camera::BUS_BUDGET;
+    int strip_height = 0;
+    std::string replay;
+    bool synthetic = false;
+    double fps = -1;
+    Schedule schedule{0, 0, "", 0};
+    double idle = 0;
+    int port = Server::PORT;
+    std::string calibration;
+    std::string undistort = "all";
+    std::string homography;
+    int mosaic_scale = 4;
+    std::vector<double> bracket;
+    int denoise = 1;
+    double history = 0;
+    double history_after = 1;
+    double history_rate = 2;
+    double history_memory = 1024;
+    bool history_lz4 = false;
+    bool footprints = false;
+    double ground = 0;
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg{argv[i]};
+        if (arg == "--bayer") {
+            mode = Camera::BAYER;
+        } else if (arg == "--bus-budget" && i+1 < argc) {
+            bus_budget = std::atoi(argv[++i]);
+        } else if (arg == "--strips") {
+            strip_height = Camera::STRIP_HEIGHT;
+        } else if (arg == "--strip-height" && i+1 < argc) {
+            strip_height = std::atoi(argv[++i]) & ~1;
+        } else if (arg == "--replay" && i+1 < argc) {
+            replay = argv[++i];
+        } else if (arg == "--synthetic") {
+            synthetic = true;
+        } else if (arg == "--fps" && i+1 < argc) {
+            fps = std::atof(argv[++i]);
+        } else if (arg == "--interval" && i+1 < argc) {
+            schedule.interval = std::atof(argv[++i]);
+        } else if (arg == "--distance" && i+1 < argc) {
+            schedule.distance = std::atof(argv[++i]);
+        } else if (arg == "--position" && i+1 < argc) {
+            schedule.position = argv[++i];
+        } else if (arg == "--simulate" && i+1 < argc) {
+            schedule.speed = std::atof(argv[++i]);
+        } else if (arg == "--idle" && i+1 < argc) {
+            idle = std::atof(argv[++i]);
+        } else if (arg == "--port" && i+1 < argc) {
+            port = std::atoi(argv[++i]);
+        } else if (arg == "--calibration" && i+1 < argc) {
+            calibration = argv[++i];
+        } else if (arg == "--undistort" && i+1 < argc) {
+            undistort = argv[++i];
+        } else if (arg == "--mosaic" && i+1 < argc) {
+            homography = argv[++i];
+        } else if (arg == "--mosaic-scale" && i+1 < argc) {
+            mosaic_scale = std::atoi(argv[++i]);
+        } else if (arg == "--denoise" && i+1 < argc) {
+            denoise = std::atoi(argv[++i]);
+        } else if (arg == "--history" && i+1 < argc) {
+            history = std::atof(argv[++i]);
+        } else if (arg == "--history-after" && i+1 < argc) {
+            history_after = std::max(0.0, std::atof(argv[++i]));
+        } else if (arg == "--history-rate" && i+1 < argc) {
+            history_rate = std::atof(argv[++i]);
+        } else if (arg == "--history-memory" && i+1 < argc) {
+            history_memory = std::atof(argv[++i]);
+        } else if (arg == "--ground" && i+1 < argc) {
+            footprints = true;
+            ground = std::atof(argv[++i]);
+        } else if (arg == "--history-lz4") {
+            history_lz4 = true;
+        } else if (arg == "--bracket" && i+1 < argc) {
+            std::istringstream stops{argv[++i]};
+            std::string stop;
+            while (std::getline(stops, stop, ','))
+                bracket.push_back(std::atof(stop.c_str()));
+        } else {
+            std::cerr << "usage: " << argv[0]
+                << " [--bayer] [--bus-budget MB/s]"
+                << " [--strips] [--strip-height rows]"
+                << " [--replay dir | --synthetic] [--fps rate]"
+                << " [--interval s] [--distance m]"
+                << " [--position endpoint | --simulate m/s]"
+                << " [--idle s] [--port data]"
+                << " [--calibration file [--undistort network|archive|all]]"
+                << " [--mosaic homography [--mosaic-scale n]]"
+                << " [--bracket stops,...] [--denoise frames]"
+                << " [--history s [--history-after s] [--history-rate fps]"
+                << " [--history-memory MB] [--history-lz4]]"
+                << " [--ground altitude (with --calibration)]\n";
+            return 1;
+        }
+    }
+
+    if (schedule.distance > 0 && schedule.position.empty()
+            && schedule.speed <= 0) {
+        std::cerr << "distance triggers need a position feed or a"
+            " simulated speed\n";
+        return 1;
+    }
+
+    if (bus_budget <= 0) {
+        std::cerr << "the bus budget is a positive number of MB/s\n";
+        return 1;
+    }
+
+    if (undistort != "network" && undistort != "archive"
+            && undistort != "all") {
+        std::cerr << "undistort network, archive or all\n";
+        return 1;
+    }
+
+    if (!replay.empty() && is_archive(replay)) {
+        std::cerr << "cannot replay images/, which is archived into;"
+            " copy the recording elsewhere first\n";
+        return 1;
+    }
+
+    if (strip_height > 0 && (synthetic || !replay.empty())) {
+        std::cerr << "strip mode needs the cameras\n";
+        return 1;
+    }
+
+    if (!bracket.empty() && (bracket.size() < 2
+                || bracket.size() > Exposure_fusion::MAX_EXPOSURES
+                || synthetic || !replay.empty())) {
+        std::cerr << "a bracket is 2 or 3 exposures and needs the cameras\n";
+        return 1;
+    }
+
+    if (footprints && (calibration.empty()
+                || (schedule.position.empty() && schedule.speed <= 0))) {
+        std::cerr << "footprints need a calibration and a position feed or"
+            " a simulated speed\n";
+        return 1;
+    }
+
+    if (history > 0 && (history_rate <= 0 || history_memory <= 0)) {
+        std::cerr << "a history needs a positive rate and memory\n";
+        return 1;
+    }
+
+    if (history_lz4 && !Frame_history::lz4_available()) {
+        std::cerr << "--history-lz4 needs a build with LZ4=1\n";
+        return 1;
+    }
+
+    try {
+        // Frames come from the cameras unless a replay or synthetic
+        // source stands in for them.
+        std::unique_ptr<Frame_source> source;
+        Camera* camera = nullptr;
+        if (!replay.empty()) {
+            source.reset(new Replay_source{replay, fps});
+        } else if (synthetic) {
+            source.reset(new Synthetic_source{Camera::WIDTH, Camera::HEIGHT,
+                    std::max(fps, 0.0)});
+        } else {
+            camera = new Camera{mode, bus_budget};
+            source.reset(camera);
+            camera->initialize();
+        }
+
+        void* context = zmq_ctx_new();
+        Event_loop loop;
+        const int signal_fd = signalfd(-1, &signals, 0);
+        loop.add_fd(signal_fd, [&] {
+            signalfd_siginfo info;
+            ssize_t unused = read(signal_fd, &info, sizeof(info));
+            (void)unused;
+            if (info.ssi_signo == SIGUSR1) {
+                const std::string path = "trace-"
+                    + std::to_string(now_us() / 1000000) + ".json";
+                try {
+                    const size_t spans = write_trace(path);
+                    std::clog << "wrote " << spans << " spans to " << path
+                        << std::endl;
+                } catch (std::runtime_error& e) {
+                    std::cerr << e.what() << std::endl;
+                }
+                return;
+            }
+            std::clog << "shutting down" << std::endl;
+            loop.stop();
+        });
+
+        {
+            Server server{loop, context, *source, camera, strip_height,
+                port};
+            std::map<int, Lens> lenses;
+            if (!calibration.empty()) {
+                lenses = read_calibration(calibration);
+                server.set_undistortion(lenses, undistort != "archive",
+                        undistort != "network");
+                if (camera)
+                    server.prepare_undistortion(camera->area().s32X,
+                            camera->area().s32Y, camera->area().s32Width,
+                            camera->area().s32Height);
+                else if (synthetic)
+                    server.prepare_undistortion(0, 0, Camera::WIDTH,
+                            Camera::HEIGHT);
+            }
+            if (footprints)
+                server.set_footprints(lenses, ground);
+            if (!homography.empty())
+                server.set_mosaic(read_homography(homography), mosaic_scale);
+            server.set_bracket(bracket);
+            server.set_denoise(denoise);
+            if (history > 0)
+                server.set_history(history, history_after, history_memory,
+                        history_lz4, history_rate);
+            Controller controller{loop, context, server, camera, port + 1};
+            Scheduler scheduler{loop, context, server, schedule};
+            std::unique_ptr<Power_manager> power;
+            if (idle > 0)
+                power.reset(new Power_manager{loop, server, controller,
+                        camera, idle,
+                        schedule.interval > 0 || schedule.distance > 0
+                        || history > 0});
+            std::clog << "waiting for requests..." << std::endl;
+            loop.run();
         }
-    } catch (Camera_exception& e) {
+        close(signal_fd);
+        zmq_ctx_destroy(context);
+    } catch (std::runtime_error& e) {
         std::cerr << e.what() << std::endl;
         exit(1);
     }
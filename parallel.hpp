@@ -0,0 +1,265 @@
+#ifndef MOSLEY_PARALLEL_HPP
+#define MOSLEY_PARALLEL_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A work-stealing pool with a worker per core. Each worker keeps its own
+// deque of tasks: tasks submitted from a worker go on its own deque and
+// are run newest first, while tasks submitted from other threads are
+// dealt out in turn. A worker whose deque is empty steals the oldest
+// task of another, so uneven load, such as one camera producing bigger
+// frames than the other, spreads over every core. Idle workers sleep
+// until there is work. Tasks must not throw.
+class Thread_pool {
+public:
+    typedef std::function<void()> Task;
+
+    // Counters for one worker since the last call to take_stats().
+    struct Worker_stats {
+        unsigned long tasks;
+        unsigned long steals;
+        double busy;            // seconds spent running tasks
+        double utilisation;     // busy time over wall time
+    };
+
+    explicit Thread_pool(int threads = std::thread::hardware_concurrency())
+        : queued{0}, stopping{false}, next{0},
+          since{std::chrono::steady_clock::now()}
+    {
+        for (int i = 0; i < std::max(1, threads); ++i)
+            workers.emplace_back(new Worker);
+        for (size_t i = 0; i < workers.size(); ++i)
+            workers[i]->thread = std::thread{&Thread_pool::work, this, i};
+    }
+
+    ~Thread_pool()
+    {
+        {
+            std::lock_guard<std::mutex> lock{sleep_mutex};
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& worker : workers)
+            worker->thread.join();
+    }
+
+    // Disallow copying and moving.
+    Thread_pool(const Thread_pool&) = delete;
+    Thread_pool& operator=(const Thread_pool&) = delete;
+
+    int size() const
+    {
+        return workers.size();
+    }
+
+    void submit(Task task)
+    {
+        const int self = current();
+        Worker& worker = *workers[self >= 0 ? self
+            : next.fetch_add(1, std::memory_order_relaxed) % workers.size()];
+        {
+            std::lock_guard<std::mutex> lock{worker.mutex};
+            worker.tasks.push_back(std::move(task));
+        }
+        {
+            std::lock_guard<std::mutex> lock{sleep_mutex};
+            ++queued;
+        }
+        wake.notify_one();
+    }
+
+    // Runs one pending task on the calling thread, if there is any, so
+    // that a thread waiting for tasks can help instead of blocking.
+    bool run_one()
+    {
+        Task task;
+        const int self = current();
+        if (!(self >= 0 && pop(self, task)) && !steal(self, task))
+            return false;
+        run(self, task);
+        return true;
+    }
+
+    std::vector<Worker_stats> take_stats()
+    {
+        using namespace std::chrono;
+        const auto now = steady_clock::now();
+        std::lock_guard<std::mutex> lock{stats_mutex};
+        const double wall = duration<double>(now - since).count();
+        since = now;
+
+        std::vector<Worker_stats> result;
+        for (const auto& worker : workers) {
+            const double busy = worker->busy_us.exchange(0) / 1e6;
+            result.push_back({worker->run.exchange(0),
+                    worker->stolen.exchange(0), busy,
+                    wall > 0 ? busy / wall : 0});
+        }
+        return result;
+    }
+
+private:
+    struct Worker {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+        std::thread thread;
+        std::atomic<unsigned long> run{0};
+        std::atomic<unsigned long> stolen{0};
+        std::atomic<uint64_t> busy_us{0};
+    };
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::mutex sleep_mutex;
+    std::condition_variable wake;
+    int queued;                 // tasks in all deques, under sleep_mutex
+    bool stopping;
+    std::atomic<unsigned> next;
+
+    std::mutex stats_mutex;
+    std::chrono::steady_clock::time_point since;
+
+    // The index of the calling thread in this pool, or -1.
+    int current() const
+    {
+        return owner() == this ? index() : -1;
+    }
+
+    static const Thread_pool*& owner()
+    {
+        static thread_local const Thread_pool* pool = nullptr;
+        return pool;
+    }
+
+    static int& index()
+    {
+        static thread_local int i = -1;
+        return i;
+    }
+
+    void taken()
+    {
+        std::lock_guard<std::mutex> lock{sleep_mutex};
+        --queued;
+    }
+
+    bool pop(int self, Task& task)
+    {
+        Worker& worker = *workers[self];
+        {
+            std::lock_guard<std::mutex> lock{worker.mutex};
+            if (worker.tasks.empty())
+                return false;
+            task = std::move(worker.tasks.back());
+            worker.tasks.pop_back();
+        }
+        taken();
+        return true;
+    }
+
+    // Takes the oldest task of another worker, starting with the one
+    // after the thief so that thieves spread out.
+    bool steal(int self, Task& task)
+    {
+        const int count = workers.size();
+        for (int i = 1; i <= count; ++i) {
+            const int victim = ((self < 0 ? 0 : self) + i) % count;
+            if (victim == self)
+                continue;
+            Worker& worker = *workers[victim];
+            {
+                std::lock_guard<std::mutex> lock{worker.mutex};
+                if (worker.tasks.empty())
+                    continue;
+                task = std::move(worker.tasks.front());
+                worker.tasks.pop_front();
+            }
+            taken();
+            if (self >= 0)
+                ++workers[self]->stolen;
+            return true;
+        }
+        return false;
+    }
+
+    void run(int self, Task& task)
+    {
+        using namespace std::chrono;
+        const auto start = steady_clock::now();
+        task();
+        if (self >= 0) {
+            Worker& worker = *workers[self];
+            worker.busy_us += duration_cast<microseconds>(
+                    steady_clock::now() - start).count();
+            ++worker.run;
+        }
+    }
+
+    void work(int self)
+    {
+        owner() = this;
+        index() = self;
+        for (;;) {
+            Task task;
+            if (pop(self, task) || steal(self, task)) {
+                run(self, task);
+                continue;
+            }
+            std::unique_lock<std::mutex> lock{sleep_mutex};
+            wake.wait(lock, [this] { return stopping || queued > 0; });
+            if (stopping && queued == 0)
+                return;
+        }
+    }
+};
+
+// The pool shared by all processing stages.
+inline Thread_pool& thread_pool()
+{
+    static Thread_pool pool;
+    return pool;
+}
+
+// Splits [0, count) into contiguous slices and calls fn(begin, end) for
+// each slice on the shared pool, returning once every slice is done.
+// There are a few slices per worker so that a slow or busy core does
+// not hold up the rest. The calling thread runs pending tasks while it
+// waits, so parallel_for may be nested inside pool tasks.
+template<typename Fn>
+void parallel_for(int count, Fn fn)
+{
+    static const int SLICES_PER_WORKER = 4;
+
+    Thread_pool& pool = thread_pool();
+    const int slices = std::max(1,
+            std::min(count, pool.size() * SLICES_PER_WORKER));
+
+    std::mutex mutex;
+    std::condition_variable done;
+    int remaining = slices;
+    for (int i = 0; i < slices; ++i) {
+        const int begin = static_cast<int64_t>(count) * i / slices;
+        const int end = static_cast<int64_t>(count) * (i+1) / slices;
+        pool.submit([&, begin, end] {
+            fn(begin, end);
+            std::lock_guard<std::mutex> lock{mutex};
+            if (--remaining == 0)
+                done.notify_all();
+        });
+    }
+
+    while (pool.run_one()) {}
+    std::unique_lock<std::mutex> lock{mutex};
+    done.wait(lock, [&] { return remaining == 0; });
+}
+
+#endif
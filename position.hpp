@@ -0,0 +1,113 @@
+#ifndef MOSLEY_POSITION_HPP
+#define MOSLEY_POSITION_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <deque>
+#include <msgpack.hpp>
+
+// A position fix from the aircraft's navigation, as published on the
+// position feed.
+struct Position {
+    double latitude;    // degrees
+    double longitude;   // degrees
+    double altitude;    // metres above the ellipsoid
+    uint64_t timestamp; // microseconds since the epoch
+
+    MSGPACK_DEFINE(latitude, longitude, altitude, timestamp);
+};
+
+const double EARTH_RADIUS = 6371000;  // metres, mean
+const double DEGREES = M_PI / 180;
+
+// Ground distance in metres between two nearby fixes. The flat-earth
+// approximation is well within GPS noise over the few hundred metres
+// between consecutive fixes.
+inline double ground_distance(const Position& a, const Position& b)
+{
+    const double lat = (a.latitude + b.latitude) / 2 * DEGREES;
+    const double dx = (b.longitude - a.longitude) * DEGREES * std::cos(lat);
+    const double dy = (b.latitude - a.latitude) * DEGREES;
+    return EARTH_RADIUS * std::sqrt(dx*dx + dy*dy);
+}
+
+// Moves a position the given number of metres east and north.
+inline Position offset(Position p, double east, double north)
+{
+    p.latitude += north / EARTH_RADIUS / DEGREES;
+    p.longitude += east / (EARTH_RADIUS * std::cos(p.latitude * DEGREES))
+        / DEGREES;
+    return p;
+}
+
+// Bearing in degrees clockwise from north from one nearby fix to
+// another, on the same flat-earth approximation.
+inline double bearing(const Position& a, const Position& b)
+{
+    const double lat = (a.latitude + b.latitude) / 2 * DEGREES;
+    const double dx = (b.longitude - a.longitude) * DEGREES * std::cos(lat);
+    const double dy = (b.latitude - a.latitude) * DEGREES;
+    return std::atan2(dx, dy) / DEGREES;
+}
+
+// The recent fixes of the aircraft, for working out where it was when a
+// frame was taken. The feed carries no attitude, so the heading is the
+// track over the ground between fixes.
+class Track {
+public:
+    // How far past the last fix a position is still extrapolated.
+    static const uint64_t STALE_US = 2000000;
+
+    // Keeps the fixes of the last so many seconds.
+    explicit Track(double seconds = 600)
+        : span{static_cast<uint64_t>(seconds * 1e6)}
+    {
+    }
+
+    // Fixes must arrive in time order; any other is ignored.
+    void add(const Position& fix)
+    {
+        if (!fixes.empty() && fix.timestamp <= fixes.back().timestamp)
+            return;
+        fixes.push_back(fix);
+        while (fixes.front().timestamp + span < fix.timestamp)
+            fixes.pop_front();
+    }
+
+    // Interpolates the position and heading at a time in microseconds
+    // since the epoch between the two fixes around it, or extrapolates
+    // them from the nearest two a little way beyond the track. Returns
+    // false if the track does not reach that time.
+    bool locate(uint64_t timestamp, Position& position,
+            double& heading) const
+    {
+        if (fixes.size() < 2 || timestamp + STALE_US < fixes.front().timestamp
+                || timestamp > fixes.back().timestamp + STALE_US)
+            return false;
+        auto next = std::lower_bound(fixes.begin(), fixes.end(), timestamp,
+                [](const Position& fix, uint64_t t) {
+                    return fix.timestamp < t;
+                });
+        if (next == fixes.begin())
+            ++next;
+        else if (next == fixes.end())
+            --next;
+        const Position& a = *(next - 1);
+        const Position& b = *next;
+        const double f = (static_cast<double>(timestamp) - a.timestamp)
+            / (b.timestamp - a.timestamp);
+        position.latitude = a.latitude + f * (b.latitude - a.latitude);
+        position.longitude = a.longitude + f * (b.longitude - a.longitude);
+        position.altitude = a.altitude + f * (b.altitude - a.altitude);
+        position.timestamp = timestamp;
+        heading = bearing(a, b);
+        return true;
+    }
+
+private:
+    const uint64_t span;
+    std::deque<Position> fixes;
+};
+
+#endif
@@ -0,0 +1,354 @@
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
+#include <functional>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <signal.h>
+#include <zmq.h>
+#include "client.hpp"
+#include "frame.hpp"
+#include "jpeg.hpp"
+#include "parallel.hpp"
+
+// The ground-side receiver. It fetches frames from mosley with a few
+// requests in flight, checks that each camera's sequence numbers run
+// on without gaps, decodes the JPEGs on the work-stealing pool,
+// optionally at a reduced DCT scale for quick-look previews, and
+// writes the results on a writer thread of their own so the disk never
+// holds up decoding. Once a second it prints the frame rate and the
+// end-to-end latency from the capture timestamp to each stage, which
+// assumes the aircraft and ground clocks are synchronised (by GPS or
+// NTP).
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Options {
+    std::string endpoint = "tcp://localhost:5555";
+    std::string command = "snap";
+    int window = 4;
+    int scale = 1;              // 1, 2, 4 or 8
+    std::string out;            // directory to write frames to, if any
+    bool jpeg = false;          // write the received JPEGs, not PPMs
+};
+
+// Latency samples in ms for one stage, from the capture timestamp.
+struct Stage {
+    std::vector<double> samples;
+
+    void add(uint64_t timestamp)
+    {
+        samples.push_back(
+                (static_cast<double>(now_us()) - timestamp) / 1000);
+    }
+
+    double percentile(double p)
+    {
+        if (samples.empty())
+            return 0;
+        std::sort(samples.begin(), samples.end());
+        return samples[std::min(samples.size() - 1,
+                static_cast<size_t>(p / 100 * samples.size()))];
+    }
+};
+
+// Counters for one reporting interval, shared by every stage.
+struct Report {
+    unsigned long frames = 0;
+    unsigned long long bytes = 0;
+    unsigned long gaps = 0;         // frames missing from a sequence
+    unsigned long reordered = 0;    // frames older than one seen before
+    unsigned long bad = 0;          // frames that did not decode
+    Stage received;
+    Stage decoded;
+    Stage written;
+};
+
+// Writes files in the order they are handed over. Producers wait while
+// MAX_QUEUED files are pending, so a slow disk slows the pipeline down
+// instead of filling memory.
+class Writer {
+public:
+    static const size_t MAX_QUEUED = 16;
+
+    typedef std::function<void(std::ofstream&)> Contents;
+
+    explicit Writer(std::function<void(uint64_t)> on_written)
+        : on_written{on_written}, running{true}
+    {
+        thread = std::thread{&Writer::run, this};
+    }
+
+    ~Writer()
+    {
+        {
+            std::lock_guard<std::mutex> lock{mutex};
+            running = false;
+        }
+        ready.notify_one();
+        thread.join();
+    }
+
+    // Disallow copying and moving.
+    Writer(const Writer&) = delete;
+    Writer& operator=(const Writer&) = delete;
+
+    void write(const std::string& path, uint64_t timestamp,
+            Contents contents)
+    {
+        std::unique_lock<std::mutex> lock{mutex};
+        space.wait(lock, [this] { return queue.size() < MAX_QUEUED; });
+        queue.push_back(Job{path, timestamp, contents});
+        ready.notify_one();
+    }
+
+private:
+    struct Job {
+        std::string path;
+        uint64_t timestamp;
+        Contents contents;
+    };
+
+    const std::function<void(uint64_t)> on_written;
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::condition_variable space;
+    std::deque<Job> queue;
+    bool running;
+    std::thread thread;
+
+    void run()
+    {
+        for (;;) {
+            Job job;
+            {
+                std::unique_lock<std::mutex> lock{mutex};
+                ready.wait(lock, [this] {
+                    return !running || !queue.empty();
+                });
+                if (queue.empty())
+                    return;
+                job = std::move(queue.front());
+                queue.pop_front();
+            }
+            space.notify_one();
+
+            std::ofstream file(job.path, std::ios::binary);
+            job.contents(file);
+            if (!file)
+                std::cerr << "could not write " << job.path << '\n';
+            on_written(job.timestamp);
+        }
+    }
+};
+
+std::string path(const Options& options, const Client_frame& frame,
+        const char* extension)
+{
+    std::ostringstream name;
+    name << options.out << "/camera-" << frame.camera << "-"
+        << frame.sequence << extension;
+    return name.str();
+}
+
+void print(Report& report, double seconds)
+{
+    std::cout << std::setw(9) << report.frames / seconds
+        << std::setw(9) << report.bytes / seconds / 1e6
+        << std::setw(7) << report.gaps
+        << std::setw(7) << report.reordered
+        << std::setw(6) << report.bad
+        << std::setw(10) << report.received.percentile(50)
+        << std::setw(10) << report.decoded.percentile(50)
+        << std::setw(10) << report.written.percentile(50)
+        << std::setw(10) << report.written.percentile(99) << std::endl;
+}
+
+volatile sig_atomic_t stopping = 0;
+
+void stop(int)
+{
+    stopping = 1;
+}
+
+void usage(const char* name)
+{
+    std::cerr << "usage: " << name << " [--endpoint addr]"
+        << " [--command snap|next] [--window n] [--scale 1|2|4|8]"
+        << " [--out dir [--jpeg]]\n";
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+    Options options;
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg{argv[i]};
+        const bool value = i+1 < argc;
+        if (arg == "--endpoint" && value) {
+            options.endpoint = argv[++i];
+        } else if (arg == "--command" && value) {
+            options.command = argv[++i];
+        } else if (arg == "--window" && value) {
+            options.window = std::atoi(argv[++i]);
+        } else if (arg == "--scale" && value) {
+            options.scale = std::atoi(argv[++i]);
+        } else if (arg == "--out" && value) {
+            options.out = argv[++i];
+        } else if (arg == "--jpeg") {
+            options.jpeg = true;
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (options.scale != 1 && options.scale != 2 && options.scale != 4
+            && options.scale != 8) {
+        usage(argv[0]);
+        return 1;
+    }
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
+
+    std::mutex mutex;
+    Report report;
+    std::map<int, unsigned long> next_sequence;
+    Writer writer{[&](uint64_t timestamp) {
+        std::lock_guard<std::mutex> lock{mutex};
+        report.written.add(timestamp);
+    }};
+
+    // At most a few frames per worker are decoding at once; beyond that
+    // the receiver stops taking frames and the client stops requesting.
+    Thread_pool& pool = thread_pool();
+    const int max_decoding = 2 * pool.size();
+    int decoding = 0;
+    std::condition_variable decoded;
+
+    // Decodes a frame and hands it to the writer. The frame only leaves
+    // the decoding count once it is queued, so that the writer's limit
+    // holds the receiver back as well.
+    auto decode = [&](std::shared_ptr<Client_frame> frame) {
+        auto pixels = std::make_shared<std::vector<unsigned char>>();
+        int width = 0, height = 0;
+        bool ok = true;
+        try {
+            decode_jpeg(frame->image, frame->image_size, JCS_RGB,
+                    width, height, *pixels, options.scale);
+        } catch (Jpeg_exception&) {
+            ok = false;
+        }
+        {
+            std::lock_guard<std::mutex> lock{mutex};
+            if (ok)
+                report.decoded.add(frame->timestamp);
+            else
+                ++report.bad;
+        }
+
+        if (ok && !options.out.empty() && options.jpeg) {
+            writer.write(path(options, *frame, ".jpg"), frame->timestamp,
+                    [frame](std::ofstream& file) {
+                file.write(reinterpret_cast<const char*>(frame->image),
+                        frame->image_size);
+            });
+        } else if (ok && !options.out.empty()) {
+            writer.write(path(options, *frame, ".ppm"), frame->timestamp,
+                    [=](std::ofstream& file) {
+                file << "P6\n" << width << " " << height << "\n255\n";
+                file.write(reinterpret_cast<const char*>(pixels->data()),
+                        pixels->size());
+            });
+        }
+
+        {
+            std::lock_guard<std::mutex> lock{mutex};
+            --decoding;
+        }
+        decoded.notify_one();
+    };
+
+    void* context = zmq_ctx_new();
+    try {
+        Client client{context, options.endpoint, options.window,
+            options.command};
+        std::cout << std::setw(9) << "frames/s" << std::setw(9) << "MB/s"
+            << std::setw(7) << "gaps" << std::setw(7) << "order"
+            << std::setw(6) << "bad" << std::setw(10) << "recv ms"
+            << std::setw(10) << "decode ms" << std::setw(10) << "write ms"
+            << std::setw(10) << "p99 ms" << std::endl;
+
+        auto window = Clock::now();
+        while (!stopping) {
+            Client_frame received;
+            if (client.next(received, 1000)) {
+                std::lock_guard<std::mutex> lock{mutex};
+                ++report.frames;
+                report.bytes += received.image_size;
+                report.received.add(received.timestamp);
+
+                // Sequences run per camera; a "next" stream skips
+                // frames when the link falls behind.
+                auto it = next_sequence.find(received.camera);
+                if (it == next_sequence.end()) {
+                    next_sequence[received.camera] = received.sequence + 1;
+                } else if (received.sequence < it->second) {
+                    ++report.reordered;
+                } else {
+                    report.gaps += received.sequence - it->second;
+                    it->second = received.sequence + 1;
+                }
+            }
+
+            if (received.image) {
+                {
+                    std::unique_lock<std::mutex> lock{mutex};
+                    decoded.wait(lock, [&] {
+                        return decoding < max_decoding;
+                    });
+                    ++decoding;
+                }
+
+                // The pool takes copyable tasks, so share the frame.
+                auto frame = std::make_shared<Client_frame>(
+                        std::move(received));
+                pool.submit([&, frame] { decode(frame); });
+            }
+
+            const auto now = Clock::now();
+            const double elapsed =
+                std::chrono::duration<double>(now - window).count();
+            if (elapsed >= 1) {
+                Report last;
+                {
+                    std::lock_guard<std::mutex> lock{mutex};
+                    std::swap(last, report);
+                }
+                print(last, elapsed);
+                window = now;
+            }
+        }
+
+        // Let the decodes in progress finish before tearing down.
+        std::unique_lock<std::mutex> lock{mutex};
+        decoded.wait(lock, [&] { return decoding == 0; });
+    } catch (std::runtime_error& e) {
+        std::cerr << e.what() << std::endl;
+        zmq_ctx_destroy(context);
+        return 1;
+    }
+    zmq_ctx_destroy(context);
+}
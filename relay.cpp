@@ -0,0 +1,436 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <signal.h>
+#include <sys/signalfd.h>
+#include <unistd.h>
+#include <zmq.h>
+#include <msgpack.hpp>
+#include "client.hpp"
+#include "event_loop.hpp"
+#include "frame.hpp"
+#include "jpeg.hpp"
+#include "parallel.hpp"
+#include "telemetry.hpp"
+
+// A ground-side relay that lets any number of viewers watch without
+// adding load on the aircraft. It keeps a single upstream connection to
+// mosley, fetching frames at a fixed rate however many viewers there
+// are, and serves every viewer from what it has cached: the latest
+// frame of each camera, already packed, a pyramid of smaller versions
+// of it for quick looks, and crops cut from it on demand.
+//
+// Viewers send text requests to the REP socket, the same way they would
+// to mosley:
+//
+//     snap [camera]               the latest frame
+//     level n [camera]            the latest frame at 1/2^n size
+//     crop x y w h [camera]       a full-resolution crop of it
+//     stats                       the relay counters
+//
+// An empty reply means no frame has arrived yet. Every new frame is
+// also published on the PUB socket at the configured pyramid level.
+//
+// To see that the downlink stays flat as viewers are added, point the
+// load generator at the relay:
+//
+//     relay --upstream tcp://aircraft:5555 --rate 5 &
+//     loadgen --endpoint tcp://localhost:5565 --pid $!
+
+namespace {
+
+struct Options {
+    std::string upstream = "tcp://localhost:5555";
+    std::string command = "snap";
+    std::string bind = "tcp://*:5565";
+    std::string publish = "tcp://*:5566";
+    int window = 2;
+    double rate = 0;            // upstream frames/s, 0 for as fast as sent
+    int publish_level = 2;
+    int quality = 85;
+};
+
+// Counters since the relay started, as returned to "stats" requests.
+struct Relay_stats {
+    unsigned long upstream_frames;
+    unsigned long long upstream_bytes;
+    unsigned long replies;
+    unsigned long long reply_bytes;
+    unsigned long published;
+    unsigned long crops_encoded;
+    unsigned long crops_cached;
+    unsigned long upstream_errors;
+
+    MSGPACK_DEFINE(upstream_frames, upstream_bytes, replies, reply_bytes,
+            published, crops_encoded, crops_cached, upstream_errors);
+};
+
+// A frame as cached by the relay. Every level is kept packed, ready to
+// be sent; level 0 is the message exactly as it came from upstream.
+// The decoded pixels stay around while the frame is the latest of its
+// camera, for crops.
+struct Cached_frame {
+    int camera;
+    unsigned long sequence;
+    uint64_t timestamp;
+    int width;
+    int height;
+    std::vector<std::string> levels;
+    std::vector<unsigned char> pixels;
+    std::map<std::string, std::string> crops;
+};
+
+typedef std::shared_ptr<Cached_frame> Cached_ref;
+
+std::string pack(const Telemetry& telemetry)
+{
+    msgpack::sbuffer sbuf;
+    msgpack::pack(sbuf, telemetry);
+    return std::string{sbuf.data(), sbuf.size()};
+}
+
+// Halves an interleaved RGB image by averaging each 2x2 block.
+void halve(const std::vector<unsigned char>& source, int width, int height,
+        std::vector<unsigned char>& result)
+{
+    const int half_width = width / 2;
+    const int half_height = height / 2;
+    result.resize(static_cast<size_t>(half_width) * half_height * 3);
+    for (int y = 0; y < half_height; ++y) {
+        const unsigned char* top = &source[2 * y * width * 3];
+        const unsigned char* bottom = top + width * 3;
+        unsigned char* out = &result[y * half_width * 3];
+        for (int x = 0; x < half_width * 3; x += 3) {
+            for (int c = 0; c < 3; ++c)
+                out[x + c] = (top[2*x + c] + top[2*x + 3 + c]
+                        + bottom[2*x + c] + bottom[2*x + 3 + c] + 2) / 4;
+        }
+    }
+}
+
+class Relay {
+public:
+    static const int LEVELS = 3;            // below the full frame
+    static const size_t MAX_CROPS = 64;     // cached per frame
+    static const int REPORT_SECONDS = 1;
+
+    Relay(Event_loop& loop, void* context, const Options& options)
+        : loop(loop), options(options), stats{}, reported{},
+          socket{zmq_socket(context, ZMQ_REP)},
+          publisher{zmq_socket(context, ZMQ_PUB)},
+          upstream{context, options.upstream, options.window,
+              options.command},
+          running{true}
+    {
+        if (zmq_bind(socket.get(), options.bind.c_str()) != 0)
+            throw std::runtime_error{"could not bind " + options.bind};
+        if (zmq_bind(publisher.get(), options.publish.c_str()) != 0)
+            throw std::runtime_error{"could not bind " + options.publish};
+
+        loop.add_socket(socket.get(), [this] { handle_request(); });
+        loop.add_timer(std::chrono::seconds(REPORT_SECONDS),
+                [this] { report(); });
+        fetcher = std::thread{&Relay::fetch, this};
+    }
+
+    ~Relay()
+    {
+        running = false;
+        fetcher.join();
+    }
+
+    // Disallow copying and moving.
+    Relay(const Relay&) = delete;
+    Relay& operator=(const Relay&) = delete;
+
+private:
+    Event_loop& loop;
+    const Options options;
+    Relay_stats stats;
+    Relay_stats reported;
+    const Zmq_socket socket;
+    const Zmq_socket publisher;
+
+    // Only the loop thread touches these.
+    std::map<int, Cached_ref> latest;   // by camera
+    Cached_ref newest;
+
+    Client upstream;
+    std::atomic<bool> running;
+    std::thread fetcher;
+
+    // Takes frames from upstream at the configured rate and builds the
+    // cached form of each on this thread, so that the loop only ever
+    // swaps in a finished frame. The client keeps the window of requests
+    // in flight meanwhile.
+    void fetch()
+    {
+        using namespace std::chrono;
+        typedef steady_clock Clock;
+        const auto period = options.rate > 0
+            ? duration_cast<Clock::duration>(duration<double>(1 / options.rate))
+            : Clock::duration::zero();
+
+        auto due = Clock::now();
+        while (running) {
+            Client_frame frame;
+            if (!upstream.next(frame, 1000))
+                continue;
+            Cached_ref cached = build(frame);
+            const size_t size = zmq_msg_size(frame.message.get());
+            loop.post([this, cached, size] { add(cached, size); });
+
+            // A late frame does not let the next ones catch up.
+            if (options.rate > 0) {
+                due = std::max(due + period, Clock::now());
+                std::this_thread::sleep_until(due);
+            }
+        }
+    }
+
+    Cached_ref build(const Client_frame& frame)
+    {
+        Cached_ref cached = std::make_shared<Cached_frame>();
+        cached->camera = frame.camera;
+        cached->sequence = frame.sequence;
+        cached->timestamp = frame.timestamp;
+        cached->width = frame.width;
+        cached->height = frame.height;
+        cached->levels.push_back(std::string{
+                static_cast<const char*>(zmq_msg_data(frame.message.get())),
+                zmq_msg_size(frame.message.get())});
+
+        try {
+            decode_jpeg(frame.image, frame.image_size, JCS_RGB,
+                    cached->width, cached->height, cached->pixels);
+        } catch (Jpeg_exception& e) {
+            std::cerr << "could not decode frame: " << e.what() << '\n';
+            return cached;
+        }
+
+        // Each level halves the one above; the halving is cheap next to
+        // encoding, which runs for all the levels at once.
+        std::vector<std::vector<unsigned char>> images(LEVELS);
+        std::vector<int> widths(LEVELS), heights(LEVELS);
+        const std::vector<unsigned char>* above = &cached->pixels;
+        int width = cached->width, height = cached->height;
+        for (int i = 0; i < LEVELS; ++i) {
+            halve(*above, width, height, images[i]);
+            width = widths[i] = width / 2;
+            height = heights[i] = height / 2;
+            above = &images[i];
+        }
+
+        cached->levels.resize(LEVELS + 1);
+        parallel_for(LEVELS, [&](int begin, int end) {
+            for (int i = begin; i < end; ++i)
+                cached->levels[i+1] = pack(Telemetry{widths[i], heights[i],
+                        encode_jpeg(images[i].data(), widths[i], heights[i],
+                                JCS_RGB, options.quality),
+                        cached->camera, cached->sequence,
+                        cached->timestamp});
+        });
+        return cached;
+    }
+
+    void add(Cached_ref cached, size_t size)
+    {
+        ++stats.upstream_frames;
+        stats.upstream_bytes += size;
+
+        // Crops are only cut from the latest frame of a camera, so the
+        // pixels of the one it replaces can go.
+        Cached_ref& slot = latest[cached->camera];
+        if (slot) {
+            std::vector<unsigned char>{}.swap(slot->pixels);
+            slot->crops.clear();
+        }
+        slot = cached;
+        newest = cached;
+
+        const std::string& level = cached->levels[std::min<size_t>(
+                options.publish_level, cached->levels.size() - 1)];
+        zmq_send(publisher.get(), level.data(), level.size(), ZMQ_DONTWAIT);
+        ++stats.published;
+    }
+
+    void handle_request()
+    {
+        char request[64];
+        const int size = zmq_recv(socket.get(), request, sizeof(request),
+                ZMQ_DONTWAIT);
+        if (size < 0)
+            return;
+        std::istringstream words{std::string{request,
+            std::min<size_t>(size, sizeof(request))}};
+        std::string command;
+        words >> command;
+
+        if (command == "stats") {
+            msgpack::sbuffer sbuf;
+            msgpack::pack(sbuf, stats);
+            send(std::string{sbuf.data(), sbuf.size()});
+            return;
+        }
+
+        // Any other request asks for an image.
+        int level = 0;
+        int area[4] = {0, 0, 0, 0};
+        if (command == "level")
+            words >> level;
+        else if (command == "crop")
+            words >> area[0] >> area[1] >> area[2] >> area[3];
+        int camera = -1;
+        words >> camera;
+
+        Cached_ref frame = newest;
+        if (camera >= 0) {
+            const auto it = latest.find(camera);
+            frame = it != latest.end() ? it->second : nullptr;
+        }
+        if (!frame)
+            send("");
+        else if (command == "crop")
+            send(crop(*frame, area[0], area[1], area[2], area[3]));
+        else
+            send(frame->levels[std::min<size_t>(std::max(0, level),
+                        frame->levels.size() - 1)]);
+    }
+
+    // Cuts a crop from the full-resolution frame, clamped to the frame,
+    // or returns it from the cache if another viewer asked for the same
+    // one. Crops are small, so they are encoded on the loop.
+    const std::string& crop(Cached_frame& frame, int x, int y, int width,
+            int height)
+    {
+        if (frame.pixels.empty())
+            return frame.levels[0];
+        x = std::min(std::max(0, x), frame.width - 1);
+        y = std::min(std::max(0, y), frame.height - 1);
+        width = std::min(std::max(1, width), frame.width - x);
+        height = std::min(std::max(1, height), frame.height - y);
+
+        std::ostringstream key;
+        key << x << " " << y << " " << width << " " << height;
+        const auto it = frame.crops.find(key.str());
+        if (it != frame.crops.end()) {
+            ++stats.crops_cached;
+            return it->second;
+        }
+
+        if (frame.crops.size() >= MAX_CROPS)
+            frame.crops.clear();
+        ++stats.crops_encoded;
+        const size_t pitch = frame.width * 3;
+        return frame.crops[key.str()] = pack(Telemetry{width, height,
+                encode_jpeg(&frame.pixels[y * pitch + x * 3], width, height,
+                        JCS_RGB, options.quality, pitch),
+                frame.camera, frame.sequence, frame.timestamp});
+    }
+
+    void send(const std::string& message)
+    {
+        zmq_send(socket.get(), message.data(), message.size(), 0);
+        ++stats.replies;
+        stats.reply_bytes += message.size();
+    }
+
+    // Logs the upstream and downstream rates, which show the relay
+    // keeping the downlink flat however many viewers it serves.
+    void report()
+    {
+        stats.upstream_errors = upstream.error_count();
+        const double seconds = REPORT_SECONDS;
+        std::clog << "upstream: "
+            << (stats.upstream_frames - reported.upstream_frames) / seconds
+            << " frames/s "
+            << (stats.upstream_bytes - reported.upstream_bytes) / seconds / 1e6
+            << " MB/s downstream: "
+            << (stats.replies - reported.replies) / seconds << " replies/s "
+            << (stats.reply_bytes - reported.reply_bytes) / seconds / 1e6
+            << " MB/s published: "
+            << (stats.published - reported.published) / seconds << "/s "
+            << "crops: " << stats.crops_encoded - reported.crops_encoded
+            << " encoded " << stats.crops_cached - reported.crops_cached
+            << " cached\n";
+        reported = stats;
+    }
+};
+
+void usage(const char* name)
+{
+    std::cerr << "usage: " << name << " [--upstream addr]"
+        << " [--command snap|next] [--window n] [--rate frames/s]"
+        << " [--bind addr] [--publish addr] [--publish-level n]"
+        << " [--quality q]\n";
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+    // Termination signals are delivered through the event loop, so they
+    // must be blocked before any thread is started.
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+    Options options;
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg{argv[i]};
+        const bool value = i+1 < argc;
+        if (arg == "--upstream" && value) {
+            options.upstream = argv[++i];
+        } else if (arg == "--command" && value) {
+            options.command = argv[++i];
+        } else if (arg == "--window" && value) {
+            options.window = std::atoi(argv[++i]);
+        } else if (arg == "--rate" && value) {
+            options.rate = std::atof(argv[++i]);
+        } else if (arg == "--bind" && value) {
+            options.bind = argv[++i];
+        } else if (arg == "--publish" && value) {
+            options.publish = argv[++i];
+        } else if (arg == "--publish-level" && value) {
+            options.publish_level = std::atoi(argv[++i]);
+        } else if (arg == "--quality" && value) {
+            options.quality = std::atoi(argv[++i]);
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    void* context = zmq_ctx_new();
+    try {
+        Event_loop loop;
+        const int signal_fd = signalfd(-1, &signals, 0);
+        loop.add_fd(signal_fd, [&] {
+            signalfd_siginfo info;
+            ssize_t unused = read(signal_fd, &info, sizeof(info));
+            (void)unused;
+            loop.stop();
+        });
+        {
+            Relay relay{loop, context, options};
+            std::clog << "relaying " << options.upstream << std::endl;
+            loop.run();
+        }
+        close(signal_fd);
+    } catch (std::runtime_error& e) {
+        std::cerr << e.what() << std::endl;
+        zmq_ctx_destroy(context);
+        return 1;
+    }
+    zmq_ctx_destroy(context);
+}
@@ -0,0 +1,173 @@
+#ifndef MOSLEY_REMAP_HPP
+#define MOSLEY_REMAP_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+#include "parallel.hpp"
+#include "simd.hpp"
+#include "trace.hpp"
+
+namespace remap_detail {
+
+using namespace simd;
+
+// Source positions are kept to 1/16 pixel, which keeps every product
+// of a pixel and its bilinear weight, and their sum, within 16 bits.
+const int FRACTION_BITS = 4;
+const int ONE = 1 << FRACTION_BITS;
+
+// A table entry packs the top-left source pixel and the fractional
+// offset from it into 32 bits: x in bits 0-11, y in bits 12-23 and the
+// x and y fractions in the top two nibbles, which limits sources to
+// 4096 pixels a side.
+const int MAX_SIZE = 1 << 12;
+
+// Remaps one output row. The corners of each lane are gathered one by
+// one, since there is no portable gather, and the weighting of all
+// lanes is done at once.
+inline void remap_row(const unsigned char* source, int pitch,
+        const uint32_t* entries, int width, unsigned char* out)
+{
+    const v8u16 one = v8u16{} + ONE;
+    const v8u16 half = v8u16{} + (1 << (2*FRACTION_BITS - 1));
+
+    for (int x = 0; x < width; x += LANES) {
+        const unsigned char* corners[LANES];
+        uint16_t fractions[2][LANES];
+        for (int i = 0; i < LANES; ++i) {
+            const uint32_t entry = entries[x + i];
+            corners[i] = source + ((entry >> 12) & 0xfff) * pitch
+                + (entry & 0xfff) * 3;
+            fractions[0][i] = (entry >> 24) & 0xf;
+            fractions[1][i] = entry >> 28;
+        }
+        const v8u16 fx = load(fractions[0]);
+        const v8u16 fy = load(fractions[1]);
+        const v8u16 w00 = (one - fx) * (one - fy);
+        const v8u16 w01 = fx * (one - fy);
+        const v8u16 w10 = (one - fx) * fy;
+        const v8u16 w11 = fx * fy;
+
+        const int count = std::min(LANES, width - x);
+        for (int c = 0; c < 3; ++c) {
+            uint16_t p[4][LANES], result[LANES];
+            for (int i = 0; i < LANES; ++i) {
+                p[0][i] = corners[i][c];
+                p[1][i] = corners[i][3 + c];
+                p[2][i] = corners[i][pitch + c];
+                p[3][i] = corners[i][pitch + 3 + c];
+            }
+            store(result, (load(p[0]) * w00 + load(p[1]) * w01
+                        + load(p[2]) * w10 + load(p[3]) * w11 + half)
+                    >> (2*FRACTION_BITS));
+            for (int i = 0; i < count; ++i)
+                out[3*(x + i) + c] = result[i];
+        }
+    }
+}
+
+// Splits a source coordinate into the pixel before it and the
+// fraction of the way to the next, rounded to the table's precision.
+// The pixel is kept one short of the edge so that the next one exists,
+// which leaves the last column and row 1/16 pixel short.
+inline void split(double position, int size, int& pixel, int& fraction)
+{
+    position = std::min(std::max(position, 0.0), size - 1.0);
+    pixel = static_cast<int>(position);
+    fraction = static_cast<int>(std::lround((position - pixel) * ONE));
+    if (fraction == ONE) {
+        ++pixel;
+        fraction = 0;
+    }
+    if (pixel > size - 2) {
+        pixel = size - 2;
+        fraction = ONE - 1;
+    }
+}
+
+} // namespace remap_detail
+
+// A geometric transformation of 3-byte pixels, held as a table giving
+// for every output pixel the point of the source it comes from, in
+// fixed point: 4 bytes per output pixel. Applying it is a bilinear
+// interpolation driven by the table. Points that fall outside the
+// source take the nearest edge pixel.
+class Remap_table {
+public:
+    // Builds the table, calling map(u, v, x, y) to set the source point
+    // (x, y) of each output pixel (u, v). Rows are mapped on all cores.
+    template<typename Map>
+    Remap_table(int width, int height, int source_width, int source_height,
+            Map map)
+        : output_width{width}, output_height{height},
+          padded{(width + remap_detail::LANES - 1)
+              / remap_detail::LANES * remap_detail::LANES},
+          entries(static_cast<size_t>(padded) * height)
+    {
+        using namespace remap_detail;
+        if (source_width < 2 || source_height < 2
+                || source_width > MAX_SIZE || source_height > MAX_SIZE)
+            throw std::runtime_error{"frame size not supported"};
+
+        parallel_for(height, [&](int begin, int end) {
+            for (int v = begin; v < end; ++v) {
+                uint32_t* row = &entries[static_cast<size_t>(v) * padded];
+                for (int u = 0; u < padded; ++u) {
+                    double x, y;
+                    map(std::min(u, width - 1), v, x, y);
+                    int px, py, ax, ay;
+                    split(x, source_width, px, ax);
+                    split(y, source_height, py, ay);
+                    row[u] = px | py << 12 | ax << 24
+                        | static_cast<uint32_t>(ay) << 28;
+                }
+            }
+        });
+    }
+
+    int width() const
+    {
+        return output_width;
+    }
+
+    int height() const
+    {
+        return output_height;
+    }
+
+    // Remaps output row y from a source of 3-byte pixels in any channel
+    // order, which may have a pitch larger than its width.
+    void remap_row(const unsigned char* source, int pitch, int y,
+            unsigned char* out) const
+    {
+        remap_detail::remap_row(source, pitch,
+                &entries[static_cast<size_t>(y) * padded], output_width,
+                out);
+    }
+
+    // Remaps the whole source into a tightly packed buffer, in bands of
+    // rows on all cores.
+    void apply(const unsigned char* source, int pitch,
+            unsigned char* output) const
+    {
+        const int width = output_width;
+        parallel_for(output_height, [=](int begin, int end) {
+            Trace_span span{"remap rows"};
+            for (int y = begin; y < end; ++y)
+                remap_row(source, pitch, y,
+                        output + static_cast<size_t>(y) * width * 3);
+        });
+    }
+
+private:
+    const int output_width;
+    const int output_height;
+    const int padded;
+    std::vector<uint32_t> entries;
+};
+
+#endif
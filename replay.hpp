@@ -0,0 +1,281 @@
+#ifndef MOSLEY_REPLAY_HPP
+#define MOSLEY_REPLAY_HPP
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "frame.hpp"
+
+// The general exception for errors while setting up a replay.
+struct Replay_exception : std::runtime_error {
+    Replay_exception(const std::string& msg) : std::runtime_error{msg} {}
+};
+
+// Replays a directory of recorded JPEGs, such as a copy of the images/
+// directory of an earlier flight, as if the frames came from the
+// cameras. Files are memory mapped and decoded on a background thread a
+// few frames ahead, so that grab() costs no more than a real capture.
+// Frames are paced at a fixed rate or, by default, at the rate they were
+// recorded as given by the file modification times. The recording loops
+// forever, as long as some of it can be decoded.
+class Replay_source : public Frame_source {
+public:
+    static const size_t PREFETCH = 4;
+
+    // A negative frame rate replays at the recorded pace and zero as
+    // fast as frames can be decoded.
+    Replay_source(const std::string& directory, double fps = -1)
+        : fps{fps}, directory{directory}, running{true}, undecodable{false},
+          sequence{0}
+    {
+        list(directory);
+        if (entries.empty())
+            throw Replay_exception{"no images to replay in " + directory};
+        worker = std::thread{&Replay_source::prefetch, this};
+    }
+
+    ~Replay_source()
+    {
+        {
+            std::lock_guard<std::mutex> lock{mutex};
+            running = false;
+        }
+        consumed.notify_all();
+        worker.join();
+    }
+
+    Frame grab() override
+    {
+        {
+            std::unique_lock<std::mutex> lock{mutex};
+            ready.wait(lock, [this] {
+                return !queue.empty() || undecodable;
+            });
+            if (queue.empty())
+                throw Replay_exception{"no image in " + directory
+                    + " could be decoded"};
+            current = std::move(queue.front());
+            queue.pop_front();
+        }
+        consumed.notify_one();
+
+        pace();
+        ++sequence;
+        return Frame{current.camera, counts[current.camera]++, now_us(),
+            current.width, current.height, current.width * 3,
+            Pixel_format::RGB, Bayer_pattern::GRBG, current.pixels.data(),
+            0, 0};
+    }
+
+private:
+    struct Entry {
+        std::string path;
+        int camera;
+        uint64_t recorded;  // modification time in microseconds
+    };
+
+    struct Decoded {
+        int camera;
+        uint64_t recorded;
+        int width;
+        int height;
+        std::vector<unsigned char> pixels;
+    };
+
+    const double fps;
+    const std::string directory;
+    std::vector<Entry> entries;
+
+    std::thread worker;
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::condition_variable consumed;
+    std::deque<Decoded> queue;
+    bool running;
+    bool undecodable;   // a whole pass over the recording decoded nothing
+
+    Decoded current;
+    unsigned long sequence;
+    std::map<int, unsigned long> counts;    // frames per camera
+    std::chrono::steady_clock::time_point start;
+    uint64_t first_recorded;
+    uint64_t last_recorded;
+
+    // Orders file names so that embedded numbers compare by value,
+    // putting camera-1-9.jpg before camera-1-10.jpg. Numbers are compared
+    // as digit strings, so a run of any length is fine: without leading
+    // zeros, the shorter is the smaller, and equal lengths compare
+    // lexically.
+    static bool natural_less(const std::string& a, const std::string& b)
+    {
+        size_t i = 0, j = 0;
+        while (i < a.size() && j < b.size()) {
+            if (std::isdigit(a[i]) && std::isdigit(b[j])) {
+                while (i < a.size() && a[i] == '0') ++i;
+                while (j < b.size() && b[j] == '0') ++j;
+                size_t ei = i, ej = j;
+                while (ei < a.size() && std::isdigit(a[ei])) ++ei;
+                while (ej < b.size() && std::isdigit(b[ej])) ++ej;
+                if (ei - i != ej - j)
+                    return ei - i < ej - j;
+                const int order = a.compare(i, ei - i, b, j, ej - j);
+                if (order != 0)
+                    return order < 0;
+                i = ei;
+                j = ej;
+            } else {
+                if (a[i] != b[j])
+                    return a[i] < b[j];
+                ++i;
+                ++j;
+            }
+        }
+        return a.size() - i < b.size() - j;
+    }
+
+    void list(const std::string& directory)
+    {
+        DIR* dir = opendir(directory.c_str());
+        if (!dir)
+            throw Replay_exception{"could not open " + directory};
+
+        std::vector<std::string> names;
+        while (dirent* entry = readdir(dir)) {
+            const std::string name{entry->d_name};
+            const auto dot = name.rfind('.');
+            if (dot == std::string::npos)
+                continue;
+            std::string ext = name.substr(dot + 1);
+            std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+            if (ext == "jpg" || ext == "jpeg")
+                names.push_back(name);
+        }
+        closedir(dir);
+        std::sort(names.begin(), names.end(), natural_less);
+
+        // Files written by mosley are named camera-<id>-<count>.jpg;
+        // anything else is assigned to the two cameras in turn.
+        for (const auto& name : names) {
+            Entry entry{directory + "/" + name, 0, 0};
+            if (std::sscanf(name.c_str(), "camera-%d-", &entry.camera) != 1)
+                entry.camera = entries.size() % 2 + 1;
+
+            struct stat st;
+            if (stat(entry.path.c_str(), &st) == 0)
+                entry.recorded = static_cast<uint64_t>(st.st_mtim.tv_sec)
+                    * 1000000 + st.st_mtim.tv_nsec / 1000;
+            entries.push_back(entry);
+        }
+
+        // Replay in recording order; the names break ties between files
+        // written within the resolution of the file system clock.
+        std::stable_sort(entries.begin(), entries.end(),
+                [](const Entry& a, const Entry& b) {
+                    return a.recorded < b.recorded;
+                });
+    }
+
+    // Maps and decodes the recording in order, staying PREFETCH frames
+    // ahead of the consumer. Unreadable files are skipped, and if a whole
+    // pass over the recording decodes nothing the worker gives up rather
+    // than spin, and grab() throws.
+    void prefetch()
+    {
+        size_t failures = 0;
+        for (size_t i = 0; ; i = (i+1) % entries.size()) {
+            {
+                std::unique_lock<std::mutex> lock{mutex};
+                consumed.wait(lock, [this] {
+                    return !running || queue.size() < PREFETCH;
+                });
+                if (!running)
+                    return;
+            }
+
+            Decoded decoded{entries[i].camera, entries[i].recorded, 0, 0, {}};
+            if (!load(entries[i].path, decoded)) {
+                if (++failures < entries.size())
+                    continue;
+                {
+                    std::lock_guard<std::mutex> lock{mutex};
+                    undecodable = true;
+                }
+                ready.notify_all();
+                return;
+            }
+            failures = 0;
+
+            {
+                std::lock_guard<std::mutex> lock{mutex};
+                queue.push_back(std::move(decoded));
+            }
+            ready.notify_one();
+        }
+    }
+
+    bool load(const std::string& path, Decoded& decoded)
+    {
+        Trace_span span{"decode"};
+        const int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+
+        struct stat st;
+        void* data = MAP_FAILED;
+        if (fstat(fd, &st) == 0 && st.st_size > 0)
+            data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED)
+            return false;
+        madvise(data, st.st_size, MADV_WILLNEED);
+
+        bool ok = true;
+        try {
+            decode_jpeg(static_cast<const unsigned char*>(data), st.st_size,
+                    JCS_RGB, decoded.width, decoded.height, decoded.pixels);
+        } catch (Jpeg_exception& e) {
+            std::cerr << path << ": " << e.what() << '\n';
+            ok = false;
+        }
+        munmap(data, st.st_size);
+        return ok;
+    }
+
+    // Sleeps until the current frame is due. At the recorded pace the
+    // schedule restarts whenever the recording loops around.
+    void pace()
+    {
+        using namespace std::chrono;
+        const auto now = steady_clock::now();
+
+        if (sequence == 0 || (fps < 0 && current.recorded < last_recorded)) {
+            start = now;
+            first_recorded = current.recorded;
+        } else if (fps > 0) {
+            start += duration_cast<steady_clock::duration>(
+                    duration<double>(1 / fps));
+            std::this_thread::sleep_until(start);
+        } else if (fps < 0) {
+            std::this_thread::sleep_until(start +
+                    microseconds(current.recorded - first_recorded));
+        }
+        last_recorded = current.recorded;
+    }
+};
+
+#endif
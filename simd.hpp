@@ -0,0 +1,36 @@
+#ifndef MOSLEY_SIMD_HPP
+#define MOSLEY_SIMD_HPP
+
+#include <cstdint>
+#include <cstring>
+
+// What the image kernels share to work on vectors of pixels. Eight
+// 16-bit lanes is the natural width of both SSE2 and NEON; the kernels
+// are written against GCC vector extensions so they compile to either
+// without intrinsics.
+namespace simd {
+
+typedef uint16_t v8u16 __attribute__((vector_size(16)));
+typedef int16_t v8i16 __attribute__((vector_size(16)));
+const int LANES = 8;
+
+// Blend weights are out of 128, so a byte times its weight fits in 15
+// bits and a sum of bytes whose weights add up to WEIGHT_ONE in 16.
+const int WEIGHT_BITS = 7;
+const int WEIGHT_ONE = 1 << WEIGHT_BITS;
+
+inline v8u16 load(const uint16_t* p)
+{
+    v8u16 v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+inline void store(uint16_t* p, v8u16 v)
+{
+    std::memcpy(p, &v, sizeof(v));
+}
+
+} // namespace simd
+
+#endif
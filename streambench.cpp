@@ -0,0 +1,191 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <zmq.h>
+#include "link.hpp"
+
+// Compares fetching whole frames from mosley's data socket with having
+// them streamed from its stream socket, over a link with a limited
+// bandwidth and a delay each way. A whole frame can only start across
+// the link once it is fully encoded; a streamed one starts with the
+// first chunk the encoder produces. For each way the time to the first
+// image byte and to the whole frame are printed.
+//
+// For example, against `mosley --synthetic`:
+//
+//     streambench --rate 2 --delay 20
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Options {
+    std::string data = "tcp://localhost:5555";
+    std::string stream = "tcp://localhost:5557";
+    double rate = 2;            // MB/s each way
+    int delay = 20;             // ms each way
+    int frames = 10;
+};
+
+struct Timing {
+    std::vector<double> first;      // ms to the first image byte
+    std::vector<double> total;      // ms to the whole frame
+    unsigned long long bytes = 0;
+};
+
+double milliseconds_since(Clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(
+            Clock::now() - start).count();
+}
+
+// Receives one message, returning its size, or -1 on a timeout.
+int receive(void* socket, zmq_msg_t& message)
+{
+    zmq_pollitem_t item{socket, 0, ZMQ_POLLIN, 0};
+    if (zmq_poll(&item, 1, 10000) <= 0)
+        return -1;
+    return zmq_msg_recv(&message, socket, 0);
+}
+
+// Asks the data socket for whole frames, one at a time.
+void fetch_whole(void* socket, int frames, Timing& timing)
+{
+    zmq_msg_t message;
+    zmq_msg_init(&message);
+    for (int i = 0; i < frames; ++i) {
+        const auto start = Clock::now();
+        zmq_send(socket, "", 0, ZMQ_SNDMORE);
+        zmq_send(socket, "snap", 4, 0);
+
+        // A DEALER sees the empty delimiter of the REP envelope first.
+        if (receive(socket, message) < 0 || receive(socket, message) < 0)
+            throw std::runtime_error{"no reply on the data socket"};
+        const double elapsed = milliseconds_since(start);
+        timing.first.push_back(elapsed);
+        timing.total.push_back(elapsed);
+        timing.bytes += zmq_msg_size(&message);
+    }
+    zmq_msg_close(&message);
+}
+
+// Asks the stream socket for frames, one at a time, each arriving as a
+// header, the JPEG in chunks and an empty message.
+void fetch_streamed(void* socket, int frames, Timing& timing)
+{
+    zmq_msg_t message;
+    zmq_msg_init(&message);
+    for (int i = 0; i < frames; ++i) {
+        const auto start = Clock::now();
+        zmq_send(socket, "stream", 6, 0);
+        if (receive(socket, message) < 0)
+            throw std::runtime_error{"no reply on the stream socket"};
+        timing.bytes += zmq_msg_size(&message);
+
+        bool first = true;
+        for (;;) {
+            const int size = receive(socket, message);
+            if (size < 0)
+                throw std::runtime_error{"stream stopped mid-frame"};
+            if (size == 0)
+                break;
+            if (first)
+                timing.first.push_back(milliseconds_since(start));
+            first = false;
+            timing.bytes += size;
+        }
+        timing.total.push_back(milliseconds_since(start));
+    }
+    zmq_msg_close(&message);
+}
+
+double median(std::vector<double> sample)
+{
+    if (sample.empty())
+        return 0;
+    std::sort(sample.begin(), sample.end());
+    return sample[sample.size() / 2];
+}
+
+void print(const std::string& name, const Timing& timing, int frames)
+{
+    std::cout << std::setw(8) << name
+        << std::setw(12) << median(timing.first)
+        << std::setw(12) << median(timing.total)
+        << std::setw(10) << timing.bytes / 1e6 / frames << std::endl;
+}
+
+void usage(const char* name)
+{
+    std::cerr << "usage: " << name << " [--data addr] [--stream addr]"
+        << " [--rate MB/s] [--delay ms] [--frames n]\n";
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+    Options options;
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg{argv[i]};
+        const bool value = i+1 < argc;
+        if (arg == "--data" && value) {
+            options.data = argv[++i];
+        } else if (arg == "--stream" && value) {
+            options.stream = argv[++i];
+        } else if (arg == "--rate" && value) {
+            options.rate = std::atof(argv[++i]);
+        } else if (arg == "--delay" && value) {
+            options.delay = std::atoi(argv[++i]);
+        } else if (arg == "--frames" && value) {
+            options.frames = std::max(1, std::atoi(argv[++i]));
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    void* context = zmq_ctx_new();
+    try {
+        std::cout << std::setw(8) << "reply" << std::setw(12) << "first ms"
+            << std::setw(12) << "total ms" << std::setw(10) << "MB"
+            << std::endl;
+
+        const struct {
+            const char* name;
+            std::string server;
+            const char* endpoint;
+            void (*fetch)(void*, int, Timing&);
+        } ways[] = {
+            {"whole", options.data, "inproc://whole", fetch_whole},
+            {"stream", options.stream, "inproc://stream", fetch_streamed},
+        };
+        for (const auto& way : ways) {
+            Link_relay relay{context, way.server, options.delay,
+                options.rate * 1e6, way.endpoint};
+            void* socket = zmq_socket(context, ZMQ_DEALER);
+            const int linger = 0;
+            zmq_setsockopt(socket, ZMQ_LINGER, &linger, sizeof(linger));
+            zmq_connect(socket, way.endpoint);
+
+            Timing timing;
+            try {
+                way.fetch(socket, options.frames, timing);
+            } catch (std::runtime_error&) {
+                zmq_close(socket);
+                throw;
+            }
+            zmq_close(socket);
+            print(way.name, timing, options.frames);
+        }
+    } catch (std::runtime_error& e) {
+        std::cerr << e.what() << std::endl;
+        zmq_ctx_destroy(context);
+        return 1;
+    }
+    zmq_ctx_destroy(context);
+}
@@ -0,0 +1,103 @@
+#ifndef MOSLEY_SWATH_HPP
+#define MOSLEY_SWATH_HPP
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <msgpack.hpp>
+#include "telemetry.hpp"
+
+// A continuous along-track image built from consecutive sensor strips,
+// with the device timestamp of every strip in 0.1us ticks. Pixels are
+// stored exactly as the camera delivered them (raw Bayer or BGR).
+struct Swath {
+    int camera;
+    int width;
+    int height;
+    int bytes_per_pixel;
+    std::vector<uint64_t> timestamps;
+    std::vector<unsigned char> pixels;
+};
+
+// The encoded form of a swath as sent to clients.
+struct Swath_telemetry {
+    int camera;
+    int width;
+    int height;
+    std::vector<uint64_t> timestamps;
+    std::vector<unsigned char> image;
+
+    MSGPACK_DEFINE(camera, width, height, timestamps, image);
+};
+
+// Stacks strips from a push-broom capture into swaths of a fixed number
+// of strips. Strips are copied into the swath row by row, dropping any
+// line padding of the capture buffer, so the capture buffer can be
+// handed back to the driver straight away.
+class Swath_assembler {
+public:
+    Swath_assembler(int camera, int width, int strip_height,
+            int bytes_per_pixel, int strips_per_swath)
+        : strip_height{strip_height}, strips_per_swath{strips_per_swath},
+          strips{0}
+    {
+        swath.camera = camera;
+        swath.width = width;
+        swath.height = strip_height * strips_per_swath;
+        swath.bytes_per_pixel = bytes_per_pixel;
+        reset();
+    }
+
+    // Appends a strip and returns true once the swath is complete.
+    bool add(const unsigned char* strip, int pitch, uint64_t timestamp)
+    {
+        const size_t row = static_cast<size_t>(swath.width)
+            * swath.bytes_per_pixel;
+        unsigned char* out = swath.pixels.data()
+            + static_cast<size_t>(strips) * strip_height * row;
+        for (int y = 0; y < strip_height; ++y)
+            std::memcpy(out + y*row, strip + static_cast<size_t>(y)*pitch, row);
+
+        swath.timestamps.push_back(timestamp);
+        return ++strips == strips_per_swath;
+    }
+
+    // Hands over the completed swath and starts a new one.
+    Swath take()
+    {
+        Swath result;
+        std::swap(result, swath);
+        swath.camera = result.camera;
+        swath.width = result.width;
+        swath.height = result.height;
+        swath.bytes_per_pixel = result.bytes_per_pixel;
+        reset();
+        return result;
+    }
+
+    // Drops the strips of the swath so far and returns how many there
+    // were, so that no swath spans a gap between strips.
+    int restart()
+    {
+        const int dropped = strips;
+        reset();
+        return dropped;
+    }
+
+private:
+    const int strip_height;
+    const int strips_per_swath;
+    int strips;
+    Swath swath;
+
+    void reset()
+    {
+        strips = 0;
+        swath.timestamps.clear();
+        swath.timestamps.reserve(strips_per_swath);
+        swath.pixels.resize(static_cast<size_t>(swath.width)
+                * swath.height * swath.bytes_per_pixel);
+    }
+};
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef MOSLEY_SYNTHETIC_HPP
+#define MOSLEY_SYNTHETIC_HPP
+
+#include <chrono>
+#include <random>
+#include <thread>
+#include <vector>
+#include "frame.hpp"
+
+// Produces frames from a generated pattern that scrolls a little with
+// every frame, alternating between two virtual cameras like the real
+// pair. Useful for exercising the server without hardware; the pattern
+// compresses far better than real imagery, so use a Replay_source for
+// encoding or bandwidth figures.
+class Synthetic_source : public Frame_source {
+public:
+    // A frame rate of zero produces frames as fast as they are grabbed.
+    Synthetic_source(int width, int height, double fps = 0)
+        : width{width}, height{height}, fps{fps}, sequence{0},
+          pattern(static_cast<size_t>(width) * height * 2 * 3),
+          next{std::chrono::steady_clock::now()}
+    {
+        // Twice the frame height so any scroll offset is a single view.
+        std::minstd_rand rng{7};
+        unsigned char* p = pattern.data();
+        for (int y = 0; y < 2*height; ++y) {
+            for (int x = 0; x < width; ++x) {
+                *p++ = (x / 16 + y / 16) % 2 ? 200 : 40;
+                *p++ = (x * 255 / width + rng() % 8) & 0xff;
+                *p++ = (y * 255 / (2*height)) & 0xff;
+            }
+        }
+    }
+
+    Frame grab() override
+    {
+        if (fps > 0) {
+            using namespace std::chrono;
+            next += duration_cast<steady_clock::duration>(
+                    duration<double>(1 / fps));
+            std::this_thread::sleep_until(next);
+        }
+
+        const size_t pitch = static_cast<size_t>(width) * 3;
+        const int offset = sequence * 16 % height;
+        Frame frame{static_cast<int>(sequence % 2) + 1, sequence / 2,
+            now_us(), width, height, static_cast<int>(pitch),
+            Pixel_format::BGR, Bayer_pattern::GRBG,
+            pattern.data() + offset * pitch, 0, 0};
+        ++sequence;
+        return frame;
+    }
+
+private:
+    const int width;
+    const int height;
+    const double fps;
+    unsigned long sequence;
+    std::vector<unsigned char> pattern;
+    std::chrono::steady_clock::time_point next;
+};
+
+#endif
@@ -0,0 +1,117 @@
+#ifndef MOSLEY_TELEMETRY_HPP
+#define MOSLEY_TELEMETRY_HPP
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <msgpack.hpp>
+
+// The messages exchanged with clients, shared by the server and the
+// client library.
+
+// Versions of msgpack before 1.0 pack a byte vector as an array of
+// small integers, which costs a call per byte and can only be decoded
+// by copying. Images and thumbnails are packed as a single raw instead,
+// as later versions do, so that clients can decode them in place.
+//
+// This changes the wire format of every reply that carries an image.
+// Clients built against msgpack 0.5 that convert the image with
+// as<std::vector<unsigned char>>() without the unpacker below throw
+// type_error, and Python clients get bytes where they got a list. A
+// server for such clients can be built with `make ARRAY_IMAGES=1`, which
+// keeps the arrays. Clients built with this header accept either form.
+#if !defined(MSGPACK_VERSION_MAJOR) || MSGPACK_VERSION_MAJOR < 1
+namespace msgpack {
+
+#ifndef MOSLEY_ARRAY_IMAGES
+template<typename Stream>
+inline packer<Stream>& operator<<(packer<Stream>& o,
+        const std::vector<unsigned char>& v)
+{
+    o.pack_raw(v.size());
+    o.pack_raw_body(reinterpret_cast<const char*>(v.data()), v.size());
+    return o;
+}
+#endif
+
+inline std::vector<unsigned char>& operator>>(object o,
+        std::vector<unsigned char>& v)
+{
+    if (o.type == type::RAW) {
+        v.assign(o.via.raw.ptr, o.via.raw.ptr + o.via.raw.size);
+    } else if (o.type == type::ARRAY) {
+        v.resize(o.via.array.size);
+        for (uint32_t i = 0; i < o.via.array.size; ++i)
+            v[i] = o.via.array.ptr[i].as<unsigned char>();
+    } else {
+        throw type_error();
+    }
+    return v;
+}
+
+} // namespace msgpack
+#endif
+
+// An encoded frame as sent to clients. The camera, sequence and
+// timestamp come last so that older clients can still unpack the fields
+// they know, as long as they can read the image; see above.
+struct Telemetry {
+    // The camera of a mosaic composed from both cameras.
+    static const int MOSAIC_CAMERA = -1;
+
+    int width;
+    int height;
+    std::vector<unsigned char> image;
+    int camera;
+    unsigned long sequence;
+    uint64_t timestamp;         // capture time, microseconds since the epoch
+
+    MSGPACK_DEFINE(width, height, image, camera, sequence, timestamp);
+};
+
+// A captured frame as listed in the catalogue: a small thumbnail and
+// what a client needs to decide whether to fetch the frame in full with
+// a "get camera sequence" request.
+struct Catalogue_entry {
+    int camera;
+    unsigned long sequence;
+    uint64_t timestamp;         // capture time, microseconds since the epoch
+    int width;
+    int height;
+    unsigned long size;         // bytes of the full JPEG
+    bool triggered;             // by the scheduler rather than a request
+    int thumbnail_width;
+    int thumbnail_height;
+    std::vector<unsigned char> thumbnail;
+
+    MSGPACK_DEFINE(camera, sequence, timestamp, width, height, size,
+            triggered, thumbnail_width, thumbnail_height, thumbnail);
+};
+
+// The current settings, as returned by every control command.
+struct Settings {
+    std::string mode;           // "color" or "bayer"
+    double exposure;            // ms
+    double frame_rate;
+    int quality;
+    std::vector<int> aoi;       // x, y, width, height
+    std::vector<int> cameras;   // active camera ids
+    int strip_height;           // zero when capturing full frames
+    std::vector<std::vector<int>> regions;  // kept at full quality
+    int background_quality;     // elsewhere, when there are regions
+
+    MSGPACK_DEFINE(mode, exposure, frame_rate, quality, aoi, cameras,
+            strip_height, regions, background_quality);
+};
+
+struct Control_reply {
+    bool ok;
+    std::string error;
+    long latency_us;            // time taken to apply the command
+    Settings settings;
+    std::vector<std::vector<uint64_t>> covering;    // [camera, sequence]
+
+    MSGPACK_DEFINE(ok, error, latency_us, settings, covering);
+};
+
+#endif
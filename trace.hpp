@@ -0,0 +1,188 @@
+#ifndef MOSLEY_TRACE_HPP
+#define MOSLEY_TRACE_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Span instrumentation for the frame pipeline. A Trace_span records the
+// time between its construction and destruction into a ring buffer
+// owned by the calling thread, so the hot path takes no locks and
+// allocates nothing; each thread keeps its last Buffer::CAPACITY spans.
+// write_trace() collects every buffer into a Chrome trace JSON file,
+// which chrome://tracing and the Perfetto UI both open, showing where
+// each frame spent its time and how stages overlap across threads.
+namespace trace_detail {
+
+struct Record {
+    const char* name;           // a string literal
+    uint64_t start;             // steady clock, microseconds
+    uint32_t duration;          // microseconds
+    int tid;
+    long frame;                 // frame sequence, negative if unknown
+};
+
+struct Buffer {
+    static const size_t CAPACITY = 4096;
+
+    Record records[CAPACITY];
+    std::atomic<size_t> written{0};
+    bool in_use = false;
+};
+
+// Buffers outlive their threads, so spans from short-lived workers can
+// still be dumped, and are handed on to new threads so their number
+// stays bounded by the most threads alive at once.
+struct Registry {
+    std::mutex mutex;
+    std::vector<std::shared_ptr<Buffer>> buffers;
+};
+
+inline Registry& registry()
+{
+    static Registry instance;
+    return instance;
+}
+
+struct Thread_buffer {
+    std::shared_ptr<Buffer> buffer;
+    const int tid;
+
+    Thread_buffer() : tid{static_cast<int>(syscall(SYS_gettid))}
+    {
+        auto& reg = registry();
+        std::lock_guard<std::mutex> lock{reg.mutex};
+        for (const auto& free : reg.buffers) {
+            if (!free->in_use) {
+                buffer = free;
+                break;
+            }
+        }
+        if (!buffer) {
+            buffer = std::make_shared<Buffer>();
+            reg.buffers.push_back(buffer);
+        }
+        buffer->in_use = true;
+    }
+
+    ~Thread_buffer()
+    {
+        std::lock_guard<std::mutex> lock{registry().mutex};
+        buffer->in_use = false;
+    }
+};
+
+inline uint64_t now()
+{
+    using namespace std::chrono;
+    return duration_cast<microseconds>(
+            steady_clock::now().time_since_epoch()).count();
+}
+
+inline void record(const char* name, uint64_t start, long frame)
+{
+    static thread_local Thread_buffer local;
+    Buffer& buffer = *local.buffer;
+    const size_t i = buffer.written.load(std::memory_order_relaxed);
+    buffer.records[i % Buffer::CAPACITY] = Record{name, start,
+        static_cast<uint32_t>(now() - start), local.tid, frame};
+    buffer.written.store(i + 1, std::memory_order_release);
+}
+
+// Copies the spans of one buffer. A span that its thread may have
+// overwritten during the copy is left out rather than read torn.
+inline void collect(const Buffer& buffer, std::vector<Record>& out)
+{
+    const size_t end = buffer.written.load(std::memory_order_acquire);
+    const size_t begin = end > Buffer::CAPACITY ? end - Buffer::CAPACITY : 0;
+    std::vector<Record> copy;
+    for (size_t i = begin; i < end; ++i)
+        copy.push_back(buffer.records[i % Buffer::CAPACITY]);
+
+    // The thread may already be writing the span after the last one it
+    // published, over the oldest still in the buffer.
+    const size_t after = buffer.written.load(std::memory_order_acquire);
+    const size_t valid = after >= Buffer::CAPACITY
+        ? after - Buffer::CAPACITY + 1 : 0;
+    for (size_t i = std::max(begin, valid); i < end; ++i)
+        out.push_back(copy[i - begin]);
+}
+
+} // namespace trace_detail
+
+// Records the lifetime of a scope as a span named after a string
+// literal, optionally tagged with the sequence number of its frame.
+class Trace_span {
+public:
+    explicit Trace_span(const char* name, long frame = -1)
+        : name{name}, frame{frame}, start{trace_detail::now()}
+    {
+    }
+
+    ~Trace_span()
+    {
+        trace_detail::record(name, start, frame);
+    }
+
+    // Disallow copying and moving.
+    Trace_span(const Trace_span&) = delete;
+    Trace_span& operator=(const Trace_span&) = delete;
+
+    // Tags the span once the frame is known, for example after a grab.
+    void set_frame(long value)
+    {
+        frame = value;
+    }
+
+private:
+    const char* const name;
+    long frame;
+    const uint64_t start;
+};
+
+// Writes the spans recorded so far to a Chrome trace JSON file and
+// returns how many were written.
+inline size_t write_trace(const std::string& path)
+{
+    std::vector<trace_detail::Record> records;
+    {
+        auto& reg = trace_detail::registry();
+        std::lock_guard<std::mutex> lock{reg.mutex};
+        for (const auto& buffer : reg.buffers)
+            trace_detail::collect(*buffer, records);
+    }
+    std::sort(records.begin(), records.end(),
+            [](const trace_detail::Record& a, const trace_detail::Record& b) {
+                return a.start < b.start;
+            });
+
+    std::ofstream file(path);
+    if (!file)
+        throw std::runtime_error{"could not write trace to " + path};
+    const int pid = getpid();
+    file << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    for (size_t i = 0; i < records.size(); ++i) {
+        const auto& r = records[i];
+        file << "{\"name\":\"" << r.name << "\",\"cat\":\"mosley\","
+            << "\"ph\":\"X\",\"ts\":" << r.start << ",\"dur\":" << r.duration
+            << ",\"pid\":" << pid << ",\"tid\":" << r.tid;
+        if (r.frame >= 0)
+            file << ",\"args\":{\"frame\":" << r.frame << "}";
+        file << (i+1 < records.size() ? "},\n" : "}\n");
+    }
+    file << "]}\n";
+    if (!file)
+        throw std::runtime_error{"could not write trace to " + path};
+    return records.size();
+}
+
+#endif
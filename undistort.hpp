@@ -0,0 +1,144 @@
+#ifndef MOSLEY_UNDISTORT_HPP
+#define MOSLEY_UNDISTORT_HPP
+
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include "remap.hpp"
+
+// The Brown-Conrady lens model of one camera, with the coefficients in
+// the order OpenCV's calibration reports them. The intrinsics are in
+// pixels of a frame of the given size.
+struct Lens {
+    int width;
+    int height;
+    double fx, fy, cx, cy;
+    double k1, k2, p1, p2, k3;
+};
+
+// Reads the calibration of each camera from a text file with a line
+//
+//     camera width height fx fy cx cy k1 k2 p1 p2 k3
+//
+// per camera. Blank lines and lines starting with '#' are skipped.
+inline std::map<int, Lens> read_calibration(const std::string& path)
+{
+    std::ifstream file(path);
+    if (!file)
+        throw std::runtime_error{"could not open calibration " + path};
+
+    std::map<int, Lens> lenses;
+    std::string line;
+    while (std::getline(file, line)) {
+        if (line.empty() || line[0] == '#')
+            continue;
+        std::istringstream fields{line};
+        int camera;
+        Lens lens;
+        if (!(fields >> camera >> lens.width >> lens.height >> lens.fx
+                    >> lens.fy >> lens.cx >> lens.cy >> lens.k1 >> lens.k2
+                    >> lens.p1 >> lens.p2 >> lens.k3))
+            throw std::runtime_error{"bad calibration line: " + line};
+        lenses[camera] = lens;
+    }
+    return lenses;
+}
+
+// The intrinsics of a lens for frames of the given size whose top-left
+// pixel lies at (left, top) on the sensor it was calibrated on. An area
+// of interest is a crop, which only moves the centre; frames that do not
+// fit on the sensor from there, such as replays recorded at another
+// resolution, are taken to be scaled instead.
+inline Lens frame_intrinsics(const Lens& lens, int width, int height,
+        int left, int top)
+{
+    Lens result = lens;
+    if (left >= 0 && top >= 0 && left + width <= lens.width
+            && top + height <= lens.height) {
+        result.cx -= left;
+        result.cy -= top;
+    } else {
+        const double sx = static_cast<double>(width) / lens.width;
+        const double sy = static_cast<double>(height) / lens.height;
+        result.fx *= sx;
+        result.cx *= sx;
+        result.fy *= sy;
+        result.cy *= sy;
+    }
+    result.width = width;
+    result.height = height;
+    return result;
+}
+
+// Removes the lens distortion of one camera from frames of a fixed
+// size and place on the sensor. For every output pixel, the point of
+// the distorted frame it comes from is worked out once, when the
+// undistorter is built, so applying it is only a table-driven bilinear
+// interpolation. The output keeps the lens's focal length and centre.
+class Undistorter {
+public:
+    // The lens intrinsics are adjusted to frames with their top-left
+    // pixel at (left, top) on the sensor, as frame_intrinsics() does.
+    Undistorter(const Lens& lens, int width, int height, int left = 0,
+            int top = 0)
+        : table{build(frame_intrinsics(lens, width, height, left, top))},
+          origin{left, top}
+    {
+    }
+
+    // Whether the undistorter was built for frames of this size and
+    // place on the sensor.
+    bool fits(int width, int height, int left, int top) const
+    {
+        return width == table.width() && height == table.height()
+            && left == origin.first && top == origin.second;
+    }
+
+    int width() const
+    {
+        return table.width();
+    }
+
+    int height() const
+    {
+        return table.height();
+    }
+
+    // Undistorts a frame of 3-byte pixels in any channel order, which may
+    // have a pitch larger than its width, into a tightly packed buffer.
+    // Bands of rows are processed on all cores.
+    void apply(const unsigned char* source, int pitch,
+            unsigned char* output) const
+    {
+        table.apply(source, pitch, output);
+    }
+
+private:
+    Remap_table table;
+    std::pair<int, int> origin;
+
+    static Remap_table build(const Lens& lens)
+    {
+        const double focal_x = lens.fx, centre_x = lens.cx;
+        const double focal_y = lens.fy, centre_y = lens.cy;
+        const int width = lens.width, height = lens.height;
+
+        return Remap_table{width, height, width, height,
+            [&](int u, int v, double& x, double& y) {
+                const double xn = (u - centre_x) / focal_x;
+                const double yn = (v - centre_y) / focal_y;
+                const double r2 = xn*xn + yn*yn;
+                const double radial = 1
+                    + r2 * (lens.k1 + r2 * (lens.k2 + r2 * lens.k3));
+                x = focal_x * (xn * radial + 2 * lens.p1 * xn * yn
+                        + lens.p2 * (r2 + 2 * xn*xn)) + centre_x;
+                y = focal_y * (yn * radial + lens.p1 * (r2 + 2 * yn*yn)
+                        + 2 * lens.p2 * xn * yn) + centre_y;
+            }};
+    }
+};
+
+#endif